@@ -0,0 +1,289 @@
+/*
+Program Description: Benchmark driver for smallsh. Every workload is written to a script that
+smallsh runs in script mode, once per process launch backend, and the driver reports:
+
+-Commands per second
+-p50/p99 per-command latency, measured between consecutive lines the shell prints
+-Peak RSS of the shell itself
+
+Usage: bench [shell] [count]
+*/
+
+#define _GNU_SOURCE
+#define DEFAULT_SHELL "./smallsh"
+#define DEFAULT_COUNT 2000
+#define LAUNCHER_ENV "SMALLSH_LAUNCHER"
+#define READ_BUF_SIZE 4096
+#define MAX_PATH_SIZE 4096
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Script repeated count * scale times; each repetition prints one line starting with marker */
+typedef struct workload_t {
+	const char* name;
+	const char* lines;
+	const char* marker;
+	int scale;
+} workload_t;
+
+/* Measurements of one workload run */
+typedef struct result_t {
+	int commands;
+	double seconds;
+	double p50;
+	double p99;
+	long peakRss; // KB
+} result_t;
+
+// status echoes a line after every command that prints nothing by itself; true is a built in,
+// so launches name /bin/true
+const workload_t workloads[] = {
+	{ "true", "/bin/true\nstatus\n", "exit ", 1 },
+	{ "redirect", "/bin/true < in > out\nstatus\n", "exit ", 1 },
+	{ "background", "/bin/true &\n", "background pid is ", 1 },
+	{ "builtin", "cd .\nstatus\n", "exit ", 10 },
+};
+const char* launchers[] = { "spawn", "vfork", "fork", "zygote" };
+
+/*
+ * Function: now
+ * ----------------------------
+ *   Reads the monotonic clock.
+ *
+ *   returns: the time in seconds
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Function: compareDoubles
+ * ----------------------------
+ *   qsort comparator for doubles in ascending order.
+ */
+int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Function: writeScript
+ * ----------------------------
+ *   Writes a workload's script. It ends with a cat reading the driver's pipe, which keeps the
+ *   shell alive until its peak RSS has been read.
+ *
+ *   path: the path of the script to write
+ *   workload: the workload to write
+ *   repeat: the number of times to repeat the workload's lines
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int writeScript(const char* path, const workload_t* workload, int repeat) {
+	FILE* script = fopen(path, "w");
+	if (script == NULL) {
+		perror(path);
+		return -1;
+	}
+	for (int i = 0; i < repeat; i++) {
+		fputs(workload->lines, script);
+	}
+	fputs("cat\n", script);
+	if (fclose(script) == EOF) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: readPeakRss
+ * ----------------------------
+ *   Reads the high water mark of a process's resident set from /proc.
+ *
+ *   pid: the process to read
+ *
+ *   returns: the peak RSS in KB, or -1 if it could not be read
+ */
+long readPeakRss(pid_t pid) {
+	char path[64];
+	char line[256];
+	long peak = -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE* status = fopen(path, "r");
+	if (status == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (sscanf(line, "VmHWM: %ld", &peak) == 1) {
+			break;
+		}
+	}
+	fclose(status);
+	return peak;
+}
+
+/*
+ * Function: runWorkload
+ * ----------------------------
+ *   Runs a workload's script with one launch backend. The shell's stdout is a pipe, and the time
+ *   between consecutive marker lines is the latency of one repetition.
+ *
+ *   shell: the absolute path of smallsh
+ *   dir: the directory holding the scripts, which the shell runs in
+ *   workload: the workload to run
+ *   launcher: the launch backend to select
+ *   repeat: the number of repetitions in the script
+ *   result: filled in with the measurements
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int runWorkload(const char* shell, const char* dir, const workload_t* workload, const char* launcher, int repeat, result_t* result) {
+	char script[MAX_PATH_SIZE];
+	snprintf(script, sizeof(script), "%s/%s.sh", dir, workload->name);
+	if (writeScript(script, workload, repeat) == -1) {
+		return -1;
+	}
+
+	int inPipe[2], outPipe[2];
+	if (pipe2(inPipe, O_CLOEXEC) == -1 || pipe2(outPipe, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	double start = now();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(inPipe[0], STDIN_FILENO);
+		dup2(outPipe[1], STDOUT_FILENO);
+		setenv(LAUNCHER_ENV, launcher, 1);
+		if (chdir(dir) == -1) {
+			perror(dir);
+			_exit(1);
+		}
+		execl(shell, shell, script, (char*)NULL);
+		perror(shell);
+		_exit(127);
+	}
+	close(inPipe[0]);
+	close(outPipe[1]);
+
+	double* latencies = malloc(sizeof(*latencies) * repeat);
+	size_t markerLen = strlen(workload->marker);
+	char buf[READ_BUF_SIZE];
+	size_t len = 0;
+	int count = 0;
+	double last = start;
+	while (count < repeat) {
+		ssize_t n = read(outPipe[0], buf + len, sizeof(buf) - len);
+		if (n <= 0) {
+			break;
+		}
+		double t = now();
+		len += n;
+		char* line = buf;
+		char* newLine;
+		while ((newLine = memchr(line, '\n', buf + len - line)) != NULL) {
+			if (strncmp(line, workload->marker, markerLen) == 0 && count < repeat) {
+				latencies[count++] = t - last;
+				last = t;
+			}
+			line = newLine + 1;
+		}
+		// keep a partial line for the next read, dropping lines too long to matter
+		len = buf + len - line;
+		if (len == sizeof(buf)) {
+			len = 0;
+		}
+		memmove(buf, line, len);
+	}
+	result->peakRss = readPeakRss(pid);
+
+	// let the final cat see EOF, then drain whatever the shell still prints
+	close(inPipe[1]);
+	while (read(outPipe[0], buf, sizeof(buf)) > 0);
+	close(outPipe[0]);
+	int status;
+	struct rusage ru;
+	wait4(pid, &status, 0, &ru);
+
+	if (count < repeat) {
+		fprintf(stderr, "%s/%s: shell stopped after %d of %d commands\n", workload->name, launcher, count, repeat);
+		free(latencies);
+		return -1;
+	}
+	qsort(latencies, count, sizeof(*latencies), compareDoubles);
+	result->commands = count;
+	result->seconds = last - start;
+	result->p50 = latencies[(count - 1) / 2];
+	result->p99 = latencies[(int)((count - 1) * 0.99)];
+	free(latencies);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 3) {
+		fprintf(stderr, "usage: %s [shell] [count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	char shell[PATH_MAX];
+	if (realpath(argc > 1 ? argv[1] : DEFAULT_SHELL, shell) == NULL) {
+		perror(argc > 1 ? argv[1] : DEFAULT_SHELL);
+		return EXIT_FAILURE;
+	}
+	int count = argc > 2 ? atoi(argv[2]) : DEFAULT_COUNT;
+	if (count < 1) {
+		fprintf(stderr, "count must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	char dir[] = "/tmp/smallsh-bench-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	char path[MAX_PATH_SIZE];
+	snprintf(path, sizeof(path), "%s/in", dir);
+	close(open(path, O_WRONLY | O_CREAT, 0644));
+
+	int failures = 0;
+	printf("%-12s %-8s %9s %12s %9s %9s %12s\n", "workload", "launcher", "commands", "commands/s", "p50 us", "p99 us", "peak RSS KB");
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		for (size_t j = 0; j < sizeof(launchers) / sizeof(launchers[0]); j++) {
+			result_t result;
+			if (runWorkload(shell, dir, &workloads[i], launchers[j], count * workloads[i].scale, &result) == -1) {
+				failures++;
+				continue;
+			}
+			printf("%-12s %-8s %9d %12.0f %9.1f %9.1f %12ld\n", workloads[i].name, launchers[j], result.commands,
+				result.commands / result.seconds, result.p50 * 1e6, result.p99 * 1e6, result.peakRss);
+			fflush(stdout);
+		}
+		snprintf(path, sizeof(path), "%s/%s.sh", dir, workloads[i].name);
+		unlink(path);
+	}
+
+	const char* files[] = { "in", "out" };
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,366 @@
+/*
+Program Description: Microbenchmark for the smallsh parser, linked against smallsh.c built with
+SMALLSH_NO_MAIN. For each generated corpus it times:
+
+-parse: createCommand followed by destroyCommand, which includes expanding every word
+-expand: expandCommand on the whole line as one word, followed by resetting the command arena
+-line: buildLine, the way every line takes through the shell before anything runs: parseLine
+ (the plain command fast path, or the parse tree with encoded tokens for lists) and buildCommand
+ for each simple command as runSimple does it
+
+The lists corpus has no parse results, since createCommand only takes a single pipeline.
+
+and reports ns/line and allocations/line. malloc, calloc and realloc are wrapped by the linker
+(-Wl,--wrap) to count allocations. The results are compared with a checked-in baseline and the
+benchmark fails if any of them regressed.
+
+Usage: parser [-u] [-t tolerance] [baseline]
+  -u: write the results to the baseline instead of comparing
+  -t: allowed slowdown factor for ns/line (default 2.0); allocations/line must not grow at all
+*/
+
+#define _GNU_SOURCE
+#define DEFAULT_BASELINE "bench/parser_baseline.txt"
+#define DEFAULT_TOLERANCE 2.0
+#define NUM_RUNS 5 // the fastest run counts
+#define NUM_CORPORA 5
+#define NUM_OPERATIONS 3
+#define MAX_LINE_SIZE 16384
+#define ALLOC_SLACK 0.01
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+#include "../smallsh.h"
+
+/* Generated lines cycled through by the benchmark */
+typedef struct corpus_t {
+	const char* name;
+	char** lines;
+	size_t* lengths;
+	int numLines;
+	int iterations; // lines parsed per run
+	bool lists; // lines are command lists, which createCommand rejects
+} corpus_t;
+
+/* What runCorpus times on each line */
+typedef enum operation_t {
+	OP_PARSE,
+	OP_EXPAND,
+	OP_LINE
+} operation_t;
+
+/* Result of one corpus and operation */
+typedef struct result_t {
+	char name[64];
+	double nsPerLine;
+	double allocsPerLine;
+} result_t;
+
+// smallsh globals the parser depends on
+extern char shellPid[];
+extern size_t shellPidLength;
+extern arena_t commandArena;
+
+// allocations made through the wrapped functions while counting is on
+bool counting = false;
+long numAllocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	numAllocs += counting;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+	numAllocs += counting;
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	numAllocs += counting;
+	return __real_realloc(ptr, size);
+}
+
+/*
+ * Function: addLine
+ * ----------------------------
+ *   Appends a copy of a line to a corpus.
+ *
+ *   corpus: a pointer to the corpus
+ *   line: the line to copy
+ */
+void addLine(corpus_t* corpus, const char* line) {
+	corpus->lines = realloc(corpus->lines, sizeof(*corpus->lines) * (corpus->numLines + 1));
+	corpus->lengths = realloc(corpus->lengths, sizeof(*corpus->lengths) * (corpus->numLines + 1));
+	corpus->lines[corpus->numLines] = strdup(line);
+	corpus->lengths[corpus->numLines] = strlen(line);
+	corpus->numLines++;
+}
+
+/*
+ * Function: buildCorpora
+ * ----------------------------
+ *   Generates the corpora: short command lines, lines with 512 words (MAX_ARGS), lines full of
+ *   $$, lines holding one multi-kilobyte quoted token and lines with lists of commands.
+ *
+ *   corpora: an array of NUM_CORPORA corpora to fill in
+ */
+void buildCorpora(corpus_t* corpora) {
+	static const char* shortLines[] = {
+		"ls -la /tmp",
+		"echo hello world > out.txt",
+		"sort < in.txt > sorted.txt &",
+		"grep -n 'main(' smallsh.c | wc -l",
+		"cd $HOME",
+		"echo \"pid $$ status $?\"",
+		"printf '%s\\n' a\\ b c",
+		"status",
+	};
+	static const char* listLines[] = {
+		"cd /tmp && ls -la; echo done",
+		"test -f out.txt || echo hello world > out.txt; sort < out.txt &",
+		"grep -n 'main(' smallsh.c | wc -l && echo \"pid $$ status $?\" || status",
+		"echo a & echo b & echo c",
+	};
+	char line[MAX_LINE_SIZE];
+	memset(corpora, 0, sizeof(*corpora) * NUM_CORPORA);
+
+	corpora[0].name = "short";
+	corpora[0].iterations = 400000;
+	for (size_t i = 0; i < sizeof(shortLines) / sizeof(shortLines[0]); i++) {
+		addLine(&corpora[0], shortLines[i]);
+	}
+
+	corpora[1].name = "args512";
+	corpora[1].iterations = 4000;
+	size_t len = sprintf(line, "echo");
+	for (int i = 1; i < 512; i++) {
+		len += sprintf(line + len, " arg%d", i);
+	}
+	addLine(&corpora[1], line);
+
+	corpora[2].name = "dollars";
+	corpora[2].iterations = 20000;
+	len = sprintf(line, "echo ");
+	for (int i = 0; i < 1000; i++) {
+		len += sprintf(line + len, "$$");
+	}
+	addLine(&corpora[2], line);
+	len = sprintf(line, "echo");
+	for (int i = 0; i < 500; i++) {
+		len += sprintf(line + len, " $$");
+	}
+	addLine(&corpora[2], line);
+
+	corpora[3].name = "bigtoken";
+	corpora[3].iterations = 20000;
+	len = sprintf(line, "echo \"");
+	for (int i = 0; i < 8192; i++) {
+		line[len++] = i % 1024 == 1023 ? ' ' : 'a' + i % 26;
+	}
+	len += sprintf(line + len, "$HOME\"");
+	addLine(&corpora[3], line);
+	len = sprintf(line, "echo ");
+	memset(line + len, 'x', 8192);
+	line[len + 8192] = '\0';
+	addLine(&corpora[3], line);
+
+	corpora[4].name = "lists";
+	corpora[4].iterations = 200000;
+	corpora[4].lists = true;
+	for (size_t i = 0; i < sizeof(listLines) / sizeof(listLines[0]); i++) {
+		addLine(&corpora[4], listLines[i]);
+	}
+}
+
+/*
+ * Function: now
+ * ----------------------------
+ *   Reads the monotonic clock.
+ *
+ *   returns: the time in nanoseconds
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Function: runCorpus
+ * ----------------------------
+ *   Times one operation over a corpus. Lines are copied into a scratch buffer first since the
+ *   parser modifies them; the copy is part of the measured time.
+ *
+ *   corpus: a pointer to the corpus
+ *   op: the operation to time
+ *   result: filled in with the measurements
+ */
+void runCorpus(const corpus_t* corpus, operation_t op, result_t* result) {
+	static const char* const names[NUM_OPERATIONS] = { "parse", "expand", "line" };
+	static char scratch[MAX_LINE_SIZE];
+	double best = 0;
+	long allocs = 0;
+	for (int run = 0; run < NUM_RUNS; run++) {
+		numAllocs = 0;
+		counting = true;
+		double start = now();
+		for (int i = 0; i < corpus->iterations; i++) {
+			int n = i % corpus->numLines;
+			memcpy(scratch, corpus->lines[n], corpus->lengths[n] + 1);
+			if (op == OP_EXPAND) {
+				expandCommand(scratch, corpus->lengths[n]);
+				arenaReset(&commandArena);
+			}
+			else if (op == OP_LINE) {
+				buildLine(scratch);
+			}
+			else {
+				destroyCommand(createCommand(scratch));
+			}
+		}
+		double elapsed = now() - start;
+		counting = false;
+		if (run == 0 || elapsed < best) {
+			best = elapsed;
+		}
+		// report the largest count, the first run also pays for growing the arena
+		if (run == 0 || numAllocs > allocs) {
+			allocs = numAllocs;
+		}
+	}
+	snprintf(result->name, sizeof(result->name), "%s/%s", corpus->name, names[op]);
+	result->nsPerLine = best / corpus->iterations;
+	result->allocsPerLine = (double)allocs / corpus->iterations;
+}
+
+/*
+ * Function: compareBaseline
+ * ----------------------------
+ *   Compares results with a baseline file of "name ns/line allocs/line" lines.
+ *
+ *   path: the path of the baseline
+ *   results: the results to compare
+ *   numResults: the number of results
+ *   tolerance: the allowed slowdown factor for ns/line
+ *
+ *   returns: the number of regressions, or -1 if the baseline could not be read
+ */
+int compareBaseline(const char* path, const result_t* results, int numResults, double tolerance) {
+	FILE* baseline = fopen(path, "r");
+	if (baseline == NULL) {
+		perror(path);
+		return -1;
+	}
+	int regressions = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), baseline) != NULL) {
+		char name[64];
+		double ns, allocs;
+		if (line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &ns, &allocs) != 3) {
+			continue;
+		}
+		for (int i = 0; i < numResults; i++) {
+			if (strcmp(results[i].name, name) != 0) {
+				continue;
+			}
+			if (results[i].nsPerLine > ns * tolerance) {
+				printf("REGRESSION %s: %.1f ns/line, baseline %.1f\n", name, results[i].nsPerLine, ns);
+				regressions++;
+			}
+			if (results[i].allocsPerLine > allocs + ALLOC_SLACK) {
+				printf("REGRESSION %s: %.3f allocs/line, baseline %.3f\n", name, results[i].allocsPerLine, allocs);
+				regressions++;
+			}
+		}
+	}
+	fclose(baseline);
+	return regressions;
+}
+
+/*
+ * Function: writeBaseline
+ * ----------------------------
+ *   Writes results as the new baseline.
+ *
+ *   path: the path of the baseline
+ *   results: the results to write
+ *   numResults: the number of results
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int writeBaseline(const char* path, const result_t* results, int numResults) {
+	FILE* baseline = fopen(path, "w");
+	if (baseline == NULL) {
+		perror(path);
+		return -1;
+	}
+	fprintf(baseline, "# name ns/line allocs/line, written by bench/parser -u\n");
+	for (int i = 0; i < numResults; i++) {
+		fprintf(baseline, "%s %.1f %.3f\n", results[i].name, results[i].nsPerLine, results[i].allocsPerLine);
+	}
+	return fclose(baseline) == EOF ? -1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+	bool update = false;
+	double tolerance = DEFAULT_TOLERANCE;
+	const char* baselinePath = DEFAULT_BASELINE;
+	int opt;
+	while ((opt = getopt(argc, argv, "ut:")) != -1) {
+		switch (opt) {
+		case 'u':
+			update = true;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-u] [-t tolerance] [baseline]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc) {
+		baselinePath = argv[optind];
+	}
+
+	// expansion reads $$ from the shell's startup state
+	shellPidLength = sprintf(shellPid, "%d", getpid());
+	setenv("HOME", "/home/bench", 1);
+
+	corpus_t corpora[NUM_CORPORA];
+	buildCorpora(corpora);
+	result_t results[NUM_CORPORA * NUM_OPERATIONS];
+	int numResults = 0;
+	printf("%-18s %12s %12s\n", "corpus", "ns/line", "allocs/line");
+	for (int i = 0; i < NUM_CORPORA; i++) {
+		for (operation_t op = OP_PARSE; op < NUM_OPERATIONS; op++) {
+			if (op == OP_PARSE && corpora[i].lists) {
+				continue;
+			}
+			result_t* result = &results[numResults++];
+			runCorpus(&corpora[i], op, result);
+			printf("%-18s %12.1f %12.3f\n", result->name, result->nsPerLine, result->allocsPerLine);
+		}
+	}
+
+	if (update) {
+		return writeBaseline(baselinePath, results, numResults) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	int regressions = compareBaseline(baselinePath, results, numResults, tolerance);
+	if (regressions != 0) {
+		if (regressions > 0) {
+			printf("%d regression(s) against %s\n", regressions, baselinePath);
+		}
+		return EXIT_FAILURE;
+	}
+	printf("no regressions against %s\n", baselinePath);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,385 @@
+/*
+Program Description: Load generator for smallsh's server mode. It starts smallsh --server on a
+socket in a temporary directory, checks that captured output, passed file descriptors and exit
+statuses come back as expected, and then keeps a number of client connections busy with commands,
+reporting:
+
+-Commands per second over all clients
+-p50/p99 request latency, from sending a request to receiving its reply
+-Peak RSS of the server
+
+Usage: server [shell] [clients] [count]
+*/
+
+#define _GNU_SOURCE
+#define DEFAULT_SHELL "./smallsh"
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_COUNT 2000 // requests per client
+#define LOAD_COMMAND "/bin/true"
+#define CONNECT_TRIES 200
+#define MAX_PATH_SIZE 4096
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <signal.h>
+#include "../smallsh.h"
+
+// room for a reply with both streams captured in full
+char replyBuf[sizeof(serverReply_t) + SERVER_CAPTURE_SIZE * 2];
+
+/*
+ * Function: now
+ * ----------------------------
+ *   Reads the monotonic clock.
+ *
+ *   returns: the time in seconds
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Function: compareDoubles
+ * ----------------------------
+ *   qsort comparator for doubles in ascending order.
+ */
+int compareDoubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Function: connectServer
+ * ----------------------------
+ *   Connects to the server, retrying while it starts up.
+ *
+ *   path: the path of the server's socket
+ *
+ *   returns: the connected socket, or -1 if the server did not come up (the error is printed)
+ */
+int connectServer(const char* path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	for (int i = 0; i < CONNECT_TRIES; i++) {
+		int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd != -1 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+		usleep(10000);
+	}
+	perror(path);
+	return -1;
+}
+
+/*
+ * Function: sendRequest
+ * ----------------------------
+ *   Sends a command line to the server, with the file descriptors the flags announce.
+ *
+ *   fd: the connection to send on
+ *   flags: SERVER_* flags
+ *   line: the command line
+ *   fds: the file descriptors to pass
+ *   numFds: the number of file descriptors
+ *
+ *   returns: 0 if successful; -1 otherwise
+ */
+int sendRequest(int fd, uint32_t flags, const char* line, const int* fds, int numFds) {
+	serverRequest_t request = { flags };
+	struct iovec iov[2] = { { &request, sizeof(request) }, { (void*)line, strlen(line) } };
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int) * 3)];
+	} control;
+	struct msghdr msg = { 0 };
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (numFds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/*
+ * Function: readReply
+ * ----------------------------
+ *   Reads a reply into replyBuf.
+ *
+ *   fd: the connection to read from
+ *
+ *   returns: a pointer to the reply header, or NULL if the connection failed
+ */
+serverReply_t* readReply(int fd) {
+	ssize_t n = recv(fd, replyBuf, sizeof(replyBuf), 0);
+	if (n < (ssize_t)sizeof(serverReply_t)) {
+		return NULL;
+	}
+	return (serverReply_t*)replyBuf;
+}
+
+/*
+ * Function: check
+ * ----------------------------
+ *   Runs one request and compares its exit value and captured stdout with the expected ones.
+ *
+ *   fd: the connection to use
+ *   flags: SERVER_* flags
+ *   line: the command line
+ *   fds: the file descriptors to pass
+ *   numFds: the number of file descriptors
+ *   exitValue: the expected exit value
+ *   out: the expected stdout, or NULL to skip comparing it
+ *
+ *   returns: true if the reply matched; false otherwise (the mismatch is printed)
+ */
+bool check(int fd, uint32_t flags, const char* line, const int* fds, int numFds, int exitValue, const char* out) {
+	serverReply_t* reply = NULL;
+	if (sendRequest(fd, flags, line, fds, numFds) == 0) {
+		reply = readReply(fd);
+	}
+	if (reply == NULL) {
+		fprintf(stderr, "check %s: no reply\n", line);
+		return false;
+	}
+	const char* captured = replyBuf + sizeof(*reply);
+	if (!WIFEXITED(reply->status) || WEXITSTATUS(reply->status) != exitValue) {
+		fprintf(stderr, "check %s: status %#x, expected exit value %d\n", line, reply->status, exitValue);
+		return false;
+	}
+	if (out != NULL && (reply->outLength != strlen(out) || memcmp(captured, out, reply->outLength) != 0)) {
+		fprintf(stderr, "check %s: stdout %.*s, expected %s\n", line, (int)reply->outLength, captured, out);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Function: runChecks
+ * ----------------------------
+ *   Checks capture, fd passing, pipelines, exit values and failed launches.
+ *
+ *   fd: the connection to use
+ *   dir: a scratch directory
+ *
+ *   returns: the number of failed checks
+ */
+int runChecks(int fd, const char* dir) {
+	int failures = 0;
+	failures += !check(fd, SERVER_CAPTURE, "echo hello $$", NULL, 0, 0, NULL);
+	failures += !check(fd, SERVER_CAPTURE, "/bin/echo one two", NULL, 0, 0, "one two\n");
+	failures += !check(fd, SERVER_CAPTURE, "printf '%s\\n' a b c | /usr/bin/tr a-z A-Z", NULL, 0, 0, "A\nB\nC\n");
+	failures += !check(fd, SERVER_CAPTURE, "/bin/sh -c 'exit 3'", NULL, 0, 3, "");
+	failures += !check(fd, SERVER_CAPTURE, "nosuchcommand", NULL, 0, 1, "");
+
+	// the client's own stdin and stdout
+	char inPath[MAX_PATH_SIZE], outPath[MAX_PATH_SIZE];
+	snprintf(inPath, sizeof(inPath), "%s/in", dir);
+	snprintf(outPath, sizeof(outPath), "%s/out", dir);
+	int fds[2];
+	fds[0] = open(inPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	fds[1] = open(outPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	write(fds[0], "passed\n", 7);
+	lseek(fds[0], 0, SEEK_SET);
+	failures += !check(fd, SERVER_STDIN | SERVER_STDOUT | SERVER_CAPTURE, "cat", fds, 2, 0, "");
+	char buf[16] = { 0 };
+	if (pread(fds[1], buf, sizeof(buf) - 1, 0) != 7 || strcmp(buf, "passed\n") != 0) {
+		fprintf(stderr, "check cat: passed stdout holds %s\n", buf);
+		failures++;
+	}
+	close(fds[0]);
+	close(fds[1]);
+	unlink(inPath);
+	unlink(outPath);
+
+	// output past the capture limit is dropped, and the command still finishes
+	serverReply_t* reply = NULL;
+	if (sendRequest(fd, SERVER_CAPTURE, "/usr/bin/seq 100000", NULL, 0) == 0) {
+		reply = readReply(fd);
+	}
+	if (reply == NULL || !reply->truncated || reply->outLength != SERVER_CAPTURE_SIZE || reply->status != 0) {
+		fprintf(stderr, "check seq: output was not truncated\n");
+		failures++;
+	}
+	return failures;
+}
+
+/*
+ * Function: runLoad
+ * ----------------------------
+ *   Keeps a number of connections busy with one request each until every connection has sent
+ *   count requests.
+ *
+ *   path: the path of the server's socket
+ *   numClients: the number of connections
+ *   count: the number of requests per connection
+ *   latencies: an array with room for numClients * count latencies
+ *
+ *   returns: the number of requests answered
+ */
+int runLoad(const char* path, int numClients, int count, double* latencies) {
+	struct pollfd* pfds = calloc(numClients, sizeof(*pfds));
+	double* sent = calloc(numClients, sizeof(*sent));
+	int* remaining = calloc(numClients, sizeof(*remaining));
+	int answered = 0;
+	int active = 0;
+	for (int i = 0; i < numClients; i++) {
+		pfds[i].fd = connectServer(path);
+		pfds[i].events = POLLIN;
+		remaining[i] = count;
+		if (pfds[i].fd != -1 && sendRequest(pfds[i].fd, 0, LOAD_COMMAND, NULL, 0) == 0) {
+			sent[i] = now();
+			active++;
+		}
+		else {
+			pfds[i].fd = -1;
+		}
+	}
+	while (active > 0) {
+		if (poll(pfds, numClients, -1) == -1) {
+			continue;
+		}
+		for (int i = 0; i < numClients; i++) {
+			if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+				continue;
+			}
+			serverReply_t* reply = readReply(pfds[i].fd);
+			double t = now();
+			if (reply != NULL) {
+				latencies[answered++] = t - sent[i];
+			}
+			if (reply == NULL || --remaining[i] == 0 || sendRequest(pfds[i].fd, 0, LOAD_COMMAND, NULL, 0) == -1) {
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				active--;
+				continue;
+			}
+			sent[i] = now();
+		}
+	}
+	free(pfds);
+	free(sent);
+	free(remaining);
+	return answered;
+}
+
+/*
+ * Function: readPeakRss
+ * ----------------------------
+ *   Reads the high water mark of a process's resident set from /proc.
+ *
+ *   pid: the process to read
+ *
+ *   returns: the peak RSS in KB, or -1 if it could not be read
+ */
+long readPeakRss(pid_t pid) {
+	char path[64];
+	char line[256];
+	long peak = -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE* status = fopen(path, "r");
+	if (status == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (sscanf(line, "VmHWM: %ld", &peak) == 1) {
+			break;
+		}
+	}
+	fclose(status);
+	return peak;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc > 4) {
+		fprintf(stderr, "usage: %s [shell] [clients] [count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	char shell[PATH_MAX];
+	if (realpath(argc > 1 ? argv[1] : DEFAULT_SHELL, shell) == NULL) {
+		perror(argc > 1 ? argv[1] : DEFAULT_SHELL);
+		return EXIT_FAILURE;
+	}
+	int numClients = argc > 2 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+	int count = argc > 3 ? atoi(argv[3]) : DEFAULT_COUNT;
+	if (numClients < 1 || count < 1) {
+		fprintf(stderr, "clients and count must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	char dir[] = "/tmp/smallsh-server-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	char path[MAX_PATH_SIZE];
+	snprintf(path, sizeof(path), "%s/sock", dir);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return EXIT_FAILURE;
+	}
+	if (pid == 0) {
+		execl(shell, shell, "--server", path, (char*)NULL);
+		perror(shell);
+		_exit(127);
+	}
+
+	int failures = 0;
+	int fd = connectServer(path);
+	if (fd == -1) {
+		failures++;
+	}
+	else {
+		failures += runChecks(fd, dir);
+		close(fd);
+		printf("server checks: %s\n", failures == 0 ? "passed" : "FAILED");
+	}
+
+	if (fd != -1) {
+		double* latencies = malloc(sizeof(*latencies) * numClients * count);
+		double start = now();
+		int answered = runLoad(path, numClients, count, latencies);
+		double elapsed = now() - start;
+		if (answered < numClients * count) {
+			fprintf(stderr, "only %d of %d requests were answered\n", answered, numClients * count);
+			failures++;
+		}
+		if (answered > 0) {
+			qsort(latencies, answered, sizeof(*latencies), compareDoubles);
+			printf("%-8s %9s %12s %9s %9s %12s\n", "clients", "commands", "commands/s", "p50 us", "p99 us", "peak RSS KB");
+			printf("%-8d %9d %12.0f %9.1f %9.1f %12ld\n", numClients, answered, answered / elapsed,
+				latencies[(answered - 1) / 2] * 1e6, latencies[(int)((answered - 1) * 0.99)] * 1e6, readPeakRss(pid));
+		}
+		free(latencies);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+	rmdir(dir);
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
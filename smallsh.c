@@ -4,13 +4,24 @@ Course: CS344
 Date: 01/26/2022
 Program Description: This program is an implementation of a simple shell capable of the following:
 
--Provide a prompt for commands
+-Provide a prompt for commands, or run a script file without prompting
+-Cache parsed scripts so later runs replay their tokens without lexing them again
 -Handle blank lines and comments, which are lines beginning with the # character
--Provide expansion for the variable $$
+-Run lists of commands joined by ;, &, && and ||, and if, for and while compound commands
+-Provide expansion for the variables $$, $?, $!, $NAME and ${NAME}
+-Expand *, ? and [...] patterns in arguments to matching file names
 -Execute 3 commands exit, cd, and status via code built into the shell
+-Run echo, printf, true, false, test, pwd, kill and sleep inside the shell, without a new process
+-Time commands and record the resources every job used
+-Trace the stages of every command into a ring buffer and export them as a Chrome trace
 -Execute other commands by creating new processes using a function from the exec family of functions
--Support input and output redirection
+-Support input and output redirection, and here-documents and here-strings fed through sealed memfds
 -Support running commands in foreground and background processes
+-Capture the output of background jobs in fixed-size in-memory ring buffers
+-Run a file of commands with a bounded number of them running at once
+-Split commands whose arguments exceed ARG_MAX into as few exec-sized commands as possible
+-Launch external commands with posix_spawn, vfork, fork or a pre-forked zygote, selectable at runtime
+-Serve command lines from many clients over a Unix domain socket (smallsh --server SOCKET)
 -Implement custom handlers for 2 signals, SIGINT and SIGTSTP
 */
 
@@ -19,14 +30,76 @@ Program Description: This program is an implementation of a simple shell capable
 #define BACKGROUND_CHAR "&"
 #define INPUT_CHAR "<"
 #define OUTPUT_CHAR ">"
+#define PIPE_CHAR "|"
+#define SEPARATOR_CHAR ";"
+#define AND_STR "&&"
+#define OR_STR "||"
+#define HEREDOC_STR "<<"
+#define HERESTRING_STR "<<<"
+#define HEREDOC_NAME "smallsh-heredoc" // name of here-document memfds in /proc/PID/fd
+#define CONTINUE_CHAR ">" // prompt for the next line of an open if, for or while
 #define COMMENT_CHAR "#"
-#define VAR_EXP_CHAR "$$"
 #define MAX_LENGTH 2048 // unused, dynamic allocation
 #define MAX_ARGS 512 // unused
 #define EXIT_CMD "exit"
 #define CD_CMD "cd"
 #define STATUS_CMD "status"
+#define LAUNCHER_CMD "launcher"
+#define HASH_CMD "hash"
+#define PARALLEL_CMD "parallel"
+#define TIME_CMD "time"
+#define BATCH_CMD "batch"
+#define BATCH_HEADROOM 4096 // bytes of ARG_MAX left unused by batch, as xargs does
+#define JOBS_CMD "jobs"
+#define TRACE_CMD "trace"
+#define TRACE_ENV "SMALLSH_TRACE" // file to write a trace to, tracing starts with the shell if set
+#define TRACE_DEFAULT_FILE "smallsh-trace.json"
+#define TRACE_EVENTS (1 << 16) // power of two, older events are overwritten
+#define TRACE_CHILD_SLOTS 128 // stamps fork and vfork children leave in a shared page, by pid
+#define TEST_BRACKET_CMD "["
+#define BUILTIN_TABLE_BITS 6
+#define BUILTIN_TABLE_SIZE (1 << BUILTIN_TABLE_BITS)
+#define BUILTIN_COMMAND 1 // stands in for an external command: sets the status, and the command runs in the background
+#define BUILTIN_STAGE 2 // may run in a forked child as a pipeline stage
+#define BUILTIN_PREFIX 4 // handles the rest of the line itself, pipeline and redirections included
+#define LAUNCHER_ENV "SMALLSH_LAUNCHER" // selects the process launch backend at startup
 #define MAX_PID_STR_SIZE 21 // max digits in PID is 21?
+#define JOB_TABLE_BITS 12
+#define JOB_TABLE_SIZE (1 << JOB_TABLE_BITS)
+#define MAX_JOBS (JOB_TABLE_SIZE / 4 * 3) // cap the load factor so probe chains stay short
+#define MAX_EVENTS 64
+#define NOTIFY_BUF_SIZE 16384
+#define OUTPUT_SIZE_ENV "SMALLSH_JOB_OUTPUT_SIZE" // bytes of output kept per background job, 0 to discard it
+#define DEFAULT_OUTPUT_SIZE 65536
+#define MAX_CAPTURED_JOBS 64 // later background jobs get /dev/null while this many are running
+#define ZYGOTE_SLOTS 4 // ready children the zygote keeps for the shell
+#define ZYGOTE_MSG_SIZE 65536 // largest launch request, bigger ones use posix_spawn
+#define ZYGOTE_WAIT_MS 100 // how long a launch waits for a slot being forked
+#define SERVER_OPTION "--server"
+#define MAX_CLIENTS 256
+#define SERVER_BACKLOG 128
+#define READER_BUF_SIZE 4096
+#define SCRIPT_CACHE_ENV "SMALLSH_SCRIPT_CACHE" // directory of parsed scripts, empty to disable the cache
+#define SCRIPT_MAGIC "SMALLSH" // starts every parsed script
+#define SCRIPT_VERSION 6 // bump whenever the lexer changes, older parsed scripts are then ignored
+#define SCRIPT_KIND 0x0f // token byte of a parsed script: its tokenKind_t
+#define SCRIPT_EXPAND 0x10 // token byte: the word is raw and must be expanded
+#define SCRIPT_GLOB 0x20 // token byte: the word is a glob pattern
+#define SCRIPT_QUOTED 0x40 // token byte: the word had quotes or escapes, so it is never a keyword
+#define SCRIPT_BUFFERED 0x80 // token byte, parse trees only: the body is in hereDocBuf, at an offset
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+#define ARGV_INITIAL_CAP 8
+#define CAT_CMD "cat"
+#define TEE_CMD "tee"
+#define PIPE_SIZE_ENV "SMALLSH_PIPE_SIZE" // capacity in bytes of pipes between pipeline stages
+#define SPLICE_CHUNK (1 << 20)
+#define COPY_BUF_SIZE 65536
+#define DQUOTE_ESCAPES "$`\"\\" // characters a backslash escapes inside double quotes
+#define PATH_CACHE_SIZE 256 // power of two
+#define MAX_PATH_ENTRIES (PATH_CACHE_SIZE / 4 * 3)
+#define GLOB_ESCAPES "*?[]\\" // characters escaped when they come out of quotes or variables
+#define DIRENT_BUF_SIZE 65536 // bytes read per getdents64 call
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,32 +113,377 @@ Program Description: This program is an implementation of a simple shell capable
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include "smallsh.h"
 
+// the shell's pid for $$, formatted once at startup
+char shellPid[MAX_PID_STR_SIZE + 1];
+size_t shellPidLength;
+// pid of the last background command for $!
+pid_t lastBackgroundPid = 0;
 // global variable for signal handling
 bool backgroundEnabled = true;
-// track status of last completed/terminated child process
-int status;
-// global linked list to keep track of child processes
-llNode* head = NULL;
+// prompts are only printed when reading commands from a terminal
+bool interactive = true;
+// track status of last completed/terminated foreground and background child processes
+int foregroundStatus;
+int backgroundStatus;
+bool statusInitialized = false;
+// event loop: epoll set of the shell and the signalfd SIGCHLD is delivered through
+int eventFd = -1;
+int sigchldFd = -1;
+// signal mask exec'd children start with
+sigset_t childSignalMask;
+// backend used to launch external commands, and the one the last launch actually used
+launcher_t launcherBackend = LAUNCHER_SPAWN;
+launcher_t lastLauncher = LAUNCHER_SPAWN;
+bool anyLaunched = false;
+// set by a vfork child whose exec failed (the child shares our memory until it exits)
+volatile int vforkErrno = 0;
+// environment handed to exec'd programs
+extern char** environ;
+
+/* Block of memory handed out by an arena */
+typedef struct arenaBlock_t {
+	struct arenaBlock_t* next;
+	size_t size;
+	size_t used;
+	_Alignas(16) char data[];
+} arenaBlock_t;
+
+/* Bump allocator whose allocations are all freed together */
+typedef struct arena_t {
+	arenaBlock_t* head; // block being allocated from, chained to the older ones
+	unsigned long resets; // number of times the arena was reset
+} arena_t;
 
 /* Struct for commands */
 typedef struct command_t {
 	char* command;
 	int numArgs;
-	char** args; // pointer to array of char pointers
+	char** args; // pointer to array of char pointers, argv + 1
+	char** argv; // NULL terminated argument vector starting with the command
+	int argvCap;
 	char* inputFile;
+	char* hereDoc; // body of a here-document or here-string, fed to stdin instead of inputFile
+	size_t hereDocLen;
 	char* outputFile;
-	bool isBackground;
+	bool isBackground; // set on the first stage of a pipeline
+	struct command_t* next; // next stage of the pipeline
 } command_t;
 
-/* Linked list struct for tracking background child processes */
-// doubly linked list is unnecessary
-typedef struct llNode {
+/* Token scanned from a command line */
+typedef struct token_t {
+	tokenKind_t kind;
+	char* text; // word text, or error message
+	size_t len;
+	bool expand; // word is raw and must go through expandCommand
+	bool glob; // word has an unquoted *, ? or [ and is expanded to matching file names
+	bool quoted; // word had quotes or escapes, so it is never a keyword
+} token_t;
+
+/* Compiled glob pattern for one path component */
+typedef struct globMatcher_t {
+	uint8_t (*sets)[32]; // character set of each position, as a bitmap
+	bool* stars; // whether each position is a * (its set is unused)
+	int numOps;
+	const char* suffix; // literal text after the last *, checked before running the matcher
+	size_t suffixLen;
+	bool dotOk; // the pattern starts with a literal ., so hidden names may match
+} globMatcher_t;
+
+/* Directory read with getdents64, kept for the rest of the command line */
+typedef struct dirListing_t {
+	char* path;
+	char* records; // struct dirent64 records, d_reclen apart
+	size_t size;
+	struct dirListing_t* next;
+} dirListing_t;
+
+/* Single pass command line scanner */
+typedef struct lexer_t {
+	char* pos;
+	char held; // operator overwritten by the terminator of the previous word
+	char* replay; // tokens of a parsed script line, replayed instead of scanning pos
+	char* replayEnd;
+} lexer_t;
+
+/* Command of a parsed command list, chained through next. Simple commands keep their tokens,
+ * encoded like a parsed script line (or in place in a parsed script), and are built (and
+ * expanded) each time they run; a line that is one plain simple command keeps just the line */
+typedef struct node_t {
+	nodeKind_t kind;
+	struct node_t* next;
+	tokenKind_t join; // TOKEN_AND or TOKEN_OR if joined to the previous command by && or ||
+	char* tokens; // tokens of a simple command, or the words of a for loop
+	char* tokensEnd;
+	char* line; // the line of a plain simple command, scanned when it runs instead of encoded
+	char* name; // variable of a for loop
+	struct node_t* cond; // condition list of an if or while
+	struct node_t* body; // then list of an if, or the body of a loop
+	struct node_t* elseBody; // else list of an if; an elif is an if node here
+} node_t;
+
+/* Recursive descent parser over the tokens of a line, and the lines after it while an if, for or
+ * while is open */
+typedef struct parser_t {
+	lexer_t lexer;
+	lineReader_t* reader; // where the following lines come from
+	token_t token; // the next token, if peeked
+	char* tokenStart; // where the next token is encoded in a replayed line, NULL if it was scanned
+	bool peeked;
+	bool lineEnded; // the next token is on the following line
+	int depth; // compound commands open, the end of a line only ends the list outside of them
+	bool failed; // a syntax error was printed
+} parser_t;
+
+/* Parsed script, the same in memory and in the cache file: this header, the absolute path of the
+ * script, the offset of every line (plus one past the last) and the tokens of the lines. Offsets
+ * are from the header so the file can be mapped anywhere. Each token is a byte holding its kind
+ * and SCRIPT_EXPAND/SCRIPT_GLOB/SCRIPT_QUOTED, followed by the terminated text of words,
+ * here-document bodies and errors (raw if SCRIPT_EXPAND is set). Comments and blank lines are left
+ * out, and the body of a here-document belongs to the line of its << */
+typedef struct scriptHeader_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t numLines;
+	uint64_t size; // size, mtime, ctime, inode and device of the script parsed
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t ctimeSec; // an edit that restores the mtime (touch -d, rsync -t) still changes the ctime
+	int64_t ctimeNsec;
+	uint64_t ino;
+	uint64_t dev;
+	uint64_t totalSize;
+	uint32_t pathOffset;
+	uint32_t linesOffset;
+	uint32_t tokensOffset;
+	uint32_t checksum; // FNV-1a of everything after the header
+} scriptHeader_t;
+
+/* Job table slot for tracking child processes */
+typedef struct job_t {
+	pid_t pid; // 0 marks an empty slot
+	bool background;
+	bool lastStage; // the pipeline's status is this child's status
+	int parallelJob; // number of the parallel job the child belongs to, 0 if none
+	int client; // server mode client the child runs for, 1-based, 0 if none
+	struct timespec start; // when the child was started
+	unsigned long traceCommand; // command line that started the child, for tracing
+} job_t;
+
+/* Span of time recorded by tracing */
+typedef struct traceEvent_t {
+	const char* name; // string literal, so recording never copies
+	const char* category;
+	pid_t tid; // the shell, or the child the event belongs to
+	unsigned long command; // number of the command line
+	uint64_t start; // CLOCK_MONOTONIC nanoseconds
+	uint64_t end;
+} traceEvent_t;
+
+/* Timestamps a fork or vfork child writes into the shared trace page before exec */
+typedef struct traceChild_t {
+	pid_t pid; // 0 if unused, a stamp is only read back for the pid that wrote it
+	uint64_t start;
+	uint64_t redirected;
+	uint64_t exec;
+} traceChild_t;
+
+/* Output of a background job, captured from a pipe into a ring buffer */
+typedef struct jobOutput_t {
+	pid_t pid; // last stage of the job, 0 marks an empty slot
+	long number; // order the jobs were started in
+	int fd; // read end of the capture pipe, -1 once at EOF
+	bool done; // the last stage has been reaped
+	int status; // wait status of the last stage, once done
+	char* buf;
+	size_t size;
+	uint64_t written; // total bytes captured, the ring holds the last size of them
+} jobOutput_t;
+
+/* Command run by the shell itself */
+typedef struct builtin_t {
+	const char* name; // NULL marks an empty slot
+	builtinFn_t fn;
+	int flags; // BUILTIN_* flags
+} builtin_t;
+
+// hash table of built ins, filled by initBuiltins
+builtin_t builtinTable[BUILTIN_TABLE_SIZE];
+
+/* Resources used by a job, summed over its pipeline stages */
+typedef struct usage_t {
+	pid_t pid; // last stage of the job, 0 if no job has been recorded
+	struct timespec start;
+	struct timespec end;
+	struct rusage ru; // ru_maxrss is the largest of the stages
+} usage_t;
+
+/* Buffered reader handing out lines of a file descriptor */
+typedef struct lineReader_t {
+	int fd;
+	char* buf;
+	size_t cap;
+	size_t start; // first unconsumed byte
+	size_t end; // end of the buffered data
+	bool eof;
+	bool mapped; // buf is a file mapping rather than a heap buffer
+	scriptHeader_t* script; // parsed script replayed instead of reading lines, or NULL
+	bool scriptMapped; // script is a mapped cache file rather than a heap buffer
+	uint32_t scriptLine; // next line of the script
+} lineReader_t;
+
+/* Path cache entry mapping a command name to its executable */
+typedef struct pathEntry_t {
+	char* name; // NULL marks an empty slot
+	char* path;
+	int dir; // index of the $PATH directory the command was found in
+	unsigned hits;
+} pathEntry_t;
+
+/* $PATH directory opened for the path cache */
+typedef struct pathDir_t {
+	char* name;
+	int fd; // -1 if the directory did not exist
+	struct timespec mtime;
+} pathDir_t;
+
+/* Pre-forked child of the zygote, waiting for a launch request on its socket */
+typedef struct slot_t {
 	pid_t pid;
-	struct llNode* next;
-	struct llNode* prev;
-} llNode;
+	int fd;
+} slot_t;
+
+/* Launch request sent to a zygote slot, followed by the path, argv and environment strings */
+typedef struct slotRequest_t {
+	bool background;
+	pid_t pgid; // process group to join, 0 for a new one, -1 to stay in the shell's
+	int argc;
+	int envc;
+} slotRequest_t;
+
+/* Connection of a server mode client, with the command it is running */
+typedef struct client_t {
+	int fd; // -1 marks an empty slot
+	bool busy; // a command was received and its reply is not sent yet
+	bool hungUp; // the client went away, the reply is dropped
+	bool started; // the last stage of the command was started
+	int running; // stages of the command still running
+	int status; // wait status of the last stage
+	int captureFds[2]; // read ends of the stdout/stderr capture pipes, -1 once at EOF
+	char* capture; // SERVER_CAPTURE_SIZE bytes of stdout followed by as much of stderr
+	uint32_t captureLength[2];
+	bool truncated;
+	usage_t usage;
+} client_t;
+
+/* Everything a launch backend needs to start a child */
+typedef struct launch_t {
+	command_t* command;
+	char** argv;
+	bool background;
+	const pathEntry_t* resolved; // path cache entry, or NULL to search $PATH
+	int inFd; // fd for the child's stdin, or -1 to inherit
+	int outFd; // fd for the child's stdout, or -1 to inherit
+	pid_t pgid; // process group to join, 0 for a new one, -1 to stay in the shell's
+	stageFn_t stageFn; // pipeline built in the forked child runs instead of exec'ing
+} launch_t;
+
+// zygote launcher: socket to the zygote, ready slots, and slots asked for but not received yet
+int zygoteFd = -1;
+slot_t zygoteSlots[ZYGOTE_SLOTS];
+int numZygoteSlots = 0;
+int zygoteRequested = 0;
+
+// server mode: listening socket and client connections
+int serverFd = -1;
+client_t clients[MAX_CLIENTS];
+// server mode: signalfd for SIGTERM and SIGINT, either stops the server
+int stopFd = -1;
+
+// open-addressed cache of resolved command paths, valid for cachedPath's directories
+pathEntry_t pathCache[PATH_CACHE_SIZE];
+int numPathEntries = 0;
+char* cachedPath = NULL;
+pathDir_t* pathDirs = NULL;
+int numPathDirs = 0;
+
+// owns the command being parsed and executed, reset by destroyCommand
+arena_t commandArena = { NULL };
+
+// owns the command list being run, reset before the next one is read; simple commands of lines
+// that are not replayed are encoded in the scratch buffer before they are copied to it
+arena_t parseArena = { NULL };
+char* parseScratch = NULL;
+size_t parseScratchCap = 0;
+// bodies of the here-documents of the command list being run, read from a reader that is not
+// mapped; emptied with the parse arena
+char* hereDocBuf = NULL;
+size_t hereDocUsed = 0;
+size_t hereDocCap = 0;
+// the next prompt continues an open compound command
+bool promptContinued = false;
+// signalfd the outermost running loop polls for ^C, and whether ^C stopped the command list
+int loopIntFd = -1;
+bool listInterrupted = false;
+
+// directory listings of the current command line, dropped when the command arena is reset
+arena_t listingArena = { NULL };
+dirListing_t* dirListings = NULL;
+unsigned long listingResets = 0;
+
+// open-addressed table of child processes keyed by pid
+job_t jobTable[JOB_TABLE_SIZE];
+int numJobs = 0;
+
+// parallel built in: jobs still running, jobs that failed, and whether one was interrupted
+int parallelRunning = 0;
+int parallelFailed = 0;
+bool parallelInterrupted = false;
+// batch built in: the combined status of its chunks, which are not reported one by one
+int parallelStatus = 0;
+bool parallelQuiet = false;
+
+// captured background output, finished jobs are kept until their slot is needed
+jobOutput_t jobOutputs[MAX_CAPTURED_JOBS];
+long numJobOutputs = 0;
+
+// background completion messages waiting to be written with the next prompt
+char notifyBuf[NOTIFY_BUF_SIZE];
+size_t notifyLength = 0;
+
+// set by the exit built in
+bool exitRequested = false;
+
+// tracing: preallocated ring of events, the number recorded so far, the command line being traced,
+// the shared page children stamp, and the file the trace is written to
+bool tracing = false;
+traceEvent_t traceEvents[TRACE_EVENTS];
+unsigned long numTraceEvents = 0;
+unsigned long traceCommand = 0;
+traceChild_t* traceChildren = NULL;
+char* traceFile = NULL;
+// reader the shell reads commands from
+lineReader_t* shellReader = NULL;
+// signal that interrupted the last in-process built in, 0 if none
+int builtinSignal = 0;
+
+// resources used by the last foreground job (or parallel run) and the last completed background job
+usage_t foregroundUsage;
+usage_t backgroundUsage;
 
 // Handler for SIGTSTP - enters foreground-only mode
 void handle_SIGTSTP(int signo) {
@@ -81,535 +499,6758 @@ void handle_SIGTSTP(int signo) {
 	}
 }
 
-// Handler for SIGCHLD
-// Code adapted from instructor Ryan Gambord at https://edstem.org/us/courses/16718/discussion/1077321
-void handle_SIGCHLD(int signo, siginfo_t* si, void* context) {
-	int errno_sav = errno;
-
-	waitpid(si->si_pid, &status, 0);
+/*
+ * Function: jobSlot
+ * ----------------------------
+ *   Hashes a pid to its home slot in the job table.
+ *
+ *   pid: the process id to hash
+ *
+ *   returns: the index of the pid's home slot
+ */
+size_t jobSlot(pid_t pid) {
+	// Fibonacci hashing spreads sequential pids across the table
+	return ((uint32_t)pid * 2654435769u) >> (32 - JOB_TABLE_BITS);
+}
 
-	pid_t pid = si->si_pid;
-	// check that pid exists in list of tracked background processes before printing
-	llNode* currNode = head;
-	while (currNode != NULL) {
-		// if node is a tracked background process, print, otherwise ignore
-		if (currNode->pid == pid) {
-			char const str[] = "\nbackground pid ";
-			write(STDOUT_FILENO, str, sizeof str - 1);
+/*
+ * Function: addJob
+ * ----------------------------
+ *   Adds a child to the job table so the event loop can match it when it is reaped.
+ *
+ *   childPid: the process id of the child to track
+ *   background: whether the child runs in the background
+ *   lastStage: whether the child is the last stage of its pipeline
+ *   parallelJob: the number of the parallel job the child belongs to, 0 if none
+ *
+ *   returns: 0 if successful; -1 if the table is full
+ *
+ *   notes: only background children count against MAX_JOBS, the remaining slots are headroom for
+ *   foreground children
+ */
+int addJob(pid_t childPid, bool background, bool lastStage, int parallelJob) {
+	if (background && numJobs >= MAX_JOBS) {
+		return -1;
+	}
+	size_t i = jobSlot(childPid);
+	// linear probing, the load factor cap guarantees an empty slot
+	while (jobTable[i].pid != 0 && jobTable[i].pid != childPid) {
+		i = (i + 1) & (JOB_TABLE_SIZE - 1);
+	}
+	if (jobTable[i].pid == 0) {
+		numJobs++;
+	}
+	jobTable[i].pid = childPid;
+	jobTable[i].background = background;
+	jobTable[i].lastStage = lastStage;
+	jobTable[i].parallelJob = parallelJob;
+	jobTable[i].client = 0;
+	jobTable[i].traceCommand = traceCommand;
+	clock_gettime(CLOCK_MONOTONIC, &jobTable[i].start);
+	return 0;
+}
 
-			int i = 1;
+/*
+ * Function: findJob
+ * ----------------------------
+ *   Looks up a child in the job table.
+ *
+ *   childPid: the process id of the child to look up
+ *
+ *   returns: a pointer to the job, or NULL if the pid is not tracked
+ */
+job_t* findJob(pid_t childPid) {
+	size_t i = jobSlot(childPid);
+	while (jobTable[i].pid != 0) {
+		if (jobTable[i].pid == childPid) {
+			return &jobTable[i];
+		}
+		i = (i + 1) & (JOB_TABLE_SIZE - 1);
+	}
+	return NULL;
+}
 
-			// count digits
-			while (pid / (i * 10) != 0) i *= 10;
+/*
+ * Function: removeJob
+ * ----------------------------
+ *   Removes a child from the job table. Later entries of the probe chain are shifted back into
+ *   the freed slot so lookups never need tombstones.
+ *
+ *   childPid: the process id of the child to remove
+ *
+ *   returns: true if the child was tracked; false otherwise
+ */
+bool removeJob(pid_t childPid) {
+	job_t* job = findJob(childPid);
+	if (job == NULL) {
+		return false;
+	}
+	size_t hole = job - jobTable;
+	size_t i = hole;
+	while (true) {
+		i = (i + 1) & (JOB_TABLE_SIZE - 1);
+		if (jobTable[i].pid == 0) {
+			break;
+		}
+		// an entry may move into the hole only if its home slot is not between the hole and it
+		size_t home = jobSlot(jobTable[i].pid);
+		if (((i - home) & (JOB_TABLE_SIZE - 1)) >= ((i - hole) & (JOB_TABLE_SIZE - 1))) {
+			jobTable[hole] = jobTable[i];
+			hole = i;
+		}
+	}
+	jobTable[hole].pid = 0;
+	numJobs--;
+	return true;
+}
 
-			for (; 0 < i; i /= 10)
-			{
-				char c = (char)(pid / i) + '0'; // write ascii value of the int
-				write(STDOUT_FILENO, &c, 1);
-				pid = pid % i;
-			}
+/*
+ * Function: killJobs
+ * ----------------------------
+ *   Sends a signal to every tracked background child.
+ *
+ *   signo: the signal to send
+ */
+void killJobs(int signo) {
+	for (size_t i = 0; i < JOB_TABLE_SIZE; i++) {
+		if (jobTable[i].pid != 0 && jobTable[i].background) {
+			kill(jobTable[i].pid, signo);
+		}
+	}
+}
 
-			{
-				char const str[] = " is done: ";
-				write(STDOUT_FILENO, str, sizeof str - 1);
-			}
+/*
+ * Function: printJobTable
+ * ----------------------------
+ *   Prints out the tracked children for testing purposes.
+ */
+void printJobTable(void) {
+	if (numJobs == 0) {
+		printf("Job table is empty.\n");
+	}
+	for (size_t i = 0; i < JOB_TABLE_SIZE; i++) {
+		if (jobTable[i].pid != 0) {
+			printf("Slot %zu PID: %d%s\n", i, jobTable[i].pid, jobTable[i].background ? " &" : "");
+		}
+	}
+	fflush(stdout);
+}
 
-			if (CLD_EXITED == si->si_code)
-			{
-				char const str[] = "exit value ";
-				write(STDOUT_FILENO, str, sizeof str - 1);
-			}
-			else
-			{
-				char const str[] = "terminated by signal ";
-				write(STDOUT_FILENO, str, sizeof str - 1);
-			}
+/*
+ * Function: arenaAlloc
+ * ----------------------------
+ *   Bump-allocates memory from an arena. A new block at least double the size of the last one is
+ *   chained on when the current block is full.
+ *
+ *   arena: a pointer to the arena to allocate from
+ *   size: the number of bytes to allocate
+ *
+ *   returns: a pointer to the memory, aligned for any type
+ *
+ *   notes: the memory is freed all at once by arenaReset or destroyArena
+ */
+void* arenaAlloc(arena_t* arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	arenaBlock_t* block = arena->head;
+	if (block == NULL || block->size - block->used < size) {
+		size_t blockSize = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+		while (blockSize < size) {
+			blockSize *= 2;
+		}
+		arenaBlock_t* newBlock = malloc(sizeof(*newBlock) + blockSize);
+		if (newBlock == NULL) {
+			perror("Error");
+			exit(1);
+		}
+		newBlock->next = block;
+		newBlock->size = blockSize;
+		newBlock->used = 0;
+		arena->head = block = newBlock;
+	}
+	void* ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
 
-			{
-				int status = si->si_status;
-				int i = 1;
-				while (status / (i * 10) != 0) i *= 10;
+/*
+ * Function: arenaStrndup
+ * ----------------------------
+ *   Copies the first n characters of a string into an arena.
+ *
+ *   arena: a pointer to the arena to allocate from
+ *   s: the string to copy
+ *   n: the number of characters to copy
+ *
+ *   returns: a pointer to the terminated copy
+ */
+char* arenaStrndup(arena_t* arena, const char* s, size_t n) {
+	char* copy = arenaAlloc(arena, n + 1);
+	memcpy(copy, s, n);
+	copy[n] = '\0';
+	return copy;
+}
 
-				for (; 0 < i; i /= 10)
-				{
-					char c = (char)(status / i) + '0';
-					write(STDOUT_FILENO, &c, 1);
-					status = status % i;
-				}
-			}
+/*
+ * Function: arenaShrink
+ * ----------------------------
+ *   Gives the unused end of the most recent allocation of an arena back to it, so a buffer can
+ *   be allocated for the most it may need and cut down to what it used.
+ *
+ *   arena: a pointer to the arena the memory came from
+ *   ptr: the most recent allocation
+ *   size: the number of bytes of it to keep
+ */
+void arenaShrink(arena_t* arena, void* ptr, size_t size) {
+	arenaBlock_t* block = arena->head;
+	size_t offset = (char*)ptr - block->data;
+	block->used = offset + ((size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+}
 
-			write(STDOUT_FILENO, "\n", 1);
-			errno = errno_sav;
+/*
+ * Function: arenaReset
+ * ----------------------------
+ *   Frees everything allocated from an arena at once. If the arena had to chain on blocks, they
+ *   are replaced by a single block big enough for all of them, so an arena that is reset after
+ *   every command settles on one block and stops calling malloc.
+ *
+ *   arena: a pointer to the arena to reset
+ */
+void arenaReset(arena_t* arena) {
+	arena->resets++;
+	arenaBlock_t* block = arena->head;
+	if (block == NULL) {
+		return;
+	}
+	if (block->next != NULL) {
+		size_t total = 0;
+		while (block != NULL) {
+			arenaBlock_t* next = block->next;
+			total += block->size;
+			free(block);
+			block = next;
 		}
-		currNode = currNode->next;
+		arena->head = NULL;
+		arenaAlloc(arena, total);
+		block = arena->head;
 	}
+	block->used = 0;
 }
 
 /*
- * Function: addToChildList
+ * Function: destroyArena
  * ----------------------------
- *   Takes a childPid, creates a linked list node for it, and adds it to the beginning of the linked list
- *	 
- *	 head: the head of the linked list to add to (or NULL if none)
- *   childPid: the process id of the child to add to the linked list
- *
- *   returns: a pointer to the new head of the linked list
+ *   Frees every block of an arena.
  *
- *	 notes: linked list must be freed using destroyChildList function
+ *   arena: a pointer to the arena to destroy
  */
-llNode* addToChildList(llNode* head, pid_t childPid) {
-	// create childNode as new head
-	llNode* childNode = malloc(sizeof * childNode);
-	childNode->pid = childPid;
-	childNode->prev = NULL;
-	childNode->next = head;
-	if (head != NULL) {
-		head->prev = childNode;
+void destroyArena(arena_t* arena) {
+	while (arena->head != NULL) {
+		arenaBlock_t* next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
 	}
-	return childNode;
 }
 
 /*
- * Function: removeFromChildList
+ * Function: initLexer
  * ----------------------------
- *   Takes a childPid and removes the first node in the linked list with that childPid
+ *   Initializes a lexer over a command line.
  *
- *	 head: the head of the linked list to add to remove from
- *   childPid: the process id of the child to remove from the linked list
+ *   lexer: a pointer to the lexer to initialize
+ *   line: the writable, terminated command line; words are terminated and unquoted in place
+ */
+void initLexer(lexer_t* lexer, char* line) {
+	lexer->pos = line;
+	lexer->held = '\0';
+	lexer->replay = NULL;
+}
+
+/*
+ * Function: isOperatorChar
+ * ----------------------------
+ *   Checks whether an unquoted character ends a word and starts an operator token.
  *
- *   returns: a pointer to the head of the linked list
+ *   c: the character to check
  *
- *	 notes: linked list must be freed using destroyChildList function
+ *   returns: true if c is an operator character; false otherwise
  */
-llNode* removeFromChildList(llNode* head, pid_t childPid) {
-	if (head == NULL) {
-		return head;
-	}
-	llNode* currNode = head;
-	// advance currNode until we find node to remove
-	llNode* prevNode = NULL;
-	while (currNode != NULL) {
-		if (currNode->pid == childPid) {
-			// if there's a prev node, set it
-			if (prevNode != NULL) {
-				prevNode->next = currNode->next;
+bool isOperatorChar(char c) {
+	return c == '<' || c == '>' || c == '&' || c == '|' || c == ';';
+}
+
+/*
+ * Function: unquoteWord
+ * ----------------------------
+ *   Removes quotes and backslash escapes from a word in place. The result is never longer than
+ *   the word, so it is compacted towards the start.
+ *
+ *   word: the start of the word
+ *   len: the length of the word
+ *
+ *   returns: the length of the unquoted word
+ */
+size_t unquoteWord(char* word, size_t len) {
+	char* out = word;
+	char* end = word + len;
+	char quote = '\0';
+	for (char* in = word; in < end; in++) {
+		if (quote == '\'') {
+			if (*in == '\'') {
+				quote = '\0';
 			}
-			// otherwise, head needs to be reassigned
 			else {
-				head = currNode->next;
-			}
-			// if there's a next node, set it
-			if (currNode->next != NULL) {
-				currNode->next->prev = prevNode;
+				*out++ = *in;
 			}
-			free(currNode);
-			return head;
+		}
+		else if (*in == '\\' && in + 1 < end
+			&& (quote == '\0' || strchr(DQUOTE_ESCAPES, in[1]) != NULL)) {
+			*out++ = *++in;
+		}
+		else if (*in == '"' || (*in == '\'' && quote == '\0')) {
+			quote = quote ? '\0' : *in;
 		}
 		else {
-			prevNode = currNode;
-			currNode = currNode->next;
+			*out++ = *in;
 		}
 	}
-	return head;
+	return out - word;
 }
 
 /*
- * Function: printChildList
+ * Function: lexNext
  * ----------------------------
- *   Takes the head of a linked list and prints out the nodes.
+ *   Scans the next token of a command line in a single pass. Words may contain single quotes,
+ *   double quotes and backslash escapes and are separated by any whitespace or an unquoted
+ *   operator. A word that needs no expansion is sliced out of the line without copying: it is
+ *   terminated (and unquoted if needed) in place. A word with a $ outside single quotes is left raw
+ *   with expand set, for expandCommand to unquote and expand in one go. A word with an unquoted *,
+ *   ? or [...] has glob set (a [ that no ] closes, like the [ built in, is literal), and is also
+ *   left raw if it has quotes so expandPattern can tell quoted glob characters from unquoted ones.
+ *   A lexer over a parsed script line replays its tokens.
  *
- *	 head: the head of the linked list to print
+ *   lexer: a pointer to the lexer
+ *   token: set to the scanned token; text/len are only set for words and errors
  *
- *	 notes: linked list must be freed using destroyChildList function
+ *   returns: the kind of the scanned token
  */
-void printChildList(llNode* head) {
-	if (head == NULL) {
-		printf("LL is empty.\n");
-		fflush(stdout);
+tokenKind_t lexNext(lexer_t* lexer, token_t* token) {
+	if (lexer->replay != NULL) {
+		return replayToken(lexer, token);
 	}
-	llNode* tmp = head;
-	int i = 1;
-	while (tmp != NULL) {
-		printf("Node %d PID: %d\n", i, tmp->pid);
-		fflush(stdout);
-		i++;
-		tmp = tmp->next;
+	char* pos = lexer->pos;
+	char c = lexer->held ? lexer->held : *pos;
+	lexer->held = '\0';
+	while (isspace((unsigned char)c)) {
+		c = *++pos;
+	}
+
+	token->text = NULL;
+	token->len = 0;
+	token->expand = false;
+	token->glob = false;
+	token->quoted = false;
+	switch (c) {
+	case '\0':
+		lexer->pos = pos;
+		return token->kind = TOKEN_END;
+	case '<':
+		// << and <<< (the rest of the operator is still in the line after a held terminator); the
+		// body of a here-document is read by readHereDoc
+		if (pos[1] == '<') {
+			lexer->pos = pos + 2 + (pos[2] == '<');
+			return token->kind = pos[2] == '<' ? TOKEN_HERESTRING : TOKEN_HEREDOC;
+		}
+		lexer->pos = pos + 1;
+		return token->kind = TOKEN_INPUT;
+	case '>':
+		lexer->pos = pos + 1;
+		return token->kind = TOKEN_OUTPUT;
+	case '&':
+		// the first character may be a held terminator, the second is still in the line
+		lexer->pos = pos + 1 + (pos[1] == '&');
+		return token->kind = pos[1] == '&' ? TOKEN_AND : TOKEN_BACKGROUND;
+	case '|':
+		lexer->pos = pos + 1 + (pos[1] == '|');
+		return token->kind = pos[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+	case ';':
+		lexer->pos = pos + 1;
+		return token->kind = TOKEN_SEMICOLON;
+	}
+
+	// word: find its end, tracking quotes
+	char* start = pos;
+	char quote = '\0';
+	bool quoted = false;
+	char* bracket = NULL; // first unquoted [, a glob only once a ] closes it
+	for (; c != '\0'; c = *++pos) {
+		if (quote == '\'') {
+			quote = c == '\'' ? '\0' : quote;
+		}
+		else if (c == '\\') {
+			quoted = true;
+			if (pos[1] != '\0') {
+				pos++;
+			}
+		}
+		else if (c == '"' || c == '\'') {
+			quoted = true;
+			quote = quote == c ? '\0' : (quote ? quote : c);
+		}
+		else if (c == '$') {
+			token->expand = true;
+		}
+		else if (quote == '\0' && (c == '*' || c == '?')) {
+			token->glob = true;
+		}
+		else if (quote == '\0' && c == '[') {
+			bracket = bracket != NULL ? bracket : pos;
+		}
+		else if (quote == '\0' && c == ']' && bracket != NULL && pos > bracket + 1) {
+			token->glob = true;
+		}
+		else if (quote == '\0' && (isspace((unsigned char)c) || isOperatorChar(c))) {
+			break;
+		}
 	}
+	token->text = start;
+	token->len = pos - start;
+	token->quoted = quoted;
+	lexer->pos = pos;
+	if (quote != '\0') {
+		token->text = "unterminated quote";
+		token->len = strlen(token->text);
+		return token->kind = TOKEN_ERROR;
+	}
+	if (token->expand || (token->glob && quoted)) {
+		token->expand = true;
+		return token->kind = TOKEN_WORD;
+	}
+	if (quoted) {
+		token->len = unquoteWord(start, token->len);
+	}
+	// terminate in place, holding on to an operator that the terminator overwrites
+	if (start + token->len == pos && c != '\0') {
+		lexer->held = isOperatorChar(c) ? c : '\0';
+		lexer->pos = pos + !isOperatorChar(c);
+	}
+	start[token->len] = '\0';
+	return token->kind = TOKEN_WORD;
 }
 
 /*
- * Function: destroyChildList
+ * Function: pushArg
  * ----------------------------
- *   Takes the head node of a linked list created with addToChildList function and destroys each node.
+ *   Appends an argument to a command's NULL terminated argv, doubling the array in the command
+ *   arena when it is full.
  *
- *	 head: the head of the linked list to destroy
+ *   command: a pointer to the command struct
+ *   arg: the argument to append
  */
-void destroyChildList(llNode* head) {
-	llNode* tmp;
-
-	while (head != NULL)
-	{
-		tmp = head;
-		head = head->next;
-		free(tmp);
+void pushArg(command_t* command, char* arg) {
+	int argc = command->numArgs + (command->command != NULL);
+	if (argc + 1 >= command->argvCap) {
+		int cap = command->argvCap ? command->argvCap * 2 : ARGV_INITIAL_CAP;
+		char** argv = arenaAlloc(&commandArena, sizeof(*argv) * cap);
+		if (argc > 0) {
+			memcpy(argv, command->argv, sizeof(*argv) * argc);
+		}
+		command->argv = argv;
+		command->argvCap = cap;
 	}
+	command->argv[argc] = arg;
+	command->argv[argc + 1] = NULL;
+	if (command->command == NULL) {
+		command->command = arg;
+	}
+	else {
+		command->numArgs++;
+	}
+	command->args = command->argv + 1;
 }
 
 /*
  * Function: createCommand
  * ----------------------------
  *   Given an inputted command line, parses out the command, arguments, input/output redirections, and
- *   background mode and creates a command structure from it.
+ *   background mode and creates a command structure from it. Stages of a pipeline (separated by
+ *   |) are chained through next. The line is tokenized in a single pass by lexNext and words are
+ *   appended to a growable argv as they are scanned, patterns as the file names they match.
  *
- *	 line: the stripped (no new line char) command line
+ *	 line: the stripped (no new line char) command line, which is modified
  *
- *   returns: pointer to the command struct
+ *   returns: pointer to the command struct of the first stage, or NULL on a syntax error (the error
+ *   is printed)
  *
- *	 notes: commands must later be destroyed with destroyCommand function
+ *	 notes: the command and everything it points to is allocated from the command arena and must
+ *	 later be destroyed with destroyCommand function; words may point into line
  */
 command_t* createCommand(char* line) {
-	command_t* currCommand = malloc(sizeof(*currCommand));
-	initCommand(currCommand); // initialize struct
-
-	// copy the line (we will use it for a second parse)
-	char* lineCpy = malloc(strlen(line) * sizeof(char) + 1);
-	strcpy(lineCpy, line);
-
-	char* savePtr = NULL;
-
-	bool inputFound = false;
-	bool outputFound = false;
-
-	// first token is the command
-	char* token = strtok_r(line, " ", &savePtr);
-
-	// get pid
-	char* pid = malloc((MAX_PID_STR_SIZE + 1) * sizeof(*pid));
-	sprintf(pid, "%d", getpid());
-
-	// perform variable expansion on $$
-	currCommand->command = expandCommand(token, VAR_EXP_CHAR, pid);
-
-	token = strtok_r(NULL, " ", &savePtr);
-
-	// look for args
-	int numArgs = 0;
-
-	// use a copy of the string to parse through args to get numArgs
-	char* tempPtr = NULL;
-	char* tempToken = strtok_r(lineCpy, " ", &tempPtr);
-	tempToken = strtok_r(NULL, " ", &tempPtr); // advance it once to skip command
-	while (tempToken != NULL && strcmp(tempToken, INPUT_CHAR) != 0 
-		&& strcmp(tempToken, OUTPUT_CHAR) != 0 
-		&& strcmp(tempToken, BACKGROUND_CHAR) != 0) {
-		numArgs++;
-		tempToken = strtok_r(NULL, " ", &tempPtr);
-	}
-	currCommand->numArgs = numArgs;
+	lexer_t lexer;
+	initLexer(&lexer, line);
+	return parseCommand(&lexer);
+}
 
-	// store args
-	currCommand->args = malloc(sizeof(*currCommand->args) * numArgs); // allocate space for numArgs char ptrs
-	for (int i = 0; i < numArgs; i++) {
-		currCommand->args[i] = expandCommand(token, VAR_EXP_CHAR, pid);
-		token = strtok_r(NULL, " ", &savePtr);
-	}
+/*
+ * Function: parseCommand
+ * ----------------------------
+ *   Builds a command from the tokens of a lexer, for createCommand or a line of a parsed script.
+ *
+ *   lexer: a pointer to the lexer, over a command line or replaying a parsed one
+ *
+ *   returns: pointer to the command struct of the first stage, or NULL on a syntax error (the error
+ *   is printed)
+ */
+command_t* parseCommand(lexer_t* lexer) {
+	command_t* pipeline = arenaAlloc(&commandArena, sizeof(*pipeline));
+	initCommand(pipeline); // initialize struct
+	command_t* currCommand = pipeline;
+	bool background = false;
 
-	while (token != NULL) {
-		// input redirection filename
-		if (strcmp(token, INPUT_CHAR) == 0 && !inputFound) {
-			// next token will be input filename
-			token = strtok_r(NULL, " ", &savePtr);
-			if (token) {
-				currCommand->inputFile = expandCommand(token, VAR_EXP_CHAR, pid);
-				inputFound = true;
+	token_t token;
+	while (lexNext(lexer, &token) != TOKEN_END) {
+		// & only counts as the last token
+		background = token.kind == TOKEN_BACKGROUND;
+		switch (token.kind) {
+		case TOKEN_WORD:
+			if (token.glob) {
+				expandGlob(currCommand, &token);
 			}
-		}
-		// output redirection filename
-		else if (strcmp(token, OUTPUT_CHAR) == 0 && !outputFound) {
-			// next token will be output filename
-			token = strtok_r(NULL, " ", &savePtr);
-			if (token) {
-				currCommand->outputFile = expandCommand(token, VAR_EXP_CHAR, pid);
-				outputFound = true;
+			else {
+				pushArg(currCommand, wordText(&token));
+			}
+			break;
+		case TOKEN_INPUT:
+		case TOKEN_OUTPUT: {
+			// next token will be the filename
+			token_t file;
+			if (lexNext(lexer, &file) != TOKEN_WORD) {
+				fprintf(stderr, "syntax error: expected a file name after %s\n",
+					token.kind == TOKEN_INPUT ? INPUT_CHAR : OUTPUT_CHAR);
+				return NULL;
+			}
+			char** target = token.kind == TOKEN_INPUT ? &currCommand->inputFile : &currCommand->outputFile;
+			// only the first redirection of each kind is used
+			if (*target == NULL && (token.kind == TOKEN_OUTPUT || currCommand->hereDoc == NULL)) {
+				*target = wordText(&file);
 			}
+			break;
 		}
-		else if (strcmp(token, BACKGROUND_CHAR) == 0) {
-			token = strtok_r(NULL, " ", &savePtr);
-			if (token == NULL) {
-				// valid background char
-				currCommand->isBackground = true;
-				break;
+		case TOKEN_HEREDOC:
+		case TOKEN_HERESTRING: {
+			char* body;
+			size_t bodyLen;
+			if (token.kind == TOKEN_HEREDOC) {
+				// a single command line has no lines after it
+				if (token.text == NULL) {
+					fprintf(stderr, "syntax error: unexpected %s\n", HEREDOC_STR);
+					return NULL;
+				}
+				body = token.expand ? expandHereDoc(token.text, token.len, &bodyLen) : token.text;
+				bodyLen = token.expand ? bodyLen : token.len;
 			}
 			else {
-				continue;
+				// a here-string is the word and a new line
+				token_t word;
+				if (lexNext(lexer, &word) != TOKEN_WORD) {
+					fprintf(stderr, "syntax error: expected a word after %s\n", HERESTRING_STR);
+					return NULL;
+				}
+				char* text = wordText(&word);
+				bodyLen = strlen(text) + 1;
+				body = arenaAlloc(&commandArena, bodyLen + 1);
+				memcpy(body, text, bodyLen - 1);
+				body[bodyLen - 1] = '\n';
+				body[bodyLen] = '\0';
 			}
+			if (currCommand->inputFile == NULL && currCommand->hereDoc == NULL) {
+				currCommand->hereDoc = body;
+				currCommand->hereDocLen = bodyLen;
+			}
+			break;
+		}
+		case TOKEN_PIPE:
+			if (currCommand->command == NULL) {
+				fprintf(stderr, "syntax error: expected a command before %s\n", PIPE_CHAR);
+				return NULL;
+			}
+			// start the next stage
+			currCommand->next = arenaAlloc(&commandArena, sizeof(*currCommand));
+			currCommand = currCommand->next;
+			initCommand(currCommand);
+			break;
+		case TOKEN_BACKGROUND:
+			break;
+		case TOKEN_SEMICOLON:
+		case TOKEN_AND:
+		case TOKEN_OR:
+			// lists are split up by parseList, a single command line has none
+			fprintf(stderr, "syntax error: unexpected %s\n", token.kind == TOKEN_SEMICOLON ? SEPARATOR_CHAR
+				: token.kind == TOKEN_AND ? AND_STR : OR_STR);
+			return NULL;
+		default:
+			fprintf(stderr, "syntax error: %.*s\n", (int)token.len, token.text);
+			return NULL;
 		}
-		token = strtok_r(NULL, " ", &savePtr);
 	}
-	free(lineCpy);
-	free(pid);
-	return currCommand;
+	if (currCommand != pipeline && currCommand->command == NULL) {
+		fprintf(stderr, "syntax error: expected a command after %s\n", PIPE_CHAR);
+		return NULL;
+	}
+	pipeline->isBackground = background;
+	return pipeline;
 }
 
 /*
- * Function: expandCommand
+ * Function: wordText
  * ----------------------------
- *   Takes a string and replaces all instances of a given input substring with a given output substring.
- *   Replacement occurs left to right.
+ *   Gets the final text of a word token, expanding it if the lexer left it raw.
  *
- *	 str: the string to expand
- *   fromSubstr: the input substring to expand
- *   toSubstr: the output substring to expand to
+ *   token: a pointer to the word token
  *
- *   returns: a pointer to the expanded string
- * 
- *	 notes: must free returned string
+ *   returns: the terminated text of the word
  */
-
-char* expandCommand(char* str, char* fromSubstr, char* toSubstr) {
-	// count variable strings to expand from
-	int i = 0;
-	int newLength = strlen(str);
-	int adjustedLength = strlen(toSubstr) - strlen(fromSubstr);
-	
-	// figure out how much space to allocate for expanded string
-	while (i < strlen(str)) {
-		// if match, allot room for expansion
-		if (strncmp(&str[i], fromSubstr, strlen(fromSubstr)) == 0) {
-			newLength += adjustedLength;
-			i += strlen(fromSubstr);
-		}
-		// doesn't match
-		else {
-			i++;
-		}
+char* wordText(token_t* token) {
+	if (token->expand) {
+		return expandCommand(token->text, token->len);
 	}
-	i = 0;
-
-	// allocate the space for expanded string
-	char* expandedStr = malloc(sizeof(char) * newLength + 1);
-	memset(expandedStr, '\0', newLength + 1);
-
-	// now copy the expanded string
-	while (i < strlen(str)) {
-		if (strncmp(&str[i], fromSubstr, strlen(fromSubstr)) == 0) {
-			strncat(expandedStr, toSubstr, strlen(toSubstr));
-			i += strlen(fromSubstr);
-		}
-		// doesn't match
-		else {
-			strncat(expandedStr, &str[i], 1);
-			i++;
-		}
-	}
-	return expandedStr;
+	return token->text;
 }
 
 /*
- * Function: getCommand
+ * Function: initParser
  * ----------------------------
- *   Gets a user-inputted command from stdin.
- *
- *   bufPtr: a double pointer to the first character in the string
- *   size: a pointer to the size of the buffer
+ *   Initializes a parser. The first line is read with nextParserLine.
  *
- *   returns: a pointer to the first character in the string
- *
- *   notes: bufPtr must be freed later
+ *   parser: a pointer to the parser to initialize
+ *   reader: the line reader the lines come from
  */
-char* getCommand(char** bufPtr, size_t* size) {
-	size_t nread;
-	printf(PROMPT_CHAR);
-	fflush(stdout);
-	nread = getline(bufPtr, size, stdin);
-	// input validation (in case user just presses enter)
-	// also check if empty space or if user starts with COMMENT_CHAR (#)
-	while (nread == 1 || strncmp(*bufPtr, COMMENT_CHAR, 1) == 0 || isEmptyString(*bufPtr)) {
-		printf(PROMPT_CHAR);
-		fflush(stdout);
-		nread = getline(bufPtr, size, stdin);
-	}
-	// strip new line
-	if ((*bufPtr)[nread - 1] == '\n') {
-		(*bufPtr)[nread - 1] = '\0';
-	}
-	return *bufPtr;
+void initParser(parser_t* parser, lineReader_t* reader) {
+	initLexer(&parser->lexer, NULL);
+	parser->reader = reader;
+	parser->peeked = false;
+	parser->lineEnded = false;
+	parser->depth = 0;
+	parser->failed = false;
 }
+
 /*
- * Function: isEmptyString
+ * Function: nextParserLine
  * ----------------------------
- *   Checks if a given string is all empty space.
+ *   Points the parser's lexer at the next line of its reader, a parsed script line if the reader
+ *   has a parsed script. Inside an open compound command the continuation prompt is shown.
  *
- *   s: a pointer to the string to check
- * 
- *	 returns: 0 if not empty; 1 if empty
+ *   parser: a pointer to the parser
+ *
+ *   returns: true if there was a line; false at EOF
  */
-int isEmptyString(char* s) {
-	for (int i = 0; i < strlen(s); i++) {
-		if (!isspace(*s)) {
-			return 0;
-		}
+bool nextParserLine(parser_t* parser) {
+	lineReader_t* reader = parser->reader;
+	// a single line (buildLine) has no lines after it
+	if (reader == NULL) {
+		return false;
 	}
-	return 1;
+	promptContinued = parser->depth > 0;
+	bool found;
+	if (reader->script != NULL) {
+		found = nextScriptLine(reader, &parser->lexer);
+	}
+	else {
+		char* line = getCommand(reader);
+		found = line != NULL;
+		initLexer(&parser->lexer, line);
+	}
+	promptContinued = false;
+	return found;
 }
 
 /*
- * Function: changeDirectory
+ * Function: peekToken
  * ----------------------------
- *   Wrapper for the chdir() function. If command does not contain any args, changes to the
- *   default HOME directory (i.e. getenv("HOME
+ *   Scans the next token unless it was already scanned. Inside an open compound command the end
+ *   of a line is a TOKEN_NEWLINE, and the token after it comes from the following line.
  *
- *   command: a pointer to the command struct
+ *   parser: a pointer to the parser
  *
- *	 returns: 0 if successful; 1 if unsuccessful
+ *   returns: the kind of the next token, in parser->token; TOKEN_END at the end of the line
+ *   outside of compound commands, or at EOF
+ *
+ *   notes: the token is consumed by clearing parser->peeked
  */
-int changeDirectory(command_t* command) {
-	int retVal;
-	// double check command is CD_CMD
-	if (strcmp(command->command, CD_CMD) != 0) {
-		return -1;
+tokenKind_t peekToken(parser_t* parser) {
+	token_t* token = &parser->token;
+	if (parser->peeked) {
+		return token->kind;
 	}
-	// if no args, cd to HOME
-	if (command->numArgs == 0) {
-		retVal = chdir(getenv("HOME"));
+	parser->peeked = true;
+	if (parser->lineEnded) {
+		parser->lineEnded = false;
+		if (!nextParserLine(parser)) {
+			token->text = NULL;
+			token->len = 0;
+			return token->kind = TOKEN_END;
+		}
 	}
-	// otherwise do whatever chdir normally does, ignoring other args besides first
-	else {
-		retVal = chdir(command->args[0]);
+	parser->tokenStart = parser->lexer.replay;
+	tokenKind_t kind = lexNext(&parser->lexer, token);
+	// a replayed here-document already has its body, a single line has no lines for one
+	if (kind == TOKEN_HEREDOC && parser->lexer.replay == NULL && parser->reader != NULL) {
+		readHereDoc(parser->reader, &parser->lexer, token);
 	}
-	if (retVal != 0) {
-		perror("Error");
+	else if (kind == TOKEN_HEREDOC && parser->lexer.replay == NULL) {
+		token->text = "unexpected " HEREDOC_STR;
+		token->len = strlen(token->text);
+		token->kind = TOKEN_ERROR;
 	}
-	return retVal;
+	if (kind == TOKEN_END && parser->depth > 0) {
+		parser->lineEnded = true;
+		token->kind = TOKEN_NEWLINE;
+	}
+	return token->kind;
 }
 
 /*
- * Function: printStatus
+ * Function: isKeyword
  * ----------------------------
- *   Prints the status of the last terminated/completed wstatus
+ *   Checks whether the next token is a keyword. Only unquoted words are keywords, and the parser
+ *   only looks for them where a command starts, so "echo fi" and "'if'" are plain words.
  *
- *   wstatus: a pointer to the int value
+ *   parser: a pointer to the parser
+ *   keyword: the keyword to check for
+ *
+ *   returns: true if the next token is the keyword; false otherwise
  */
-void printStatus(int status) {
+bool isKeyword(parser_t* parser, const char* keyword) {
+	token_t* token = &parser->token;
+	return peekToken(parser) == TOKEN_WORD && !token->expand && !token->glob && !token->quoted
+		&& strcmp(token->text, keyword) == 0;
+}
+
+/*
+ * Function: skipNewlines
+ * ----------------------------
+ *   Consumes the ends of lines at the next token, inside a compound command they separate
+ *   commands like ;.
+ *
+ *   parser: a pointer to the parser
+ */
+void skipNewlines(parser_t* parser) {
+	while (peekToken(parser) == TOKEN_NEWLINE) {
+		parser->peeked = false;
+	}
+}
+
+/*
+ * Function: syntaxError
+ * ----------------------------
+ *   Prints a syntax error at the next token and fails the parse.
+ *
+ *   parser: a pointer to the parser
+ *   expected: what was expected at the token, or NULL if the token is unexpected
+ */
+void syntaxError(parser_t* parser, const char* expected) {
+	static const char* const names[] = { "end of file", NULL, INPUT_CHAR, OUTPUT_CHAR, BACKGROUND_CHAR,
+		PIPE_CHAR, SEPARATOR_CHAR, AND_STR, OR_STR, HEREDOC_STR, HERESTRING_STR, NULL, "new line" };
+	token_t* token = &parser->token;
+	tokenKind_t kind = peekToken(parser);
+	const char* text = names[kind];
+	int len = text != NULL ? (int)strlen(text) : (int)token->len;
+	text = text != NULL ? text : token->text;
+	if (kind == TOKEN_ERROR) {
+		fprintf(stderr, "syntax error: %.*s\n", len, text);
+	}
+	else if (expected != NULL) {
+		fprintf(stderr, "syntax error: expected %s before %.*s\n", expected, len, text);
+	}
+	else {
+		fprintf(stderr, "syntax error: unexpected %.*s\n", len, text);
+	}
+	parser->failed = true;
+}
+
+/*
+ * Function: parserExpect
+ * ----------------------------
+ *   Consumes a keyword the grammar requires at the next token.
+ *
+ *   parser: a pointer to the parser
+ *   keyword: the required keyword
+ *
+ *   returns: true if it was there; false otherwise (the error is printed)
+ */
+bool parserExpect(parser_t* parser, const char* keyword) {
+	if (!isKeyword(parser, keyword)) {
+		syntaxError(parser, keyword);
+		return false;
+	}
+	parser->peeked = false;
+	return true;
+}
+
+/*
+ * Function: newNode
+ * ----------------------------
+ *   Allocates an empty node in the parse arena.
+ *
+ *   kind: the kind of the node
+ *
+ *   returns: the node
+ */
+node_t* newNode(nodeKind_t kind) {
+	node_t* node = arenaAlloc(&parseArena, sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->kind = kind;
+	return node;
+}
+
+/*
+ * Function: bufferToken
+ * ----------------------------
+ *   Encodes the next token at the end of the scratch buffer, growing it if needed, and consumes
+ *   it. The token's text may point into a line that the next line replaces, so it is copied now;
+ *   a here-document body already stays in hereDocBuf until the list has run, so only its offset
+ *   and length are kept (SCRIPT_BUFFERED) and the body is never copied again.
+ *
+ *   parser: a pointer to the parser
+ *   size: the bytes already in the scratch buffer
+ *
+ *   returns: the bytes in the scratch buffer with the token
+ */
+size_t bufferToken(parser_t* parser, size_t size) {
+	token_t* token = &parser->token;
+	size_t textSize = token->kind == TOKEN_HEREDOC ? 2 * sizeof(size_t) : token->len + 1;
+	if (size + textSize + 1 > parseScratchCap) {
+		parseScratchCap = (size + textSize + 1) * 2;
+		parseScratch = realloc(parseScratch, parseScratchCap);
+	}
+	parser->peeked = false;
+	if (token->kind != TOKEN_HEREDOC) {
+		return size + encodeToken(parseScratch + size, token);
+	}
+	size_t ref[2] = { token->text - hereDocBuf, token->len };
+	parseScratch[size] = TOKEN_HEREDOC | SCRIPT_BUFFERED | (token->expand ? SCRIPT_EXPAND : 0);
+	memcpy(parseScratch + size + 1, ref, sizeof(ref));
+	return size + 1 + sizeof(ref);
+}
+
+/*
+ * Function: saveTokens
+ * ----------------------------
+ *   Copies the tokens in the scratch buffer to a node.
+ *
+ *   node: a pointer to the node
+ *   size: the bytes in the scratch buffer
+ */
+void saveTokens(node_t* node, size_t size) {
+	node->tokens = arenaAlloc(&parseArena, size ? size : 1);
+	memcpy(node->tokens, parseScratch, size);
+	node->tokensEnd = node->tokens + size;
+}
+
+/*
+ * Function: isPlainLine
+ * ----------------------------
+ *   Checks whether a command line is one simple command, which needs no parse tree: nothing that
+ *   could be ;, & before the end, && or ||, no << and no keyword first. Quotes are not looked at,
+ *   so a line with these characters quoted is merely parsed the long way.
+ *
+ *   line: the command line, not scanned yet
+ *
+ *   returns: true if the line is a plain simple command; false otherwise
+ */
+bool isPlainLine(const char* line) {
+	static const char* const keywords[] = { "if", "then", "elif", "else", "fi", "for", "do", "done", "while" };
+	line += strspn(line, " \t\n\v\f\r");
+	if (*line == '\0' || *line == '#' || *line == '&') {
+		return false;
+	}
+	// keywords are 2 to 5 letters, most first words are not looked up at all
+	size_t firstLen = strcspn(line, " \t\n\v\f\r;&|<>");
+	for (size_t i = 0; firstLen >= 2 && firstLen <= 5 && i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+		if (strncmp(line, keywords[i], firstLen) == 0 && keywords[i][firstLen] == '\0') {
+			return false;
+		}
+	}
+	for (const char* c = strpbrk(line, ";&|<"); c != NULL; c = strpbrk(c + 1, ";&|<")) {
+		if (*c == ';' || (*c == '|' && c[1] == '|') || (*c == '<' && c[1] == '<')
+			|| (*c == '&' && c[1 + strspn(c + 1, " \t\n\v\f\r")] != '\0')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Function: parseLine
+ * ----------------------------
+ *   Parses the command list of a line: commands separated by ;, where an if, for or while goes on
+ *   over the following lines until it is closed. A line that is one plain simple command (see
+ *   isPlainLine) is not scanned here at all: its node keeps the line, which is scanned once when
+ *   it runs.
+ *
+ *   parser: a pointer to a parser over the line, set up by nextParserLine
+ *
+ *   returns: the first command of the list, or NULL on a syntax error (the error is printed)
+ *
+ *   notes: the list is allocated from the parse arena, which is reset once it has run; the line
+ *   of a plain simple command must not be read over before then
+ */
+node_t* parseLine(parser_t* parser) {
+	if (parser->lexer.replay == NULL && !parser->peeked && isPlainLine(parser->lexer.pos)) {
+		node_t* node = newNode(NODE_COMMAND);
+		node->line = parser->lexer.pos;
+		return node;
+	}
+	node_t* list = parseList(parser);
+	// the list stopped at a keyword that closes nothing
+	if (!parser->failed && peekToken(parser) != TOKEN_END) {
+		syntaxError(parser, NULL);
+	}
+	return parser->failed ? NULL : list;
+}
+
+/*
+ * Function: isListEnd
+ * ----------------------------
+ *   Checks whether a list ends at the next token: the end of the line (outside of compound
+ *   commands) or a keyword that continues or closes a compound command.
+ *
+ *   parser: a pointer to the parser
+ *
+ *   returns: true if the list ends; false otherwise
+ */
+bool isListEnd(parser_t* parser) {
+	static const char* const ends[] = { "then", "elif", "else", "fi", "do", "done" };
+	bool end = peekToken(parser) == TOKEN_END;
+	for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]) && !end; i++) {
+		end = isKeyword(parser, ends[i]);
+	}
+	return end;
+}
+
+/*
+ * Function: parseList
+ * ----------------------------
+ *   Parses commands separated by ;, & or the ends of lines and joined by && or ||, up to where
+ *   isListEnd ends it; the keyword there is left unconsumed. The list stays flat: a command
+ *   joined by && or || runs depending on the status of whatever ran last, which makes them left
+ *   associative with equal precedence as in sh.
+ *
+ *   parser: a pointer to the parser
+ *
+ *   returns: the first command of the list; NULL if it is empty or on a syntax error
+ */
+node_t* parseList(parser_t* parser) {
+	node_t* list = NULL;
+	node_t** tail = &list;
+	while (!parser->failed) {
+		skipNewlines(parser);
+		if (isListEnd(parser)) {
+			break;
+		}
+		node_t* node = parseCompound(parser);
+		if (node == NULL) {
+			break;
+		}
+		*tail = node;
+		tail = &node->next;
+		// && and || join the next command to this one, which may be on the next line
+		tokenKind_t join;
+		while ((join = peekToken(parser)) == TOKEN_AND || join == TOKEN_OR) {
+			parser->peeked = false;
+			parser->depth++;
+			skipNewlines(parser);
+			parser->depth--;
+			if (isListEnd(parser)) {
+				syntaxError(parser, "a command");
+				break;
+			}
+			if ((node = parseCompound(parser)) == NULL) {
+				break;
+			}
+			node->join = join;
+			*tail = node;
+			tail = &node->next;
+		}
+		// a command ends at ;, & (which parseSimple keeps), a new line or the end of the line
+		if (!parser->failed && peekToken(parser) == TOKEN_SEMICOLON) {
+			parser->peeked = false;
+		}
+	}
+	return parser->failed ? NULL : list;
+}
+
+/*
+ * Function: parseBody
+ * ----------------------------
+ *   Parses the list of a condition, branch or loop body, which must not be empty.
+ *
+ *   parser: a pointer to the parser
+ *
+ *   returns: the first command of the list, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseBody(parser_t* parser) {
+	node_t* list = parseList(parser);
+	if (list == NULL && !parser->failed) {
+		syntaxError(parser, "a command");
+	}
+	return list;
+}
+
+/*
+ * Function: parseCompound
+ * ----------------------------
+ *   Parses one command of a list: an if, for or while, which like a simple command has to be
+ *   followed by ;, &&, ||, a new line or the end of the line, or else a simple command.
+ *
+ *   parser: a pointer to the parser
+ *
+ *   returns: the command, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseCompound(parser_t* parser) {
+	if (!isKeyword(parser, "if") && !isKeyword(parser, "for") && !isKeyword(parser, "while")) {
+		return parseSimple(parser);
+	}
+	char first = parser->token.text[0];
+	parser->depth++;
+	node_t* node = first == 'i' ? parseIf(parser, false) : first == 'f' ? parseFor(parser) : parseWhile(parser);
+	parser->depth--;
+	tokenKind_t kind = node != NULL ? peekToken(parser) : TOKEN_END;
+	if (kind != TOKEN_SEMICOLON && kind != TOKEN_NEWLINE && kind != TOKEN_END && kind != TOKEN_AND && kind != TOKEN_OR) {
+		syntaxError(parser, NULL);
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Function: parseSimple
+ * ----------------------------
+ *   Parses a simple command: the tokens up to ;, &&, ||, a new line or the end of the line, or up
+ *   to and including &, which parseCommand takes as the last token. They are kept encoded and only
+ *   built into a command (and expanded) when it runs; the tokens of a replayed line are already
+ *   encoded and stay mapped, so the node points at them instead of a copy.
+ *
+ *   parser: a pointer to the parser
+ *
+ *   returns: the command, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseSimple(parser_t* parser) {
+	peekToken(parser);
+	char* start = parser->tokenStart;
+	size_t size = 0;
+	bool empty = true;
+	tokenKind_t kind;
+	while ((kind = peekToken(parser)) != TOKEN_SEMICOLON && kind != TOKEN_NEWLINE && kind != TOKEN_END
+		&& kind != TOKEN_AND && kind != TOKEN_OR) {
+		if (kind == TOKEN_ERROR || (kind == TOKEN_BACKGROUND && empty)) {
+			syntaxError(parser, kind == TOKEN_ERROR ? NULL : "a command");
+			return NULL;
+		}
+		if (start != NULL) {
+			parser->peeked = false;
+		}
+		else {
+			size = bufferToken(parser, size);
+		}
+		empty = false;
+		if (kind == TOKEN_BACKGROUND) {
+			break;
+		}
+	}
+	if (empty) {
+		syntaxError(parser, "a command");
+		return NULL;
+	}
+	node_t* node = newNode(NODE_COMMAND);
+	if (start != NULL) {
+		// up to the token that ended the command, or past the & that did
+		node->tokens = start;
+		node->tokensEnd = parser->peeked ? parser->tokenStart : parser->lexer.replay;
+	}
+	else {
+		saveTokens(node, size);
+	}
+	return node;
+}
+
+/*
+ * Function: parseIf
+ * ----------------------------
+ *   Parses "if list; then list; [elif list; then list;]... [else list;] fi", from the if or elif.
+ *
+ *   parser: a pointer to the parser, at the if or elif
+ *   elif: true for an elif, which shares the fi of its if
+ *
+ *   returns: the if, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseIf(parser_t* parser, bool elif) {
+	parser->peeked = false;
+	node_t* node = newNode(NODE_IF);
+	if ((node->cond = parseBody(parser)) == NULL || !parserExpect(parser, "then")
+		|| (node->body = parseBody(parser)) == NULL) {
+		return NULL;
+	}
+	if (isKeyword(parser, "elif")) {
+		if ((node->elseBody = parseIf(parser, true)) == NULL) {
+			return NULL;
+		}
+	}
+	else if (isKeyword(parser, "else")) {
+		parser->peeked = false;
+		if ((node->elseBody = parseBody(parser)) == NULL) {
+			return NULL;
+		}
+	}
+	return elif || parserExpect(parser, "fi") ? node : NULL;
+}
+
+/*
+ * Function: parseFor
+ * ----------------------------
+ *   Parses "for NAME in words; do list; done". The words are kept encoded and expanded each time
+ *   the loop starts.
+ *
+ *   parser: a pointer to the parser, at the for
+ *
+ *   returns: the loop, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseFor(parser_t* parser) {
+	parser->peeked = false;
+	node_t* node = newNode(NODE_FOR);
+	token_t* token = &parser->token;
+	bool isName = peekToken(parser) == TOKEN_WORD && !token->expand && !token->glob && !token->quoted
+		&& (isalpha((unsigned char)token->text[0]) || token->text[0] == '_');
+	for (size_t i = 1; isName && i < token->len; i++) {
+		isName = isalnum((unsigned char)token->text[i]) || token->text[i] == '_';
+	}
+	if (!isName) {
+		syntaxError(parser, "a variable name");
+		return NULL;
+	}
+	node->name = arenaStrndup(&parseArena, token->text, token->len);
+	parser->peeked = false;
+	if (!parserExpect(parser, "in")) {
+		return NULL;
+	}
+	size_t size = 0;
+	while (peekToken(parser) == TOKEN_WORD) {
+		size = bufferToken(parser, size);
+	}
+	if (peekToken(parser) != TOKEN_SEMICOLON && peekToken(parser) != TOKEN_NEWLINE) {
+		syntaxError(parser, SEPARATOR_CHAR);
+		return NULL;
+	}
+	saveTokens(node, size);
+	parser->peeked = false;
+	skipNewlines(parser);
+	if (!parserExpect(parser, "do") || (node->body = parseBody(parser)) == NULL || !parserExpect(parser, "done")) {
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Function: parseWhile
+ * ----------------------------
+ *   Parses "while list; do list; done".
+ *
+ *   parser: a pointer to the parser, at the while
+ *
+ *   returns: the loop, or NULL on a syntax error (the error is printed)
+ */
+node_t* parseWhile(parser_t* parser) {
+	parser->peeked = false;
+	node_t* node = newNode(NODE_WHILE);
+	if ((node->cond = parseBody(parser)) == NULL || !parserExpect(parser, "do")
+		|| (node->body = parseBody(parser)) == NULL || !parserExpect(parser, "done")) {
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Function: exitCode
+ * ----------------------------
+ *   Converts a wait status to the exit code reported by $?: the exit value, or 128 plus the
+ *   signal number for a child terminated by a signal.
+ *
+ *   status: the wait status
+ *
+ *   returns: the exit code
+ */
+int exitCode(int status) {
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
+
+/*
+ * Function: expandVariable
+ * ----------------------------
+ *   Resolves the variable reference starting at a $: $$, $?, $!, $NAME or ${NAME}. A $ that does
+ *   not start a reference stands for itself; unset variables expand to nothing.
+ *
+ *   ref: the $ starting the reference
+ *   end: the end of the word containing it
+ *   value: set to the value of the variable
+ *   valueLen: set to the length of the value
+ *   numBuf: buffer of at least MAX_PID_STR_SIZE + 1 bytes that numeric values are formatted into
+ *
+ *   returns: the number of characters of the reference, at least 1
+ */
+size_t expandVariable(const char* ref, const char* end, const char** value, size_t* valueLen, char* numBuf) {
+	const char* name = ref + 1;
+	*value = "$";
+	*valueLen = 1;
+	if (name >= end) {
+		return 1;
+	}
+	switch (*name) {
+	case '$':
+		*value = shellPid;
+		*valueLen = shellPidLength;
+		return 2;
+	case '?':
+		*valueLen = sprintf(numBuf, "%d", exitCode(foregroundStatus));
+		*value = numBuf;
+		return 2;
+	case '!':
+		*valueLen = lastBackgroundPid ? sprintf(numBuf, "%d", lastBackgroundPid) : 0;
+		*value = numBuf;
+		return 2;
+	}
+
+	bool braced = *name == '{';
+	name += braced;
+	const char* nameEnd = name;
+	if (nameEnd < end && (isalpha((unsigned char)*nameEnd) || *nameEnd == '_')) {
+		while (nameEnd < end && (isalnum((unsigned char)*nameEnd) || *nameEnd == '_')) {
+			nameEnd++;
+		}
+	}
+	if (nameEnd == name || (braced && (nameEnd >= end || *nameEnd != '}'))) {
+		// not a reference, keep the $
+		return 1;
+	}
+
+	// look the name up without copying it out of the word
+	size_t nameLength = nameEnd - name;
+	*value = "";
+	*valueLen = 0;
+	for (char** env = environ; *env != NULL; env++) {
+		if (strncmp(*env, name, nameLength) == 0 && (*env)[nameLength] == '=') {
+			*value = *env + nameLength + 1;
+			*valueLen = strlen(*value);
+			break;
+		}
+	}
+	return nameEnd - ref + braced;
+}
+
+/*
+ * Function: copyExpansion
+ * ----------------------------
+ *   Copies the value of a variable into an expanded word, or only measures it.
+ *
+ *   out: where to write the value, or NULL to only measure it
+ *   value: the value
+ *   len: the length of the value
+ *   pattern: whether the word is a glob pattern, in which case the value's glob characters are
+ *   escaped so they match literally
+ *
+ *   returns: the number of characters written
+ */
+size_t copyExpansion(char* out, const char* value, size_t len, bool pattern) {
+	if (!pattern) {
+		if (out) {
+			memcpy(out, value, len);
+		}
+		return len;
+	}
+	size_t length = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (strchr(GLOB_ESCAPES, value[i]) != NULL) {
+			if (out) {
+				out[length] = '\\';
+			}
+			length++;
+		}
+		if (out) {
+			out[length] = value[i];
+		}
+		length++;
+	}
+	return length;
+}
+
+/*
+ * Function: expandWord
+ * ----------------------------
+ *   Unquotes and expands a raw word in one linear pass, either measuring the result or writing
+ *   it. Words without quotes jump from $ to $ with memchr and copy the runs in between.
+ *
+ *   word: the raw word
+ *   len: the length of the raw word
+ *   quoted: whether the word contains quotes or backslashes
+ *   pattern: whether to produce a glob pattern, in which glob characters that were quoted,
+ *   escaped or part of a variable's value are escaped with a backslash
+ *   out: buffer to write the result to, or NULL to only measure it
+ *
+ *   returns: the length of the result
+ */
+size_t expandWord(const char* word, size_t len, bool quoted, bool pattern, char* out) {
+	char numBuf[MAX_PID_STR_SIZE + 1];
+	const char* value;
+	size_t valueLen;
+	const char* end = word + len;
+	size_t length = 0;
+
+	if (!quoted) {
+		const char* in = word;
+		while (in < end) {
+			const char* dollar = memchr(in, '$', end - in);
+			const char* runEnd = dollar ? dollar : end;
+			if (out) {
+				memcpy(out + length, in, runEnd - in);
+			}
+			length += runEnd - in;
+			if (dollar == NULL) {
+				break;
+			}
+			in = dollar + expandVariable(dollar, end, &value, &valueLen, numBuf);
+			length += copyExpansion(out ? out + length : NULL, value, valueLen, pattern);
+		}
+		return length;
+	}
+
+	char quote = '\0';
+	for (const char* in = word; in < end; in++) {
+		bool literal = quote != '\0';
+		if (quote == '\'') {
+			if (*in == '\'') {
+				quote = '\0';
+				continue;
+			}
+		}
+		else if (*in == '\\' && in + 1 < end
+			&& (quote == '\0' || strchr(DQUOTE_ESCAPES, in[1]) != NULL)) {
+			in++;
+			literal = true;
+		}
+		else if (*in == '"' || (*in == '\'' && quote == '\0')) {
+			quote = quote ? '\0' : *in;
+			continue;
+		}
+		else if (*in == '$') {
+			size_t refLength = expandVariable(in, end, &value, &valueLen, numBuf);
+			length += copyExpansion(out ? out + length : NULL, value, valueLen, pattern);
+			in += refLength - 1;
+			continue;
+		}
+		if (pattern && literal && strchr(GLOB_ESCAPES, *in) != NULL) {
+			if (out) {
+				out[length] = '\\';
+			}
+			length++;
+		}
+		if (out) {
+			out[length] = *in;
+		}
+		length++;
+	}
+	return length;
+}
+
+/*
+ * Function: expandCommand
+ * ----------------------------
+ *   Expands a raw word: removes its quotes and escapes and replaces $$, $?, $!, $NAME and ${NAME}
+ *   outside single quotes with their values. Expansion occurs left to right. The result is
+ *   measured first so it is allocated at its exact size.
+ *
+ *	 word: the raw word to expand
+ *   len: the length of the raw word
+ *
+ *   returns: a pointer to the expanded string
+ * 
+ *	 notes: the returned string is allocated from the command arena
+ */
+char* expandCommand(const char* word, size_t len) {
+	bool quoted = memchr(word, '\'', len) || memchr(word, '"', len) || memchr(word, '\\', len);
+	size_t newLength = expandWord(word, len, quoted, false, NULL);
+	char* expandedStr = arenaAlloc(&commandArena, newLength + 1);
+	expandWord(word, len, quoted, false, expandedStr);
+	expandedStr[newLength] = '\0';
+	return expandedStr;
+}
+
+/*
+ * Function: expandHereDoc
+ * ----------------------------
+ *   Expands the body of a here-document: $ references are replaced like in an unquoted word, but
+ *   quotes and backslashes are kept as they are.
+ *
+ *   body: the raw body
+ *   len: the length of the body
+ *   newLen: set to the length of the expanded body
+ *
+ *   returns: a pointer to the expanded body, allocated from the command arena
+ */
+char* expandHereDoc(const char* body, size_t len, size_t* newLen) {
+	*newLen = expandWord(body, len, false, false, NULL);
+	char* expanded = arenaAlloc(&commandArena, *newLen + 1);
+	expandWord(body, len, false, false, expanded);
+	expanded[*newLen] = '\0';
+	return expanded;
+}
+
+/*
+ * Function: expandPattern
+ * ----------------------------
+ *   Expands a raw word like expandCommand, but into a glob pattern: glob characters that were
+ *   quoted or came from a variable are escaped with a backslash so they only match themselves.
+ *
+ *	 word: the raw word to expand
+ *   len: the length of the raw word
+ *
+ *   returns: a pointer to the pattern, allocated from the command arena
+ */
+char* expandPattern(const char* word, size_t len) {
+	size_t newLength = expandWord(word, len, true, true, NULL);
+	char* pattern = arenaAlloc(&commandArena, newLength + 1);
+	expandWord(word, len, true, true, pattern);
+	pattern[newLength] = '\0';
+	return pattern;
+}
+
+/*
+ * Function: compileGlob
+ * ----------------------------
+ *   Compiles a glob pattern for one path component into a matcher: a sequence of positions that
+ *   are each a * or a set of characters. ? is every character, [...] a set (with ranges and ! or
+ *   ^ to negate it; an unclosed [ is a literal), and a backslash makes the next character literal.
+ *
+ *   pattern: the pattern, without /
+ *   len: the length of the pattern
+ *   matcher: the matcher to fill in; its arrays are allocated from the command arena
+ */
+void compileGlob(const char* pattern, size_t len, globMatcher_t* matcher) {
+	matcher->sets = arenaAlloc(&commandArena, sizeof(*matcher->sets) * (len + 1));
+	matcher->stars = arenaAlloc(&commandArena, sizeof(*matcher->stars) * (len + 1));
+	matcher->numOps = 0;
+	matcher->dotOk = len > 0 && pattern[0] == '.';
+	const char* end = pattern + len;
+	int lastStar = -1;
+	for (const char* p = pattern; p < end; p++) {
+		int op = matcher->numOps++;
+		uint8_t* set = matcher->sets[op];
+		memset(set, 0, sizeof(matcher->sets[op]));
+		matcher->stars[op] = false;
+		if (*p == '*') {
+			matcher->stars[op] = true;
+			lastStar = op;
+			// consecutive stars are one star
+			while (p + 1 < end && p[1] == '*') {
+				p++;
+			}
+			continue;
+		}
+		if (*p == '?') {
+			memset(set, 0xff, sizeof(matcher->sets[op]));
+			continue;
+		}
+		if (*p == '[') {
+			// find the closing ], a ] right after [ or [! is part of the set
+			const char* q = p + 1;
+			bool negate = q < end && (*q == '!' || *q == '^');
+			q += negate;
+			const char* first = q;
+			while (q < end && (*q != ']' || q == first)) {
+				q += *q == '\\' && q + 1 < end ? 2 : 1;
+			}
+			if (q < end) {
+				for (const char* c = first; c < q; c++) {
+					if (*c == '\\' && c + 1 < q) {
+						c++;
+					}
+					unsigned char low = *c, high = *c;
+					if (c + 2 < q && c[1] == '-') {
+						high = c[2];
+						c += 2;
+					}
+					for (unsigned int ch = low; ch <= high; ch++) {
+						set[ch >> 3] |= 1 << (ch & 7);
+					}
+				}
+				if (negate) {
+					for (size_t i = 0; i < sizeof(matcher->sets[op]); i++) {
+						set[i] = ~set[i];
+					}
+				}
+				p = q;
+				continue;
+			}
+		}
+		if (*p == '\\' && p + 1 < end) {
+			p++;
+		}
+		unsigned char ch = *p;
+		set[ch >> 3] |= 1 << (ch & 7);
+	}
+
+	// the positions after the last * that are single characters form a literal suffix
+	matcher->suffixLen = 0;
+	if (lastStar != -1) {
+		char* suffix = arenaAlloc(&commandArena, matcher->numOps - lastStar);
+		for (int op = lastStar + 1; op < matcher->numOps; op++) {
+			int count = 0;
+			unsigned char literal = 0;
+			for (unsigned int ch = 0; ch < 256 && count < 2; ch++) {
+				if (matcher->sets[op][ch >> 3] & (1 << (ch & 7))) {
+					literal = ch;
+					count++;
+				}
+			}
+			if (count != 1) {
+				matcher->suffixLen = 0;
+				break;
+			}
+			suffix[matcher->suffixLen++] = literal;
+		}
+		matcher->suffix = suffix;
+	}
+}
+
+/*
+ * Function: globMatch
+ * ----------------------------
+ *   Matches a file name against a compiled pattern. A * that fails to match is retried one
+ *   character further on from the last *, which keeps matching linear for the usual patterns.
+ *
+ *   matcher: a pointer to the compiled pattern
+ *   name: the file name
+ *   len: the length of the name
+ *
+ *   returns: true if the name matches; false otherwise
+ */
+bool globMatch(const globMatcher_t* matcher, const char* name, size_t len) {
+	// names starting with . are only matched by patterns starting with .
+	if (name[0] == '.' && !matcher->dotOk) {
+		return false;
+	}
+	if (len < matcher->suffixLen || memcmp(name + len - matcher->suffixLen, matcher->suffix, matcher->suffixLen) != 0) {
+		return false;
+	}
+	int op = 0;
+	int starOp = -1;
+	size_t starPos = 0;
+	size_t pos = 0;
+	while (pos < len) {
+		unsigned char ch = name[pos];
+		if (op < matcher->numOps && matcher->stars[op]) {
+			starOp = ++op;
+			starPos = pos;
+		}
+		else if (op < matcher->numOps && (matcher->sets[op][ch >> 3] & (1 << (ch & 7)))) {
+			op++;
+			pos++;
+		}
+		else if (starOp != -1) {
+			op = starOp;
+			pos = ++starPos;
+		}
+		else {
+			return false;
+		}
+	}
+	while (op < matcher->numOps && matcher->stars[op]) {
+		op++;
+	}
+	return op == matcher->numOps;
+}
+
+/*
+ * Function: listDirectory
+ * ----------------------------
+ *   Reads a directory with bulk getdents64 calls straight into the listing arena. Listings are
+ *   cached for the rest of the command line, so every pattern on the line that looks into a
+ *   directory shares one scan of it.
+ *
+ *   path: the directory, "" for the working directory
+ *
+ *   returns: a pointer to the listing, or NULL if the directory could not be opened
+ */
+dirListing_t* listDirectory(const char* path) {
+	// the command arena is reset after every line, so the listings of an earlier line are stale
+	if (listingResets != commandArena.resets) {
+		destroyArena(&listingArena);
+		dirListings = NULL;
+		listingResets = commandArena.resets;
+	}
+	for (dirListing_t* listing = dirListings; listing != NULL; listing = listing->next) {
+		if (strcmp(listing->path, path) == 0) {
+			return listing;
+		}
+	}
+
+	int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	dirListing_t* listing = arenaAlloc(&listingArena, sizeof(*listing));
+	listing->path = arenaStrndup(&listingArena, path, strlen(path));
+	// a directory that outgrows its space moves to twice as much, the old space goes with the arena
+	size_t cap = DIRENT_BUF_SIZE;
+	size_t size = 0;
+	char* records = arenaAlloc(&listingArena, cap);
+	ssize_t n;
+	while ((n = getdents64(fd, records + size, cap - size)) > 0) {
+		size += n;
+		if (cap - size < DIRENT_BUF_SIZE) {
+			cap *= 2;
+			char* moved = arenaAlloc(&listingArena, cap);
+			memcpy(moved, records, size);
+			records = moved;
+		}
+	}
+	close(fd);
+	arenaShrink(&listingArena, records, size);
+
+	listing->records = records;
+	listing->size = size;
+	listing->next = dirListings;
+	dirListings = listing;
+	return listing;
+}
+
+/*
+ * Function: hasGlobChars
+ * ----------------------------
+ *   Checks a path component of a pattern for unescaped glob characters, a [ only counting if a ]
+ *   closes it.
+ *
+ *   pattern: the component
+ *   len: the length of the component
+ *
+ *   returns: true if the component is a pattern; false if it is a literal name
+ */
+bool hasGlobChars(const char* pattern, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (pattern[i] == '\\') {
+			i++;
+		}
+		else if (pattern[i] == '*' || pattern[i] == '?') {
+			return true;
+		}
+		else if (pattern[i] == '[') {
+			for (size_t j = i + 2; j < len; j++) {
+				if (pattern[j] == ']') {
+					return true;
+				}
+				j += pattern[j] == '\\';
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * Function: compareStrings
+ * ----------------------------
+ *   qsort comparator for strings in byte order.
+ */
+int compareStrings(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * Function: expandGlob
+ * ----------------------------
+ *   Expands a word with glob characters to the file names it matches, sorted in byte order, and
+ *   appends them to a command's arguments. The pattern is walked one path component at a time:
+ *   literal components are appended as they are, and pattern components are matched against
+ *   the cached listing of every directory reached so far. A word that matches nothing is
+ *   appended unchanged (without its quotes).
+ *
+ *   command: a pointer to the command struct
+ *   token: a pointer to the word token
+ */
+void expandGlob(command_t* command, token_t* token) {
+	char* pattern = token->expand ? expandPattern(token->text, token->len) : token->text;
+	int numPaths = 1;
+	char** paths = arenaAlloc(&commandArena, sizeof(*paths));
+	paths[0] = pattern[0] == '/' ? "/" : "";
+	bool mustExist = false;
+
+	const char* component = pattern;
+	while (*component == '/') {
+		component++;
+	}
+	while (*component != '\0' && numPaths > 0) {
+		const char* componentEnd = strchrnul(component, '/');
+		size_t len = componentEnd - component;
+		const char* next = componentEnd;
+		while (*next == '/') {
+			next++;
+		}
+		// a trailing / makes the last component a directory as well
+		bool last = *componentEnd == '\0';
+
+		if (!hasGlobChars(component, len)) {
+			// a literal name, with its escapes removed
+			char* name = arenaAlloc(&commandArena, len + 1);
+			size_t nameLen = 0;
+			for (size_t i = 0; i < len; i++) {
+				i += component[i] == '\\' && i + 1 < len;
+				name[nameLen++] = component[i];
+			}
+			for (int i = 0; i < numPaths; i++) {
+				size_t pathLen = strlen(paths[i]);
+				char* path = arenaAlloc(&commandArena, pathLen + nameLen + 2);
+				sprintf(path, "%s%.*s%s", paths[i], (int)nameLen, name, last ? "" : "/");
+				paths[i] = path;
+			}
+			mustExist = true;
+		}
+		else {
+			globMatcher_t matcher;
+			compileGlob(component, len, &matcher);
+			int numMatches = 0;
+			int matchesCap = 8;
+			char** matches = arenaAlloc(&commandArena, sizeof(*matches) * matchesCap);
+			for (int i = 0; i < numPaths; i++) {
+				dirListing_t* listing = listDirectory(paths[i]);
+				if (listing == NULL) {
+					continue;
+				}
+				size_t pathLen = strlen(paths[i]);
+				for (size_t offset = 0; offset < listing->size; ) {
+					struct dirent64* entry = (struct dirent64*)(listing->records + offset);
+					offset += entry->d_reclen;
+					const char* name = entry->d_name;
+					size_t nameLen = strlen(name);
+					if ((name[0] == '.' && (nameLen == 1 || (nameLen == 2 && name[1] == '.')))
+						|| !globMatch(&matcher, name, nameLen)) {
+						continue;
+					}
+					char* path = arenaAlloc(&commandArena, pathLen + nameLen + 2);
+					memcpy(path, paths[i], pathLen);
+					memcpy(path + pathLen, name, nameLen);
+					path[pathLen + nameLen] = '\0';
+					// only directories lead on to the next component
+					if (!last) {
+						struct stat st;
+						bool isDir = entry->d_type == DT_DIR;
+						if ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && stat(path, &st) == 0) {
+							isDir = S_ISDIR(st.st_mode);
+						}
+						if (!isDir) {
+							continue;
+						}
+						path[pathLen + nameLen] = '/';
+						path[pathLen + nameLen + 1] = '\0';
+					}
+					if (numMatches == matchesCap) {
+						char** grown = arenaAlloc(&commandArena, sizeof(*grown) * matchesCap * 2);
+						memcpy(grown, matches, sizeof(*matches) * numMatches);
+						matches = grown;
+						matchesCap *= 2;
+					}
+					matches[numMatches++] = path;
+				}
+			}
+			paths = matches;
+			numPaths = numMatches;
+			mustExist = false;
+		}
+		component = next;
+	}
+
+	int numFound = 0;
+	for (int i = 0; i < numPaths; i++) {
+		struct stat st;
+		// a literal name after the last pattern was never looked up
+		if (!mustExist || lstat(paths[i], &st) == 0) {
+			paths[numFound++] = paths[i];
+		}
+	}
+	if (numFound == 0) {
+		pushArg(command, wordText(token));
+		return;
+	}
+	qsort(paths, numFound, sizeof(*paths), compareStrings);
+	for (int i = 0; i < numFound; i++) {
+		pushArg(command, paths[i]);
+	}
+}
+
+/*
+ * Function: showPrompt
+ * ----------------------------
+ *   Writes the queued notifications, followed by the prompt in interactive mode, in one batch. The
+ *   lines of an open if, for or while get the continuation prompt.
+ */
+void showPrompt(void) {
+	if (interactive) {
+		const char* prompt = promptContinued ? CONTINUE_CHAR : PROMPT_CHAR;
+		queueNotification(prompt, strlen(prompt));
+	}
+	flushNotifications();
+}
+
+/*
+ * Function: getCommand
+ * ----------------------------
+ *   Gets a user-inputted command, running the event loop while waiting for input. The prompt is
+ *   only printed in interactive mode; it is written together with the queued notifications.
+ *
+ *   reader: the line reader to read the command from
+ *
+ *   returns: a pointer to the first character in the command, or NULL at EOF
+ *
+ *   notes: the command points into the reader's buffer and is valid until the next call
+ */
+char* getCommand(lineReader_t* reader) {
+	char* line;
+	showPrompt();
+	while (true) {
+		if ((line = readLine(reader)) == NULL) {
+			return NULL;
+		}
+		// input validation (in case user just presses enter)
+		// also check if empty space or if user starts with COMMENT_CHAR (#)
+		if (strncmp(line, COMMENT_CHAR, 1) != 0 && !isEmptyString(line)) {
+			return line;
+		}
+		showPrompt();
+	}
+}
+
+/*
+ * Function: readLine
+ * ----------------------------
+ *   Gets the next line of a reader as it is, running the event loop while waiting for input.
+ *
+ *   reader: the line reader to read from
+ *
+ *   returns: the line, or NULL at EOF
+ *
+ *   notes: the line points into the reader's buffer, which reading more lines may move
+ */
+char* readLine(lineReader_t* reader) {
+	char* line;
+	while ((line = nextLine(reader)) == NULL) {
+		if (reader->eof) {
+			return NULL;
+		}
+		waitForInput(reader->fd);
+		fillReader(reader);
+	}
+	return line;
+}
+
+/*
+ * Function: readHereDoc
+ * ----------------------------
+ *   Completes a << token: scans its delimiter and reads the following lines up to a line that is
+ *   just the delimiter (or EOF) as the body. The body is expanded when the command runs unless
+ *   the delimiter has quotes. A mapped reader's lines are contiguous, so their new lines are put
+ *   back and the body is left where it is; the lines of other readers are appended to hereDocBuf,
+ *   and the rest of the current line is copied first since reading may move it.
+ *
+ *   reader: the line reader the command line came from
+ *   lexer: the lexer of the command line, just past the <<
+ *   token: the << token, given the body as its text; or a TOKEN_ERROR if there is no delimiter
+ *
+ *   notes: a body in hereDocBuf is valid until the list has run, but hereDocBuf may move as later
+ *   bodies are appended, so the parser keeps its offset (see bufferToken)
+ */
+void readHereDoc(lineReader_t* reader, lexer_t* lexer, token_t* token) {
+	token_t delim;
+	if (lexNext(lexer, &delim) != TOKEN_WORD) {
+		token->text = "expected a delimiter after " HEREDOC_STR;
+		token->len = strlen(token->text);
+		token->kind = TOKEN_ERROR;
+		return;
+	}
+	if (!reader->mapped) {
+		delim.text = arenaStrndup(&parseArena, delim.text, delim.len);
+		char* rest = lexer->held ? lexer->pos + 1 : lexer->pos;
+		size_t restLen = strlen(rest);
+		char* copy = arenaAlloc(&parseArena, restLen + 2);
+		copy[0] = lexer->held;
+		memcpy(copy + (lexer->held != '\0'), rest, restLen + 1);
+		initLexer(lexer, copy);
+	}
+
+	char* first = NULL;
+	char* end = NULL;
+	size_t start = hereDocUsed;
+	char* line;
+	while (true) {
+		// a mapped script is read before the shell starts, and never prompts
+		if (!reader->mapped) {
+			promptContinued = true;
+			showPrompt();
+			promptContinued = false;
+		}
+		// like sh, EOF ends a here-document that is never closed
+		if ((line = readLine(reader)) == NULL) {
+			end = reader->buf + reader->end;
+			break;
+		}
+		size_t lineLen = strlen(line);
+		if (lineLen == delim.len && memcmp(line, delim.text, lineLen) == 0) {
+			end = line;
+			break;
+		}
+		first = first != NULL ? first : line;
+		if (reader->mapped) {
+			// put back the new line, unless this is an unterminated last line
+			if (line + lineLen < reader->buf + reader->end) {
+				line[lineLen] = '\n';
+			}
+			continue;
+		}
+		if (hereDocUsed + lineLen + 2 > hereDocCap) {
+			hereDocCap = (hereDocUsed + lineLen + 2) * 2;
+			hereDocBuf = realloc(hereDocBuf, hereDocCap);
+		}
+		memcpy(hereDocBuf + hereDocUsed, line, lineLen);
+		hereDocBuf[hereDocUsed + lineLen] = '\n';
+		hereDocUsed += lineLen + 1;
+	}
+
+	if (reader->mapped && first != NULL) {
+		// the delimiter line is consumed, its first byte terminates the body
+		*end = '\0';
+		token->text = first;
+		token->len = end - first;
+	}
+	else if (reader->mapped) {
+		token->text = "";
+		token->len = 0;
+	}
+	else {
+		if (hereDocUsed + 1 > hereDocCap) {
+			hereDocCap = (hereDocUsed + 1) * 2;
+			hereDocBuf = realloc(hereDocBuf, hereDocCap);
+		}
+		hereDocBuf[hereDocUsed] = '\0';
+		token->text = hereDocBuf + start;
+		token->len = hereDocUsed - start;
+		hereDocUsed++;
+	}
+	token->expand = !delim.quoted && memchr(token->text, '$', token->len) != NULL;
+	token->glob = false;
+	token->quoted = false;
+}
+
+/*
+ * Function: isEmptyString
+ * ----------------------------
+ *   Checks if a given string is all empty space.
+ *
+ *   s: a pointer to the string to check
+ * 
+ *	 returns: 0 if not empty; 1 if empty
+ */
+int isEmptyString(char* s) {
+	for (int i = 0; s[i] != '\0'; i++) {
+		if (!isspace(s[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Function: changeDirectory
+ * ----------------------------
+ *   Wrapper for the chdir() function. If command does not contain any args, changes to the
+ *   default HOME directory (i.e. getenv("HOME
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if unsuccessful
+ */
+int changeDirectory(command_t* command) {
+	int retVal;
+	// double check command is CD_CMD
+	if (strcmp(command->command, CD_CMD) != 0) {
+		return -1;
+	}
+	// if no args, cd to HOME
+	if (command->numArgs == 0) {
+		retVal = chdir(getenv("HOME"));
+	}
+	// otherwise do whatever chdir normally does, ignoring other args besides first
+	else {
+		retVal = chdir(command->args[0]);
+	}
+	if (retVal != 0) {
+		perror("Error");
+	}
+	return retVal;
+}
+
+/*
+ * Function: printStatus
+ * ----------------------------
+ *   Prints the status of the last terminated/completed wstatus
+ *
+ *   wstatus: a pointer to the int value
+ */
+void printStatus(int status) {
 	// if exited
 	if (WIFEXITED(status)) {
 		printf("exit value %d\n", WEXITSTATUS(status));
 		fflush(stdout);
 	}
-	// if signal termination
-	else if (WIFSIGNALED(status)) {
-		printf("terminated by signal %d\n", WTERMSIG(status));
-		fflush(stdout);
+	// if signal termination
+	else if (WIFSIGNALED(status)) {
+		printf("terminated by signal %d\n", WTERMSIG(status));
+		fflush(stdout);
+	}
+}
+
+/*
+ * Function: printCommand
+ * ----------------------------
+ *   Prints out a given command struct for testing purposes.
+ *
+ *   command: a pointer to the command struct to print out
+ */
+void printCommand(command_t* command) {
+
+	if (command->isBackground) {
+		printf("Background: True\n");
+		fflush(stdout);
+	}
+	else {
+		printf("Background: False\n");
+		fflush(stdout);
+	}
+
+	if (command->command) {
+		printf("Command Name: %s\n", command->command);
+		fflush(stdout);
+	}
+	else {
+		printf("Not a command.\n");
+		fflush(stdout);
+	}
+
+	printf("numArgs: %d\n", command->numArgs);
+	fflush(stdout);
+
+	for (int i = 0; i < command->numArgs; i++) {
+		printf("Arg %d: %s\n", i, command->args[i]);
+		fflush(stdout);
+	}
+	
+	if (command->inputFile) {
+		printf("Input File: %s\n", command->inputFile);
+		fflush(stdout);
+	}
+	else {
+		printf("No input file.\n");
+		fflush(stdout);
+	}
+
+	if (command->outputFile) {
+		printf("Output File: %s\n", command->outputFile);
+		fflush(stdout);
+	}
+	else {
+		printf("No output file.\n");
+		fflush(stdout);
+	}
+}
+
+/*
+ * Function: initCommand
+ * ----------------------------
+ *   Initializes a given command struct with default values.
+ *
+ *   command: a pointer to the command struct to print out
+ */
+void initCommand(command_t* command) {
+	command->command = NULL;
+	command->numArgs = 0;
+	command->args = NULL;
+	command->argv = NULL;
+	command->argvCap = 0;
+	command->inputFile = NULL;
+	command->hereDoc = NULL;
+	command->hereDocLen = 0;
+	command->outputFile = NULL;
+	command->isBackground = false;
+	command->next = NULL;
+}
+
+/*
+ * Function: destroyCommand
+ * ----------------------------
+ *   Frees dynamically allocated memory associated with given command structure by resetting the
+ *   command arena.
+ *
+ *   command: a pointer to the command structure to destroy
+ *
+ *   notes: this frees every command created since the last destroyCommand
+ */
+void destroyCommand(command_t* command) {
+	// everything the command owns came from the command arena
+	arenaReset(&commandArena);
+}
+
+/*
+ * Function: initEventLoop
+ * ----------------------------
+ *   Blocks SIGCHLD and routes it through a signalfd watched by the shell's epoll set. Children
+ *   are then reaped from the event loop instead of from a signal handler.
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int initEventLoop(void) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sigchldFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigchldFd == -1) {
+		perror("signalfd");
+		return -1;
+	}
+	eventFd = epoll_create1(EPOLL_CLOEXEC);
+	if (eventFd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = sigchldFd;
+	if (epoll_ctl(eventFd, EPOLL_CTL_ADD, sigchldFd, &event) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: dispatchEvents
+ * ----------------------------
+ *   Waits for events on the shell's epoll set and handles them.
+ *
+ *   timeout: milliseconds to wait, -1 to wait until an event arrives, 0 to only poll
+ */
+void dispatchEvents(int timeout) {
+	struct epoll_event events[MAX_EVENTS];
+	int numEvents = epoll_wait(eventFd, events, MAX_EVENTS, timeout);
+	// EINTR (e.g. SIGTSTP) just means the caller checks its condition again
+	for (int i = 0; i < numEvents; i++) {
+		if (events[i].data.fd == sigchldFd) {
+			reapChildren();
+		}
+		else if (events[i].data.fd == zygoteFd) {
+			receiveSlots();
+		}
+		else if (events[i].data.fd == serverFd) {
+			acceptClients();
+		}
+		else if (events[i].data.fd == stopFd) {
+			struct signalfd_siginfo info;
+			if (read(stopFd, &info, sizeof(info)) > 0) {
+				exitRequested = true;
+			}
+		}
+		else if (findOutputFd(events[i].data.fd) != NULL) {
+			drainJobOutput(findOutputFd(events[i].data.fd));
+		}
+		else {
+			clientEvent(events[i].data.fd, events[i].events);
+		}
+	}
+}
+
+/*
+ * Function: addUsage
+ * ----------------------------
+ *   Adds the resources a reaped child used to a job's usage.
+ *
+ *   usage: a pointer to the usage of the job
+ *   ru: the resource usage of the child, as filled in by wait4()
+ */
+void addUsage(usage_t* usage, const struct rusage* ru) {
+	timeradd(&usage->ru.ru_utime, &ru->ru_utime, &usage->ru.ru_utime);
+	timeradd(&usage->ru.ru_stime, &ru->ru_stime, &usage->ru.ru_stime);
+	if (ru->ru_maxrss > usage->ru.ru_maxrss) {
+		usage->ru.ru_maxrss = ru->ru_maxrss;
+	}
+	usage->ru.ru_minflt += ru->ru_minflt;
+	usage->ru.ru_majflt += ru->ru_majflt;
+	usage->ru.ru_nvcsw += ru->ru_nvcsw;
+	usage->ru.ru_nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * Function: startUsage
+ * ----------------------------
+ *   Clears a job's usage and starts its wall clock.
+ *
+ *   usage: a pointer to the usage of the job
+ */
+void startUsage(usage_t* usage) {
+	memset(usage, 0, sizeof(*usage));
+	clock_gettime(CLOCK_MONOTONIC, &usage->start);
+}
+
+/*
+ * Function: elapsedSeconds
+ * ----------------------------
+ *   Computes the time between two CLOCK_MONOTONIC readings.
+ *
+ *   start: the earlier reading
+ *   end: the later reading
+ *
+ *   returns: the elapsed time in seconds
+ */
+double elapsedSeconds(const struct timespec* start, const struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Function: printUsage
+ * ----------------------------
+ *   Prints the wall time, CPU time, peak memory, page faults and context switches of a job, one
+ *   tab separated name and value per line.
+ *
+ *   stream: the stream to print to
+ *   usage: a pointer to the usage of the job
+ */
+void printUsage(FILE* stream, const usage_t* usage) {
+	const struct rusage* ru = &usage->ru;
+	fprintf(stream, "real\t%.3fs\nuser\t%ld.%03lds\nsys\t%ld.%03lds\n", elapsedSeconds(&usage->start, &usage->end),
+		(long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000, (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000);
+	fprintf(stream, "maxrss\t%ld KB\nfaults\t%ld minor, %ld major\nctxsw\t%ld voluntary, %ld involuntary\n",
+		ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+	fflush(stream);
+}
+
+/*
+ * Function: traceClock
+ * ----------------------------
+ *   Reads the clock for tracing. Async-signal-safe, so children of vfork may call it.
+ *
+ *   returns: CLOCK_MONOTONIC in nanoseconds, or 0 if tracing is off
+ */
+uint64_t traceClock(void) {
+	if (!tracing) {
+		return 0;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Function: traceSpan
+ * ----------------------------
+ *   Stores an event in the trace ring, overwriting the oldest one once it is full. Nothing is
+ *   allocated or written out.
+ *
+ *   name: the name of the event, which must outlive the trace (a literal or a built in's name)
+ *   category: the category of the event, a literal
+ *   tid: the child the event belongs to, 0 for the shell
+ *   command: the number of the command line the event belongs to
+ *   start: when the event started, from traceClock
+ *   end: when the event ended, from traceClock
+ */
+void traceSpan(const char* name, const char* category, pid_t tid, unsigned long command, uint64_t start, uint64_t end) {
+	traceEvent_t* event = &traceEvents[numTraceEvents++ & (TRACE_EVENTS - 1)];
+	event->name = name;
+	event->category = category;
+	event->tid = tid;
+	event->command = command;
+	event->start = start;
+	event->end = end;
+}
+
+/*
+ * Function: traceRecord
+ * ----------------------------
+ *   Records an event of the current command line that ends now, if tracing is on.
+ *
+ *   name: the name of the event, which must outlive the trace
+ *   category: the category of the event, a literal
+ *   tid: the child the event belongs to, 0 for the shell
+ *   start: when the event started, from traceClock
+ */
+void traceRecord(const char* name, const char* category, pid_t tid, uint64_t start) {
+	if (tracing) {
+		traceSpan(name, category, tid, traceCommand, start, traceClock());
+	}
+}
+
+/*
+ * Function: traceChildStamp
+ * ----------------------------
+ *   Claims the slot of the shared trace page for the calling child and stamps its start. Called
+ *   first thing in fork and vfork children, which may only use async-signal-safe calls.
+ *
+ *   returns: a pointer to the child's stamps, or NULL if tracing is off
+ */
+traceChild_t* traceChildStamp(void) {
+	if (!tracing || traceChildren == NULL) {
+		return NULL;
+	}
+	pid_t pid = syscall(SYS_getpid);
+	traceChild_t* stamp = &traceChildren[pid & (TRACE_CHILD_SLOTS - 1)];
+	stamp->pid = pid;
+	stamp->start = traceClock();
+	stamp->redirected = stamp->exec = 0;
+	return stamp;
+}
+
+/*
+ * Function: traceChild
+ * ----------------------------
+ *   Records a reaped child: the time from its launch until it was reaped and, for fork and vfork
+ *   children, the setup and exec stamps it left in the shared page.
+ *
+ *   job: a pointer to the child's job
+ */
+void traceChild(const job_t* job) {
+	uint64_t start = (uint64_t)job->start.tv_sec * 1000000000 + job->start.tv_nsec;
+	traceSpan("wait", "child", job->pid, job->traceCommand, start, traceClock());
+	traceChild_t* stamp = traceChildren != NULL ? &traceChildren[job->pid & (TRACE_CHILD_SLOTS - 1)] : NULL;
+	if (stamp != NULL && stamp->pid == job->pid) {
+		if (stamp->redirected != 0) {
+			traceSpan("redirect", "child", job->pid, job->traceCommand, stamp->start, stamp->redirected);
+		}
+		if (stamp->exec != 0) {
+			traceSpan("exec", "child", job->pid, job->traceCommand, stamp->exec, stamp->exec);
+		}
+		stamp->pid = 0;
+	}
+}
+
+/*
+ * Function: startTrace
+ * ----------------------------
+ *   Turns tracing on. The page children stamp is shared with them (MAP_SHARED), so it is mapped
+ *   once and kept.
+ *
+ *   file: the file the trace is written to, NULL to keep the current one; relative paths are
+ *   resolved now, so cd does not move the trace
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int startTrace(const char* file) {
+	if (traceChildren == NULL) {
+		traceChildren = mmap(NULL, sizeof(*traceChildren) * TRACE_CHILD_SLOTS, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (traceChildren == MAP_FAILED) {
+			traceChildren = NULL;
+			perror("mmap");
+			return -1;
+		}
+	}
+	if (file == NULL && traceFile == NULL) {
+		file = TRACE_DEFAULT_FILE;
+	}
+	if (file != NULL) {
+		char* cwd = file[0] != '/' ? getcwd(NULL, 0) : NULL;
+		free(traceFile);
+		traceFile = malloc((cwd ? strlen(cwd) + 1 : 0) + strlen(file) + 1);
+		sprintf(traceFile, "%s%s%s", cwd ? cwd : "", cwd ? "/" : "", file);
+		free(cwd);
+	}
+	tracing = true;
+	return 0;
+}
+
+/*
+ * Function: writeTrace
+ * ----------------------------
+ *   Writes the events in the trace ring as a Chrome trace event file (chrome://tracing, Perfetto).
+ *   Every event is a complete event ("X") on the track of the shell or of its child; timestamps
+ *   are in microseconds.
+ *
+ *   file: the file to write
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int writeTrace(const char* file) {
+	FILE* out = fopen(file, "w");
+	if (out == NULL) {
+		perror(file);
+		return -1;
+	}
+	pid_t pid = getpid();
+	unsigned long first = numTraceEvents > TRACE_EVENTS ? numTraceEvents - TRACE_EVENTS : 0;
+	fprintf(out, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"smallsh\"}}", pid);
+	for (unsigned long i = first; i < numTraceEvents; i++) {
+		const traceEvent_t* event = &traceEvents[i & (TRACE_EVENTS - 1)];
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"command\":%lu}}", event->name, event->category, event->start / 1e3,
+			(event->end - event->start) / 1e3, pid, event->tid != 0 ? event->tid : pid, event->command);
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%lu}}\n", first);
+	if (fclose(out) == EOF) {
+		perror(file);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: traceBuiltin
+ * ----------------------------
+ *   Built in trace [on [file] | off | flush [file]]: turns tracing on or off, or writes the events
+ *   recorded so far (which are kept) to the trace file or another one. Without arguments it
+ *   prints whether tracing is on, how many events are held and the trace file.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 otherwise
+ */
+int traceBuiltin(command_t* command) {
+	char* action = command->numArgs > 0 ? command->args[0] : NULL;
+	char* file = command->numArgs > 1 ? command->args[1] : NULL;
+	if (command->numArgs > 2 || (action != NULL && strcmp(action, "on") != 0 && strcmp(action, "off") != 0
+		&& strcmp(action, "flush") != 0) || (file != NULL && strcmp(action, "off") == 0)) {
+		fprintf(stderr, "usage: trace [on [file] | off | flush [file]]\n");
+		return 1;
+	}
+	if (action == NULL) {
+		unsigned long held = numTraceEvents > TRACE_EVENTS ? TRACE_EVENTS : numTraceEvents;
+		printf("trace %s: %lu events, %lu dropped, %s\n", tracing ? "on" : "off", held, numTraceEvents - held,
+			traceFile != NULL ? traceFile : TRACE_DEFAULT_FILE);
+		fflush(stdout);
+		return 0;
+	}
+	if (strcmp(action, "on") == 0) {
+		return startTrace(file) == 0 ? 0 : 1;
+	}
+	if (strcmp(action, "off") == 0) {
+		tracing = false;
+		return 0;
+	}
+	return writeTrace(file != NULL ? file : (traceFile != NULL ? traceFile : TRACE_DEFAULT_FILE)) == 0 ? 0 : 1;
+}
+
+/*
+ * Function: reapChildren
+ * ----------------------------
+ *   Drains the SIGCHLD signalfd and reaps every child that has exited with wait4(), which also
+ *   returns the child's resource usage. SIGCHLDs coalesce, so one wakeup may stand for any number
+ *   of children. Foreground children add their usage to foregroundUsage. When the last stage of a
+ *   foreground pipeline is reaped it sets foregroundStatus; when the last stage of a background
+ *   pipeline is reaped it sets backgroundStatus and its completion is queued for the next prompt;
+ *   the last stage of a parallel job is handed to finishParallelJob. Children run for server
+ *   clients are handed to finishClientStage. The usage of a background job is that of its last
+ *   stage. Reaped children are removed from the job table.
+ */
+void reapChildren(void) {
+	struct signalfd_siginfo fdsi[MAX_EVENTS];
+	while (read(sigchldFd, fdsi, sizeof(fdsi)) > 0);
+
+	while (true) {
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &status, WNOHANG, &ru);
+		if (pid <= 0) {
+			// ECHILD or no more exited children
+			break;
+		}
+		job_t* job = findJob(pid);
+		if (job == NULL) {
+			continue;
+		}
+		if (tracing) {
+			traceChild(job);
+		}
+		if (job->client != 0) {
+			finishClientStage(&clients[job->client - 1], job->lastStage, status, &ru);
+			removeJob(pid);
+			continue;
+		}
+		if (!job->background) {
+			addUsage(&foregroundUsage, &ru);
+		}
+		if (!job->lastStage) {
+			// earlier pipeline stages do not decide the status
+		}
+		else if (job->parallelJob != 0) {
+			finishParallelJob(job->parallelJob, pid, status);
+		}
+		else if (job->background) {
+			jobOutput_t* output = findJobOutput(pid);
+			if (output != NULL) {
+				output->done = true;
+				output->status = status;
+			}
+			backgroundStatus = status;
+			backgroundUsage.pid = pid;
+			backgroundUsage.start = job->start;
+			clock_gettime(CLOCK_MONOTONIC, &backgroundUsage.end);
+			backgroundUsage.ru = ru;
+			notifyBackgroundDone(pid, status);
+		}
+		else {
+			foregroundStatus = status;
+			foregroundUsage.pid = pid;
+		}
+		removeJob(pid);
+	}
+}
+
+/*
+ * Function: formatNumber
+ * ----------------------------
+ *   Formats a number in decimal without stdio, so it is async-signal-safe.
+ *
+ *   out: the buffer to write to, with room for at least MAX_PID_STR_SIZE characters
+ *   value: the number to format
+ *
+ *   returns: the number of characters written (no terminator is written)
+ */
+size_t formatNumber(char* out, long value) {
+	char digits[MAX_PID_STR_SIZE];
+	size_t numDigits = 0;
+	unsigned long magnitude = value < 0 ? -(unsigned long)value : (unsigned long)value;
+	do {
+		digits[numDigits++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	size_t len = 0;
+	if (value < 0) {
+		out[len++] = '-';
+	}
+	while (numDigits > 0) {
+		out[len++] = digits[--numDigits];
+	}
+	return len;
+}
+
+/*
+ * Function: formatStatus
+ * ----------------------------
+ *   Formats a wait status the way printStatus prints it, without stdio so it is
+ *   async-signal-safe.
+ *
+ *   out: the buffer to write to, with room for at least 64 characters
+ *   status: the wait status to format
+ *
+ *   returns: the number of characters written, including the new line
+ */
+size_t formatStatus(char* out, int status) {
+	static const char exited[] = "exit value ";
+	static const char signaled[] = "terminated by signal ";
+	size_t len;
+	if (WIFSIGNALED(status)) {
+		memcpy(out, signaled, sizeof(signaled) - 1);
+		len = sizeof(signaled) - 1;
+		len += formatNumber(out + len, WTERMSIG(status));
+	}
+	else {
+		memcpy(out, exited, sizeof(exited) - 1);
+		len = sizeof(exited) - 1;
+		len += formatNumber(out + len, WEXITSTATUS(status));
+	}
+	out[len++] = '\n';
+	return len;
+}
+
+/*
+ * Function: queueNotification
+ * ----------------------------
+ *   Appends a message to the notifications written with the next prompt. A full queue is
+ *   flushed first.
+ *
+ *   message: the message to queue
+ *   len: the length of the message, at most NOTIFY_BUF_SIZE
+ */
+void queueNotification(const char* message, size_t len) {
+	if (notifyLength + len > NOTIFY_BUF_SIZE) {
+		flushNotifications();
+	}
+	memcpy(notifyBuf + notifyLength, message, len);
+	notifyLength += len;
+}
+
+/*
+ * Function: notifyBackgroundDone
+ * ----------------------------
+ *   Builds the whole completion message of a background job and queues it.
+ *
+ *   pid: the process id of the job
+ *   status: the wait status of the job
+ */
+void notifyBackgroundDone(pid_t pid, int status) {
+	static const char prefix[] = "background pid ";
+	static const char done[] = " is done: ";
+	char message[128];
+	size_t len = sizeof(prefix) - 1;
+	memcpy(message, prefix, len);
+	len += formatNumber(message + len, pid);
+	memcpy(message + len, done, sizeof(done) - 1);
+	len += sizeof(done) - 1;
+	len += formatStatus(message + len, status);
+	queueNotification(message, len);
+}
+
+/*
+ * Function: flushNotifications
+ * ----------------------------
+ *   Writes every queued notification with a single write(). Pending stdio output goes first so
+ *   the order of messages is kept.
+ */
+void flushNotifications(void) {
+	if (notifyLength == 0) {
+		return;
+	}
+	fflush(stdout);
+	writeAll(STDOUT_FILENO, notifyBuf, notifyLength);
+	notifyLength = 0;
+}
+
+/*
+ * Function: waitForeground
+ * ----------------------------
+ *   Runs the event loop until foreground children have been reaped.
+ *
+ *   pids: the process ids of the foreground children, which must be in the job table
+ *   numPids: the number of children
+ */
+void waitForeground(const pid_t* pids, int numPids) {
+	for (int i = 0; i < numPids; i++) {
+		while (findJob(pids[i]) != NULL) {
+			dispatchEvents(-1);
+		}
+	}
+}
+
+/*
+ * Function: openInterruptFd
+ * ----------------------------
+ *   Blocks SIGINT and opens a signalfd for it, so a built in can wait for ^C although the shell
+ *   ignores SIGINT (blocked signals are queued even when ignored).
+ *
+ *   oldMask: set to the signal mask to restore with closeInterruptFd
+ *
+ *   returns: the signalfd, or -1 if it could not be opened (^C is then not noticed)
+ */
+int openInterruptFd(sigset_t* oldMask) {
+	sigset_t intMask;
+	sigemptyset(&intMask);
+	sigaddset(&intMask, SIGINT);
+	sigprocmask(SIG_BLOCK, &intMask, oldMask);
+	return signalfd(-1, &intMask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/*
+ * Function: closeInterruptFd
+ * ----------------------------
+ *   Closes a signalfd opened by openInterruptFd and restores the signal mask.
+ *
+ *   intFd: the signalfd
+ *   oldMask: the signal mask to restore
+ */
+void closeInterruptFd(int intFd, const sigset_t* oldMask) {
+	if (intFd != -1) {
+		close(intFd);
+	}
+	sigprocmask(SIG_SETMASK, oldMask, NULL);
+}
+
+/*
+ * Function: waitInterruptible
+ * ----------------------------
+ *   Waits for events on the shell's epoll set or ^C, handling the events.
+ *
+ *   intFd: the signalfd from openInterruptFd
+ *   timeout: how long to wait at most, NULL to wait for an event
+ *
+ *   returns: true if ^C was pressed; false otherwise
+ */
+bool waitInterruptible(int intFd, const struct timespec* timeout) {
+	struct pollfd fds[2] = { { .fd = eventFd, .events = POLLIN }, { .fd = intFd, .events = POLLIN } };
+	if (ppoll(fds, intFd != -1 ? 2 : 1, timeout, NULL) <= 0) {
+		return false;
+	}
+	if (fds[0].revents & POLLIN) {
+		dispatchEvents(0);
+	}
+	struct signalfd_siginfo info;
+	return (fds[1].revents & POLLIN) && read(intFd, &info, sizeof(info)) > 0;
+}
+
+/*
+ * Function: waitForInput
+ * ----------------------------
+ *   Runs the event loop until a file descriptor is readable (or at EOF/error).
+ *
+ *   fd: the file descriptor to wait for
+ */
+void waitForInput(int fd) {
+	struct pollfd fds[2] = { { .fd = eventFd, .events = POLLIN }, { .fd = fd, .events = POLLIN } };
+	while (true) {
+		if (poll(fds, 2, -1) == -1) {
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			dispatchEvents(0);
+		}
+		if (fds[1].revents) {
+			return;
+		}
+	}
+}
+
+/*
+ * Function: initReader
+ * ----------------------------
+ *   Initializes a line reader for a file descriptor.
+ *
+ *   reader: a pointer to the reader to initialize
+ *   fd: the file descriptor to read lines from
+ */
+void initReader(lineReader_t* reader, int fd) {
+	reader->fd = fd;
+	reader->buf = NULL;
+	reader->cap = 0;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = false;
+	reader->mapped = false;
+	reader->script = NULL;
+	reader->scriptMapped = false;
+	reader->scriptLine = 0;
+}
+
+/*
+ * Function: fillReader
+ * ----------------------------
+ *   Reads whatever is available from the reader's fd into its buffer with a single read().
+ *   Consumed lines are compacted out and the buffer doubles when it is full.
+ *
+ *   reader: a pointer to the reader
+ */
+void fillReader(lineReader_t* reader) {
+	if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	// keep a spare byte for terminating a last line without a new line
+	if (reader->end + 1 >= reader->cap) {
+		reader->cap = reader->cap ? reader->cap * 2 : READER_BUF_SIZE;
+		reader->buf = realloc(reader->buf, reader->cap);
+	}
+	ssize_t nread;
+	do {
+		nread = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end - 1);
+	} while (nread == -1 && errno == EINTR);
+	if (nread <= 0) {
+		reader->eof = true;
+	}
+	else {
+		reader->end += nread;
+	}
+}
+
+/*
+ * Function: scriptCachePath
+ * ----------------------------
+ *   Finds where the parsed form of a script is cached: $SMALLSH_SCRIPT_CACHE, or smallsh in
+ *   $XDG_CACHE_HOME or ~/.cache, named after a hash of the script's absolute path. The directory
+ *   is created if needed.
+ *
+ *   path: the path of the script
+ *   sourcePath: set to the absolute path of the script, to be freed by the caller
+ *
+ *   returns: the path of the cache file, to be freed by the caller; NULL if scripts are not cached
+ */
+char* scriptCachePath(const char* path, char** sourcePath) {
+	char* dir = getenv(SCRIPT_CACHE_ENV);
+	char* base = NULL;
+	*sourcePath = NULL;
+	if (dir == NULL) {
+		char* xdg = getenv("XDG_CACHE_HOME");
+		char* home = getenv("HOME");
+		if ((xdg == NULL || xdg[0] != '/') && home == NULL) {
+			return NULL;
+		}
+		base = xdg != NULL && xdg[0] == '/' ? strdup(xdg) : malloc(strlen(home) + sizeof("/.cache"));
+		if (base[0] != '/') {
+			sprintf(base, "%s/.cache", home);
+		}
+		dir = malloc(strlen(base) + sizeof("/smallsh"));
+		sprintf(dir, "%s/smallsh", base);
+	}
+	char* cachePath = NULL;
+	if (dir[0] != '\0' && (base == NULL || mkdir(base, 0700) == 0 || errno == EEXIST)
+		&& (mkdir(dir, 0700) == 0 || errno == EEXIST) && (*sourcePath = realpath(path, NULL)) != NULL) {
+		cachePath = malloc(strlen(dir) + sizeof("/01234567.ir"));
+		sprintf(cachePath, "%s/%08x.ir", dir, hashString(*sourcePath));
+	}
+	if (base != NULL) {
+		free(base);
+		free(dir);
+	}
+	return cachePath;
+}
+
+/*
+ * Function: scriptChecksum
+ * ----------------------------
+ *   Hashes everything after the header of a parsed script with 32-bit FNV-1a.
+ *
+ *   script: the parsed script, whose totalSize must be right
+ *
+ *   returns: the checksum
+ */
+uint32_t scriptChecksum(const scriptHeader_t* script) {
+	uint32_t hash = 2166136261u;
+	const unsigned char* end = (const unsigned char*)script + script->totalSize;
+	for (const unsigned char* p = (const unsigned char*)(script + 1); p < end; p++) {
+		hash = (hash ^ *p) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Function: encodeToken
+ * ----------------------------
+ *   Encodes a token as a parsed script stores it: its kind and flags byte, followed by the
+ *   terminated text of a word, here-document body or error.
+ *
+ *   out: where to write, with room for the text and 2 more bytes
+ *   token: a pointer to the token
+ *
+ *   returns: the number of bytes written
+ */
+size_t encodeToken(char* out, const token_t* token) {
+	out[0] = token->kind | (token->expand ? SCRIPT_EXPAND : 0) | (token->glob ? SCRIPT_GLOB : 0)
+		| (token->quoted ? SCRIPT_QUOTED : 0);
+	if (token->kind != TOKEN_WORD && token->kind != TOKEN_HEREDOC && token->kind != TOKEN_ERROR) {
+		return 1;
+	}
+	memcpy(out + 1, token->text, token->len);
+	out[token->len + 1] = '\0';
+	return token->len + 2;
+}
+
+/*
+ * Function: parseScript
+ * ----------------------------
+ *   Parses a script once into its cacheable form: every line that is not a comment or blank is
+ *   scanned with lexNext and its tokens are stored one after the other. Words needing expansion
+ *   are kept raw and marked, so $ and globs are still expanded each time the line runs.
+ *
+ *   reader: a reader over the mapped script, whose lines are consumed
+ *   st: the stat of the script
+ *   sourcePath: the absolute path of the script
+ *
+ *   returns: the parsed script in a heap buffer, to be freed by the caller
+ */
+scriptHeader_t* parseScript(lineReader_t* reader, const struct stat* st, const char* sourcePath) {
+	size_t numLines = 0, linesCap = 64;
+	uint32_t* lines = malloc(sizeof(*lines) * linesCap);
+	// a token takes at most its text, a terminator and its kind byte, and is preceded by at least a
+	// byte of the line (the word's first character or the operator)
+	size_t tokensSize = 0, tokensCap = reader->end * 2 + 1;
+	char* tokens = malloc(tokensCap);
+
+	char* line;
+	while ((line = nextLine(reader)) != NULL) {
+		if (strncmp(line, COMMENT_CHAR, 1) == 0 || isEmptyString(line)) {
+			continue;
+		}
+		if (numLines + 1 == linesCap) {
+			linesCap *= 2;
+			lines = realloc(lines, sizeof(*lines) * linesCap);
+		}
+		lines[numLines++] = tokensSize;
+		lexer_t lexer;
+		token_t token;
+		initLexer(&lexer, line);
+		while (lexNext(&lexer, &token) != TOKEN_END) {
+			// the body lines are part of this line
+			if (token.kind == TOKEN_HEREDOC) {
+				readHereDoc(reader, &lexer, &token);
+			}
+			if (tokensSize + token.len + 2 > tokensCap) {
+				tokensCap = (tokensSize + token.len + 2) * 2;
+				tokens = realloc(tokens, tokensCap);
+			}
+			tokensSize += encodeToken(tokens + tokensSize, &token);
+			// the rest of the line is never parsed
+			if (token.kind == TOKEN_ERROR) {
+				break;
+			}
+		}
+	}
+	lines[numLines] = tokensSize;
+
+	size_t pathSize = strlen(sourcePath) + 1;
+	size_t linesOffset = (sizeof(scriptHeader_t) + pathSize + 3) & ~(size_t)3;
+	size_t tokensOffset = linesOffset + sizeof(*lines) * (numLines + 1);
+	scriptHeader_t* script = calloc(1, tokensOffset + tokensSize);
+	memcpy(script->magic, SCRIPT_MAGIC, sizeof(SCRIPT_MAGIC));
+	script->version = SCRIPT_VERSION;
+	script->numLines = numLines;
+	script->size = st->st_size;
+	script->mtimeSec = st->st_mtim.tv_sec;
+	script->mtimeNsec = st->st_mtim.tv_nsec;
+	script->ctimeSec = st->st_ctim.tv_sec;
+	script->ctimeNsec = st->st_ctim.tv_nsec;
+	script->ino = st->st_ino;
+	script->dev = st->st_dev;
+	script->totalSize = tokensOffset + tokensSize;
+	script->pathOffset = sizeof(scriptHeader_t);
+	script->linesOffset = linesOffset;
+	script->tokensOffset = tokensOffset;
+	memcpy((char*)script + script->pathOffset, sourcePath, pathSize);
+	memcpy((char*)script + linesOffset, lines, sizeof(*lines) * (numLines + 1));
+	memcpy((char*)script + tokensOffset, tokens, tokensSize);
+	script->checksum = scriptChecksum(script);
+	free(lines);
+	free(tokens);
+	return script;
+}
+
+/*
+ * Function: loadScript
+ * ----------------------------
+ *   Maps a cached parsed script, if it was parsed from the script as it is now: same path, size,
+ *   mtime, ctime, inode and device. The file is checked throughout (layout, checksum and every
+ *   token) so a damaged one is never replayed. The mapping is private and writable, like a mapped
+ *   script, since words point into it.
+ *
+ *   cachePath: the path of the cache file
+ *   st: the stat of the script
+ *   sourcePath: the absolute path of the script
+ *
+ *   returns: the mapped script, or NULL if there is no valid one
+ */
+scriptHeader_t* loadScript(const char* cachePath, const struct stat* st, const char* sourcePath) {
+	int fd = open(cachePath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat cacheSt;
+	scriptHeader_t* script = MAP_FAILED;
+	if (fstat(fd, &cacheSt) == 0 && (size_t)cacheSt.st_size >= sizeof(scriptHeader_t)) {
+		script = mmap(NULL, cacheSt.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	}
+	close(fd);
+	if (script == MAP_FAILED) {
+		return NULL;
+	}
+
+	size_t pathSize = strlen(sourcePath) + 1;
+	const uint32_t* lines = (const uint32_t*)((char*)script + script->linesOffset);
+	const char* tokens = (char*)script + script->tokensOffset;
+	bool valid = memcmp(script->magic, SCRIPT_MAGIC, sizeof(SCRIPT_MAGIC)) == 0 && script->version == SCRIPT_VERSION
+		&& script->size == (uint64_t)st->st_size && script->mtimeSec == st->st_mtim.tv_sec
+		&& script->mtimeNsec == st->st_mtim.tv_nsec && script->ctimeSec == st->st_ctim.tv_sec
+		&& script->ctimeNsec == st->st_ctim.tv_nsec && script->ino == st->st_ino && script->dev == st->st_dev
+		&& script->totalSize == (uint64_t)cacheSt.st_size && script->pathOffset == sizeof(scriptHeader_t)
+		&& script->linesOffset == ((sizeof(scriptHeader_t) + pathSize + 3) & ~(size_t)3)
+		&& script->tokensOffset == script->linesOffset + sizeof(*lines) * ((uint64_t)script->numLines + 1)
+		&& script->tokensOffset <= script->totalSize
+		&& memcmp((char*)script + script->pathOffset, sourcePath, pathSize) == 0
+		&& script->checksum == scriptChecksum(script);
+	size_t tokensSize = valid ? script->totalSize - script->tokensOffset : 0;
+	for (uint32_t i = 0; valid && i < script->numLines; i++) {
+		valid = lines[i] <= lines[i + 1] && (i > 0 || lines[0] == 0);
+	}
+	valid = valid && lines[script->numLines] == tokensSize;
+	// every token must be a kind followed by a terminated text where one belongs
+	for (size_t pos = 0; valid && pos < tokensSize; ) {
+		// SCRIPT_BUFFERED only refers to hereDocBuf, never to a file
+		valid = (tokens[pos] & SCRIPT_BUFFERED) == 0;
+		int kind = tokens[pos++] & SCRIPT_KIND;
+		valid = valid && kind > TOKEN_END && kind <= TOKEN_ERROR;
+		if (valid && (kind == TOKEN_WORD || kind == TOKEN_HEREDOC || kind == TOKEN_ERROR)) {
+			const char* end = memchr(tokens + pos, '\0', tokensSize - pos);
+			valid = end != NULL;
+			pos = valid ? end - tokens + 1 : pos;
+		}
+	}
+	if (!valid) {
+		munmap(script, cacheSt.st_size);
+		return NULL;
+	}
+	return script;
+}
+
+/*
+ * Function: storeScript
+ * ----------------------------
+ *   Writes a parsed script to the cache. It is written to a temporary file that is renamed over
+ *   the cache file, so a shell reading the cache at the same time never sees half of it. Failures
+ *   are ignored, the script just gets parsed again next time.
+ *
+ *   script: the parsed script
+ *   cachePath: the path of the cache file
+ */
+void storeScript(const scriptHeader_t* script, const char* cachePath) {
+	char* tmpPath = malloc(strlen(cachePath) + MAX_PID_STR_SIZE + sizeof(".tmp"));
+	sprintf(tmpPath, "%s.%d.tmp", cachePath, getpid());
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		bool written = writeAll(fd, (const char*)script, script->totalSize) == 0;
+		if (close(fd) == -1 || !written || rename(tmpPath, cachePath) == -1) {
+			unlink(tmpPath);
+		}
+	}
+	free(tmpPath);
+}
+
+/*
+ * Function: openScript
+ * ----------------------------
+ *   Opens a script for script mode. Its parsed form is loaded from the cache if the script has
+ *   not changed since it was parsed; otherwise the script is mapped, parsed with parseScript and
+ *   the result cached for the next run. Either way the lines are then replayed from the parsed
+ *   form with nextScriptLine, without lexing. A parsed script is keyed by the stat of the file
+ *   that was mapped, not by the stat the cache was looked up with, so an edit in between is
+ *   never cached under the old key.
+ *
+ *   reader: a pointer to the reader to initialize
+ *   path: the path of the script
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int openScript(lineReader_t* reader, const char* path) {
+	struct stat st;
+	if (stat(path, &st) == -1) {
+		perror(path);
+		return -1;
+	}
+	char* sourcePath;
+	char* cachePath = scriptCachePath(path, &sourcePath);
+	scriptHeader_t* script = cachePath != NULL ? loadScript(cachePath, &st, sourcePath) : NULL;
+	bool mapped = script != NULL;
+	if (script == NULL) {
+		if (mapReader(reader, path, &st) == -1) {
+			free(cachePath);
+			free(sourcePath);
+			return -1;
+		}
+		script = parseScript(reader, &st, sourcePath != NULL ? sourcePath : path);
+		destroyReader(reader);
+		if (cachePath != NULL) {
+			storeScript(script, cachePath);
+		}
+	}
+	free(cachePath);
+	free(sourcePath);
+
+	initReader(reader, -1);
+	reader->eof = true;
+	reader->script = script;
+	reader->scriptMapped = mapped;
+	return 0;
+}
+
+/*
+ * Function: nextScriptLine
+ * ----------------------------
+ *   Gets the next line of a parsed script, showing the prompt (which writes the queued
+ *   notifications) like getCommand.
+ *
+ *   reader: a reader over a parsed script
+ *   lexer: set up to replay the tokens of the line
+ *
+ *   returns: true if there was a line; false at the end of the script
+ */
+bool nextScriptLine(lineReader_t* reader, lexer_t* lexer) {
+	showPrompt();
+	scriptHeader_t* script = reader->script;
+	if (reader->scriptLine == script->numLines) {
+		return false;
+	}
+	const uint32_t* lines = (const uint32_t*)((char*)script + script->linesOffset) + reader->scriptLine++;
+	char* tokens = (char*)script + script->tokensOffset;
+	initReplay(lexer, tokens + lines[0], tokens + lines[1]);
+	return true;
+}
+
+/*
+ * Function: initReplay
+ * ----------------------------
+ *   Initializes a lexer that replays encoded tokens instead of scanning a line.
+ *
+ *   lexer: a pointer to the lexer to initialize
+ *   tokens: the first encoded token
+ *   end: the end of the tokens
+ */
+void initReplay(lexer_t* lexer, char* tokens, char* end) {
+	initLexer(lexer, NULL);
+	lexer->replay = tokens;
+	lexer->replayEnd = end;
+}
+
+/*
+ * Function: replayToken
+ * ----------------------------
+ *   Hands out the next token of a parsed script line or of a simple command in a parsed list, as
+ *   lexNext scanned it.
+ *
+ *   lexer: a pointer to a lexer set up by nextScriptLine or initReplay
+ *   token: set to the token
+ *
+ *   returns: the kind of the token
+ */
+tokenKind_t replayToken(lexer_t* lexer, token_t* token) {
+	if (lexer->replay == lexer->replayEnd) {
+		token->text = NULL;
+		token->len = 0;
+		token->expand = false;
+		token->glob = false;
+		token->quoted = false;
+		return token->kind = TOKEN_END;
+	}
+	char flags = *lexer->replay++;
+	token->kind = flags & SCRIPT_KIND;
+	token->expand = flags & SCRIPT_EXPAND;
+	token->glob = flags & SCRIPT_GLOB;
+	token->quoted = flags & SCRIPT_QUOTED;
+	token->text = NULL;
+	token->len = 0;
+	if (flags & SCRIPT_BUFFERED) {
+		size_t ref[2];
+		memcpy(ref, lexer->replay, sizeof(ref));
+		lexer->replay += sizeof(ref);
+		token->text = hereDocBuf + ref[0];
+		token->len = ref[1];
+	}
+	else if (token->kind == TOKEN_WORD || token->kind == TOKEN_HEREDOC || token->kind == TOKEN_ERROR) {
+		token->text = lexer->replay;
+		token->len = strlen(token->text);
+		lexer->replay += token->len + 1;
+	}
+	return token->kind;
+}
+
+/*
+ * Function: nextLine
+ * ----------------------------
+ *   Takes the next complete line out of the reader's buffer without reading. At EOF an
+ *   unterminated last line is returned as well.
+ *
+ *   reader: a pointer to the reader
+ *
+ *   returns: the line with its new line stripped, or NULL if no complete line is buffered
+ *
+ *   notes: the line points into the reader's buffer and is valid until the next fillReader
+ */
+char* nextLine(lineReader_t* reader) {
+	char* line = reader->buf + reader->start;
+	char* newLine = memchr(line, '\n', reader->end - reader->start);
+	if (newLine != NULL) {
+		*newLine = '\0';
+		reader->start = newLine - reader->buf + 1;
+		return line;
+	}
+	if (reader->eof && reader->start < reader->end) {
+		reader->buf[reader->end] = '\0';
+		reader->start = reader->end;
+		return line;
+	}
+	return NULL;
+}
+
+/*
+ * Function: mapReader
+ * ----------------------------
+ *   Initializes a line reader over a memory-mapped file. Lines are handed out straight from the
+ *   mapping, so reading a script costs no read() calls or copies. The mapping is private and
+ *   writable so new lines can be replaced with terminators in place, and it is followed by at
+ *   least one zero byte so an unterminated last line can be terminated as well.
+ *
+ *   reader: a pointer to the reader to initialize
+ *   path: the path of the file to map
+ *   st: set to the stat of the file as it was opened for mapping, unless NULL
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int mapReader(lineReader_t* reader, const char* path, struct stat* st) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	struct stat fileSt;
+	if (fstat(fd, &fileSt) == -1) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	if (st != NULL) {
+		*st = fileSt;
+	}
+
+	// reserve an anonymous region one byte larger than the file, then map the file over its start
+	size_t size = fileSt.st_size;
+	char* map = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED || (size > 0 && mmap(map, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED)) {
+		perror(path);
+		if (map != MAP_FAILED) {
+			munmap(map, size + 1);
+		}
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	initReader(reader, -1);
+	reader->buf = map;
+	reader->cap = size + 1;
+	reader->end = size;
+	reader->eof = true;
+	reader->mapped = true;
+	return 0;
+}
+
+/*
+ * Function: destroyReader
+ * ----------------------------
+ *   Frees the buffer or unmaps the file of a line reader.
+ *
+ *   reader: a pointer to the reader
+ */
+void destroyReader(lineReader_t* reader) {
+	if (reader->mapped) {
+		munmap(reader->buf, reader->cap);
+	}
+	else {
+		free(reader->buf);
+	}
+	reader->buf = NULL;
+	if (reader->scriptMapped) {
+		munmap(reader->script, reader->script->totalSize);
+	}
+	else {
+		free(reader->script);
+	}
+	reader->script = NULL;
+}
+
+/*
+ * Function: hashString
+ * ----------------------------
+ *   Hashes a string with 32-bit FNV-1a.
+ *
+ *   s: the string to hash
+ *
+ *   returns: the hash of the string
+ */
+uint32_t hashString(const char* s) {
+	uint32_t hash = 2166136261u;
+	for (; *s != '\0'; s++) {
+		hash = (hash ^ (unsigned char)*s) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Function: resetPathCache
+ * ----------------------------
+ *   Forgets every resolved command path along with the opened $PATH directories.
+ */
+void resetPathCache(void) {
+	for (size_t i = 0; i < PATH_CACHE_SIZE; i++) {
+		if (pathCache[i].name != NULL) {
+			free(pathCache[i].name);
+			free(pathCache[i].path);
+			pathCache[i].name = NULL;
+		}
+	}
+	numPathEntries = 0;
+	for (int i = 0; i < numPathDirs; i++) {
+		if (pathDirs[i].fd != -1) {
+			close(pathDirs[i].fd);
+		}
+		free(pathDirs[i].name);
+	}
+	free(pathDirs);
+	pathDirs = NULL;
+	numPathDirs = 0;
+	free(cachedPath);
+	cachedPath = NULL;
+}
+
+/*
+ * Function: loadPathDirs
+ * ----------------------------
+ *   Splits a $PATH value into directories, opening each one and recording its mtime so later
+ *   lookups can tell whether a cached path may have been shadowed or removed.
+ *
+ *   path: the $PATH value
+ */
+void loadPathDirs(const char* path) {
+	cachedPath = strdup(path);
+	int count = 1;
+	for (const char* c = path; *c != '\0'; c++) {
+		count += *c == ':';
+	}
+	pathDirs = malloc(sizeof(*pathDirs) * count);
+
+	const char* start = path;
+	while (true) {
+		const char* end = strchrnul(start, ':');
+		pathDir_t* dir = &pathDirs[numPathDirs++];
+		// an empty component means the current directory
+		dir->name = end == start ? strdup(".") : strndup(start, end - start);
+		dir->fd = open(dir->name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		struct stat st;
+		if (dir->fd != -1 && fstat(dir->fd, &st) == 0) {
+			dir->mtime = st.st_mtim;
+		}
+		if (*end == '\0') {
+			break;
+		}
+		start = end + 1;
+	}
+}
+
+/*
+ * Function: pathDirsChanged
+ * ----------------------------
+ *   Checks whether any of the first $PATH directories changed since they were loaded. A change
+ *   in an earlier directory may shadow a cached command and a change in its own directory may
+ *   have removed it. Directories that were missing are checked for having appeared.
+ *
+ *   count: the number of leading directories to check
+ *
+ *   returns: true if a directory changed; false otherwise
+ */
+bool pathDirsChanged(int count) {
+	struct stat st;
+	for (int i = 0; i < count && i < numPathDirs; i++) {
+		if (pathDirs[i].fd == -1) {
+			if (stat(pathDirs[i].name, &st) == 0) {
+				return true;
+			}
+		}
+		else if (fstat(pathDirs[i].fd, &st) == -1
+			|| st.st_mtim.tv_sec != pathDirs[i].mtime.tv_sec
+			|| st.st_mtim.tv_nsec != pathDirs[i].mtime.tv_nsec) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Function: findPathEntry
+ * ----------------------------
+ *   Looks up a command name in the path cache without validating it.
+ *
+ *   name: the command name
+ *
+ *   returns: a pointer to the slot holding name, or to the empty slot it would go in
+ */
+pathEntry_t* findPathEntry(const char* name) {
+	size_t i = hashString(name) & (PATH_CACHE_SIZE - 1);
+	while (pathCache[i].name != NULL && strcmp(pathCache[i].name, name) != 0) {
+		i = (i + 1) & (PATH_CACHE_SIZE - 1);
+	}
+	return &pathCache[i];
+}
+
+/*
+ * Function: lookupCommandPath
+ * ----------------------------
+ *   Resolves a command name to an executable in $PATH, probing the directories only the first
+ *   time the name is seen. The cache is thrown away when $PATH changes or a directory that the
+ *   cached result depends on changes.
+ *
+ *   name: the command name
+ *
+ *   returns: the cache entry for the command, or NULL if name contains a / or was not found
+ */
+pathEntry_t* lookupCommandPath(const char* name) {
+	if (strchr(name, '/') != NULL) {
+		return NULL;
+	}
+	const char* path = getenv("PATH");
+	if (path == NULL) {
+		path = "/bin:/usr/bin";
+	}
+	if (cachedPath == NULL || strcmp(path, cachedPath) != 0) {
+		resetPathCache();
+		loadPathDirs(path);
+	}
+
+	pathEntry_t* entry = findPathEntry(name);
+	if (entry->name != NULL) {
+		if (!pathDirsChanged(entry->dir + 1)) {
+			entry->hits++;
+			return entry;
+		}
+		// reload the directories and start over
+		resetPathCache();
+		loadPathDirs(path);
+		entry = findPathEntry(name);
+	}
+	else if (numPathEntries >= MAX_PATH_ENTRIES) {
+		// full, start over rather than evicting
+		resetPathCache();
+		loadPathDirs(path);
+		entry = findPathEntry(name);
+	}
+
+	for (int i = 0; i < numPathDirs; i++) {
+		struct stat st;
+		if (pathDirs[i].fd != -1 && fstatat(pathDirs[i].fd, name, &st, 0) == 0
+			&& S_ISREG(st.st_mode) && faccessat(pathDirs[i].fd, name, X_OK, AT_EACCESS) == 0) {
+			entry->name = strdup(name);
+			entry->path = malloc(strlen(pathDirs[i].name) + strlen(name) + 2);
+			sprintf(entry->path, "%s/%s", pathDirs[i].name, name);
+			entry->dir = i;
+			entry->hits = 1;
+			numPathEntries++;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: execResolved
+ * ----------------------------
+ *   Replaces the current (child) process with a command, exec'ing the cached executable
+ *   directly through its pre-opened directory fd instead of probing $PATH.
+ *
+ *   resolved: the path cache entry of the command, or NULL to search $PATH
+ *   argv: the NULL terminated argument vector
+ *
+ *   returns: only on failure, with errno set
+ */
+void execResolved(const pathEntry_t* resolved, char* argv[]) {
+	if (resolved != NULL) {
+		execveat(pathDirs[resolved->dir].fd, resolved->name, argv, environ, 0);
+		// scripts cannot be run through a close-on-exec directory fd (ENOENT)
+		if (errno != ENOSYS && errno != ENOENT) {
+			return;
+		}
+		execv(resolved->path, argv);
+		return;
+	}
+	execvp(argv[0], argv);
+}
+
+/*
+ * Function: hashCommands
+ * ----------------------------
+ *   Built in for the path cache. With no args, lists the cached commands with their hit counts;
+ *   -r empties the cache; otherwise each arg is resolved and added to the cache.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if a command was not found
+ */
+int hashCommands(command_t* command) {
+	int retVal = 0;
+	if (command->numArgs == 0) {
+		if (numPathEntries == 0) {
+			printf("hash: hash table empty\n");
+		}
+		else {
+			printf("hits\tcommand\n");
+			for (size_t i = 0; i < PATH_CACHE_SIZE; i++) {
+				if (pathCache[i].name != NULL) {
+					printf("%4u\t%s\n", pathCache[i].hits, pathCache[i].path);
+				}
+			}
+		}
+	}
+	else if (strcmp(command->args[0], "-r") == 0) {
+		resetPathCache();
+	}
+	else {
+		for (int i = 0; i < command->numArgs; i++) {
+			pathEntry_t* entry = lookupCommandPath(command->args[i]);
+			if (entry == NULL && strchr(command->args[i], '/') == NULL) {
+				fprintf(stderr, "hash: %s: not found\n", command->args[i]);
+				retVal = 1;
+			}
+			else if (entry != NULL) {
+				// lookups count as hits, a hashed but unused command reports 0
+				entry->hits--;
+			}
+		}
+	}
+	fflush(stdout);
+	return retVal;
+}
+
+/*
+ * Function: launcherName
+ * ----------------------------
+ *   Gets the printable name of a process launch backend.
+ *
+ *   backend: the launch backend
+ *
+ *   returns: the name of the backend
+ */
+const char* launcherName(launcher_t backend) {
+	switch (backend) {
+	case LAUNCHER_FORK:
+		return "fork";
+	case LAUNCHER_VFORK:
+		return "vfork";
+	case LAUNCHER_SPAWN:
+		return "spawn";
+	case LAUNCHER_ZYGOTE:
+		return "zygote";
+	}
+	return "unknown";
+}
+
+/*
+ * Function: parseLauncher
+ * ----------------------------
+ *   Looks up a process launch backend by name (fork, vfork, spawn or zygote).
+ *
+ *   name: the name of the backend
+ *   backend: set to the matching backend if one is found
+ *
+ *   returns: true if name is a known backend; false otherwise
+ */
+bool parseLauncher(const char* name, launcher_t* backend) {
+	launcher_t backends[] = { LAUNCHER_FORK, LAUNCHER_VFORK, LAUNCHER_SPAWN, LAUNCHER_ZYGOTE };
+	for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(name, launcherName(backends[i])) == 0) {
+			*backend = backends[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Function: setLauncher
+ * ----------------------------
+ *   Built in for selecting the launch backend. With no args, prints the selected backend and the
+ *   backend the last external command was actually launched with. Selecting zygote starts the
+ *   zygote if it is not running.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if the backend is unknown
+ */
+int setLauncher(command_t* command) {
+	if (command->numArgs == 0) {
+		printf("launcher: %s (last launch: %s)\n", launcherName(launcherBackend),
+			anyLaunched ? launcherName(lastLauncher) : "none");
+		fflush(stdout);
+		return 0;
+	}
+	launcher_t backend;
+	if (!parseLauncher(command->args[0], &backend)) {
+		fprintf(stderr, "launcher: unknown backend %s (expected fork, vfork, spawn or zygote)\n", command->args[0]);
+		return 1;
+	}
+	if (backend == LAUNCHER_ZYGOTE && startZygote() == -1) {
+		return 1;
+	}
+	launcherBackend = backend;
+	return 0;
+}
+
+/*
+ * Function: openHereDoc
+ * ----------------------------
+ *   Puts the body of a here-document or here-string into an anonymous memfd, written straight from
+ *   the body with no temporary file, and seals it so nothing can change it while it is read.
+ *
+ *   body: the body
+ *   len: the length of the body
+ *
+ *   returns: a close-on-exec fd open for reading at the start of the body, or -1 if it could not be
+ *   created (the error is printed)
+ */
+int openHereDoc(const char* body, size_t len) {
+	int fd = memfd_create(HEREDOC_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		perror("memfd_create");
+		return -1;
+	}
+	if (writeAll(fd, body, len) == -1
+		|| fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1
+		|| lseek(fd, 0, SEEK_SET) == -1) {
+		perror("here-document");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Function: openRedirections
+ * ----------------------------
+ *   Opens the input/output redirection files of a command in the shell process so they can be
+ *   handed to the child; a here-document or here-string is put into a memfd. Sides without a
+ *   redirection can be sent to /dev/null. Both fds are opened close-on-exec and are left as -1
+ *   when nothing was opened for that side.
+ *
+ *   command: a pointer to the command struct
+ *   nullIn: whether stdin goes to /dev/null if it is not redirected
+ *   nullOut: whether stdout goes to /dev/null if it is not redirected
+ *   inFd: set to the fd for the child's stdin or -1
+ *   outFd: set to the fd for the child's stdout or -1
+ *
+ *   returns: 0 if successful; -1 if a file could not be opened (the error is printed)
+ */
+int openRedirections(command_t* command, bool nullIn, bool nullOut, int* inFd, int* outFd) {
+	*inFd = -1;
+	*outFd = -1;
+	char* inputFile = command->inputFile ? command->inputFile : (nullIn ? "/dev/null" : NULL);
+	char* outputFile = command->outputFile ? command->outputFile : (nullOut ? "/dev/null" : NULL);
+
+	if (command->hereDoc != NULL) {
+		*inFd = openHereDoc(command->hereDoc, command->hereDocLen);
+		if (*inFd == -1) {
+			return -1;
+		}
+	}
+	else if (inputFile != NULL) {
+		*inFd = open(inputFile, O_RDONLY | O_CLOEXEC);
+		if (*inFd == -1) {
+			perror(inputFile);
+			return -1;
+		}
+	}
+	if (outputFile != NULL) {
+		*outFd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (*outFd == -1) {
+			perror(outputFile);
+			if (*inFd != -1) {
+				close(*inFd);
+				*inFd = -1;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function: forkLaunch
+ * ----------------------------
+ *   Launches a command with fork(). The child resets its signal dispositions, connects its pipes
+ *   and opens its own redirections before exec'ing (or running a pipeline built in).
+ *
+ *   launch: what to launch; inFd/outFd are the pipe ends, if any
+ *
+ *   returns: the pid of the child; -1 if fork failed
+ */
+pid_t forkLaunch(const launch_t* launch) {
+	command_t* command = launch->command;
+	bool background = launch->background;
+	pid_t spawnPid = fork();
+
+	switch (spawnPid) {
+	case -1:
+		perror("Error");
+		break;
+	case 0: {
+		// child process
+		traceChild_t* stamp = traceChildStamp();
+		struct sigaction action = { { 0 } };
+		sigfillset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		// set SIGINT behavior if child process is foreground
+		if (!background) {
+			action.sa_handler = SIG_DFL;
+			sigaction(SIGINT, &action, NULL);
+		}
+		// set SIGTSTP to be ignored for any child process
+		action.sa_handler = SIG_IGN;
+		sigaction(SIGTSTP, &action, NULL);
+		sigprocmask(SIG_SETMASK, &childSignalMask, NULL);
+		if (launch->pgid != -1) {
+			setpgid(0, launch->pgid);
+		}
+
+		// connect pipes, explicit redirections below take precedence
+		if ((launch->inFd != -1 && dup2(launch->inFd, 0) == -1)
+			|| (launch->outFd != -1 && dup2(launch->outFd, 1) == -1)) {
+			perror("Error");
+			exit(1);
+		}
+
+		// handle input/output redirection
+		if (command->hereDoc != NULL) {
+			int inputFD = openHereDoc(command->hereDoc, command->hereDocLen);
+			if (inputFD == -1 || dup2(inputFD, 0) == -1) {
+				perror("Error");
+				exit(1);
+			}
+			close(inputFD);
+		}
+		else if (command->inputFile != NULL) {
+			// Open input file
+			int inputFD = open(command->inputFile, O_RDONLY);
+			if (inputFD == -1) {
+				perror(command->inputFile);
+				exit(1);
+			}
+
+			// Redirect stdin to source file
+			int result = dup2(inputFD, 0);
+			if (result == -1) {
+				perror("Error");
+				exit(1);
+			}
+
+			// close open file
+			if (close(inputFD) == -1) {
+				perror("Error");
+				exit(1);
+			}
+		}
+		// no input redirection specified, send to dev/null
+		else if (background && launch->inFd == -1) {
+			int inputFD = open("/dev/null", O_RDONLY);
+			if (inputFD == -1) {
+				perror("/dev/null");
+				exit(1);
+			}
+
+			// Redirect stdin to source file
+			int result = dup2(inputFD, 0);
+			if (result == -1) {
+				perror("Error");
+				exit(1);
+			}
+
+			// close open file
+			if (close(inputFD) == -1) {
+				perror("Error");
+				exit(1);
+			}
+		}
+		if (command->outputFile != NULL) {
+			// Open output file
+			int outputFD = open(command->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (outputFD == -1) {
+				perror(command->outputFile);
+				exit(1);
+			}
+
+			// Redirect stdin to source file
+			int result = dup2(outputFD, 1);
+			if (result == -1) {
+				perror("Error");
+				exit(1);
+			}
+
+			// close open file
+			if (close(outputFD) == -1) {
+				perror("Error");
+				exit(1);
+			}
+		}
+		// no output redirection specified, send to dev/null
+		else if (background && launch->outFd == -1) {
+			int outputFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (outputFD == -1) {
+				perror("/dev/null");
+				exit(1);
+			}
+
+			// Redirect stdout to source file
+			int result = dup2(outputFD, 1);
+			if (result == -1) {
+				perror("Error");
+				exit(1);
+			}
+
+			// close open file
+			if (close(outputFD) == -1) {
+				perror("Error");
+				exit(1);
+			}
+		}
+		if (stamp != NULL) {
+			stamp->redirected = traceClock();
+		}
+		// pipeline built ins run right here instead of being exec'd; nothing execs, so drop the
+		// inherited O_CLOEXEC fds (other pipe ends would otherwise keep readers from seeing EOF)
+		if (launch->stageFn != NULL) {
+			close_range(STDERR_FILENO + 1, ~0U, 0);
+			exit(launch->stageFn(command));
+		}
+		if (stamp != NULL) {
+			stamp->exec = traceClock();
+		}
+		// Replace the current program with command->command
+		execResolved(launch->resolved, launch->argv);
+		// exec only returns if there is an error
+		perror(command->command);
+		exit(1);
+		break;
+	}
+	default:
+		break;
+	}
+	return spawnPid;
+}
+
+/*
+ * Function: vforkLaunch
+ * ----------------------------
+ *   Launches a command with vfork(). The parent is suspended until the child execs, so no page
+ *   tables are copied. Redirections are opened by the parent beforehand and the child only
+ *   dup2()s them. The child may only touch async-signal-safe state; an exec failure is reported
+ *   back through vforkErrno and printed by the parent.
+ *
+ *   launch: what to launch; inFd/outFd are the final stdin/stdout or -1 to inherit
+ *
+ *   returns: the pid of the child; -1 if vfork failed
+ */
+pid_t vforkLaunch(const launch_t* launch) {
+	vforkErrno = 0;
+	pid_t spawnPid = vfork();
+
+	if (spawnPid == 0) {
+		// child process, shares our memory but has its own signal dispositions
+		traceChild_t* stamp = traceChildStamp();
+		struct sigaction action = { { 0 } };
+		sigfillset(&action.sa_mask);
+		if (!launch->background) {
+			action.sa_handler = SIG_DFL;
+			sigaction(SIGINT, &action, NULL);
+		}
+		action.sa_handler = SIG_IGN;
+		sigaction(SIGTSTP, &action, NULL);
+		sigprocmask(SIG_SETMASK, &childSignalMask, NULL);
+
+		if ((launch->pgid != -1 && setpgid(0, launch->pgid) == -1)
+			|| (launch->inFd != -1 && dup2(launch->inFd, STDIN_FILENO) == -1)
+			|| (launch->outFd != -1 && dup2(launch->outFd, STDOUT_FILENO) == -1)) {
+			vforkErrno = errno;
+			_exit(1);
+		}
+		if (stamp != NULL) {
+			stamp->redirected = stamp->exec = traceClock();
+		}
+		execResolved(launch->resolved, launch->argv);
+		// exec only returns if there is an error
+		vforkErrno = errno;
+		_exit(1);
+	}
+	if (spawnPid == -1) {
+		perror("Error");
+	}
+	else if (vforkErrno != 0) {
+		// the child has already exited with 1, it is reaped like any other command
+		errno = vforkErrno;
+		perror(launch->command->command);
+	}
+	return spawnPid;
+}
+
+/*
+ * Function: spawnLaunch
+ * ----------------------------
+ *   Launches a command with posix_spawn(), or posix_spawnp() if its path is not cached. Redirections
+ *   are opened by the parent beforehand and passed through dup2 file actions; SIGINT is reset to
+ *   default for foreground commands and the process group is set with spawn attributes. Spawn
+ *   attributes cannot ignore a signal, so SIGTSTP is ignored in the shell for the duration of the
+ *   call and the child inherits that disposition.
+ *
+ *   launch: what to launch; inFd/outFd are the final stdin/stdout or -1 to inherit
+ *
+ *   returns: the pid of the child; -1 if the command could not be spawned (the error is printed)
+ */
+pid_t spawnLaunch(const launch_t* launch) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t tstpMask, oldMask, pending, defaultSignals;
+	struct sigaction ignore = { { 0 } }, oldTSTP;
+	pid_t spawnPid;
+
+	posix_spawn_file_actions_init(&actions);
+	if (launch->inFd != -1) {
+		posix_spawn_file_actions_adddup2(&actions, launch->inFd, STDIN_FILENO);
+	}
+	if (launch->outFd != -1) {
+		posix_spawn_file_actions_adddup2(&actions, launch->outFd, STDOUT_FILENO);
+	}
+
+	// block SIGTSTP while its disposition is swapped so a Ctrl-Z is not lost
+	sigemptyset(&tstpMask);
+	sigaddset(&tstpMask, SIGTSTP);
+	sigprocmask(SIG_BLOCK, &tstpMask, &oldMask);
+	sigpending(&pending);
+	bool tstpPending = sigismember(&pending, SIGTSTP);
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGTSTP, &ignore, &oldTSTP);
+
+	posix_spawnattr_init(&attr);
+	short flags = POSIX_SPAWN_SETSIGMASK;
+	posix_spawnattr_setsigmask(&attr, &childSignalMask);
+	if (!launch->background) {
+		sigemptyset(&defaultSignals);
+		sigaddset(&defaultSignals, SIGINT);
+		posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+		flags |= POSIX_SPAWN_SETSIGDEF;
+	}
+	if (launch->pgid != -1) {
+		posix_spawnattr_setpgroup(&attr, launch->pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	int err = launch->resolved != NULL
+		? posix_spawn(&spawnPid, launch->resolved->path, &actions, &attr, launch->argv, environ)
+		: posix_spawnp(&spawnPid, launch->argv[0], &actions, &attr, launch->argv, environ);
+
+	sigaction(SIGTSTP, &oldTSTP, NULL);
+	sigprocmask(SIG_SETMASK, &oldMask, NULL);
+	// ignoring SIGTSTP discarded a pending one, deliver it by hand
+	if (tstpPending) {
+		handle_SIGTSTP(SIGTSTP);
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0) {
+		errno = err;
+		perror(launch->command->command);
+		return -1;
+	}
+	return spawnPid;
+}
+
+/*
+ * Function: sendFds
+ * ----------------------------
+ *   Sends a message over a Unix socket along with file descriptors.
+ *
+ *   sock: the socket to send on
+ *   data: the message
+ *   len: the length of the message
+ *   fds: the file descriptors to pass
+ *   numFds: the number of file descriptors, at most 4
+ *
+ *   returns: 0 if successful; -1 otherwise (errno is set)
+ */
+int sendFds(int sock, const void* data, size_t len, const int* fds, int numFds) {
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int) * 4)];
+	} control;
+	struct iovec iov = { (void*)data, len };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (numFds > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+	}
+	// a slot that died must not take the shell down with SIGPIPE
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/*
+ * Function: recvFds
+ * ----------------------------
+ *   Receives a message from a Unix socket along with any file descriptors passed with it. The
+ *   received descriptors are close-on-exec.
+ *
+ *   sock: the socket to receive from
+ *   data: the buffer for the message
+ *   len: the size of the buffer
+ *   fds: the array for the received file descriptors
+ *   maxFds: the size of the array, at most 4
+ *   numFds: set to the number of file descriptors received
+ *   flags: recvmsg flags, e.g. MSG_DONTWAIT
+ *
+ *   returns: the length of the message; 0 at EOF; -1 on error (errno is set)
+ */
+ssize_t recvFds(int sock, void* data, size_t len, int* fds, int maxFds, int* numFds, int flags) {
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int) * 4)];
+	} control;
+	struct iovec iov = { data, len };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	*numFds = 0;
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+	} while (n == -1 && errno == EINTR);
+	for (struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int* received = (int*)CMSG_DATA(cmsg);
+		for (int i = 0; i < count; i++) {
+			if (*numFds < maxFds) {
+				fds[(*numFds)++] = received[i];
+			}
+			else {
+				close(received[i]);
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Function: runSlot
+ * ----------------------------
+ *   Body of a zygote slot: waits for one launch request, applies its working directory, stdio,
+ *   process group and signal dispositions, and execs the command. If the exec fails the errno is
+ *   sent back before exiting with 1; a successful exec closes the close-on-exec socket instead.
+ *
+ *   sock: the slot's end of its socket to the shell
+ */
+void runSlot(int sock) {
+	static char buf[ZYGOTE_MSG_SIZE];
+	int fds[4];
+	int numFds;
+	ssize_t n = recvFds(sock, buf, sizeof(buf) - 1, fds, 4, &numFds, 0);
+	if (n < (ssize_t)sizeof(slotRequest_t) || numFds != 4) {
+		// the shell exited or the pool was dropped
+		_exit(0);
+	}
+	buf[n] = '\0';
+
+	// unpack the path, argv and environment
+	slotRequest_t* request = (slotRequest_t*)buf;
+	char** strings = malloc(sizeof(*strings) * (request->argc + request->envc + 2));
+	char* p = buf + sizeof(*request);
+	char* path = p;
+	p += strlen(p) + 1;
+	char** argv = strings;
+	char** envp = strings + request->argc + 1;
+	for (int i = 0; i < request->argc + request->envc; i++) {
+		strings[i < request->argc ? i : i + 1] = p;
+		p += strlen(p) + 1;
+	}
+	argv[request->argc] = NULL;
+	envp[request->envc] = NULL;
+
+	struct sigaction action = { { 0 } };
+	sigfillset(&action.sa_mask);
+	if (!request->background) {
+		action.sa_handler = SIG_DFL;
+		sigaction(SIGINT, &action, NULL);
+	}
+	sigprocmask(SIG_SETMASK, &childSignalMask, NULL);
+
+	int err = 0;
+	if (fchdir(fds[0]) == -1 || (request->pgid != -1 && setpgid(0, request->pgid) == -1)
+		|| dup2(fds[1], STDIN_FILENO) == -1 || dup2(fds[2], STDOUT_FILENO) == -1
+		|| dup2(fds[3], STDERR_FILENO) == -1) {
+		err = errno;
+	}
+	else {
+		environ = envp;
+		if (path[0] != '\0') {
+			execv(path, argv);
+		}
+		else {
+			execvp(argv[0], argv);
+		}
+		err = errno;
+	}
+	write(sock, &err, sizeof(err));
+	_exit(1);
+}
+
+/*
+ * Function: forkSlot
+ * ----------------------------
+ *   Forks a slot in the zygote and hands its socket to the shell. The slot is cloned with
+ *   CLONE_PARENT, so it is the shell's child and the shell can wait for it like for any child.
+ *
+ *   control: the zygote's socket to the shell
+ */
+void forkSlot(int control) {
+	int sv[2] = { -1, -1 };
+	pid_t slotPid = -1;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0) {
+		// a fork whose parent is the shell; the zygote is single threaded, so the raw call is safe
+		slotPid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+		if (slotPid == 0) {
+			close(control);
+			close(sv[0]);
+			runSlot(sv[1]);
+		}
+		close(sv[1]);
+	}
+	// the shell counts replies, so a failed slot is still answered
+	sendFds(control, &slotPid, sizeof(slotPid), &sv[0], slotPid != -1 ? 1 : 0);
+	if (sv[0] != -1) {
+		close(sv[0]);
+	}
+}
+
+/*
+ * Function: zygoteMain
+ * ----------------------------
+ *   Body of the zygote: forks slots for as long as the shell asks for them. Every request is a
+ *   one byte message holding the number of slots wanted. Exits when the shell closes its socket.
+ *
+ *   control: the zygote's socket to the shell
+ */
+void zygoteMain(int control) {
+	struct sigaction ignore = { { 0 } };
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGTSTP, &ignore, NULL);
+	// keep only stdio and the socket, the shell's epoll set and pipes are not ours
+	close_range(STDERR_FILENO + 1, control - 1, 0);
+	close_range(control + 1, ~0U, 0);
+
+	unsigned char wanted;
+	ssize_t n;
+	while ((n = read(control, &wanted, 1)) == 1 || (n == -1 && errno == EINTR)) {
+		for (int i = 0; n == 1 && i < wanted; i++) {
+			forkSlot(control);
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Function: startZygote
+ * ----------------------------
+ *   Forks the zygote, a helper that keeps ZYGOTE_SLOTS pre-forked children ready to exec launch
+ *   requests, and asks it for a full pool. Does nothing if the zygote is running.
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
+ */
+int startZygote(void) {
+	if (zygoteFd != -1) {
+		return 0;
+	}
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		zygoteMain(sv[1]);
+	}
+	close(sv[1]);
+	zygoteFd = sv[0];
+
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = zygoteFd;
+	if (epoll_ctl(eventFd, EPOLL_CTL_ADD, zygoteFd, &event) == -1) {
+		perror("epoll_ctl");
+		stopZygote();
+		return -1;
+	}
+	requestSlots();
+	return 0;
+}
+
+/*
+ * Function: stopZygote
+ * ----------------------------
+ *   Closes the socket to the zygote and the ready slots, which makes them all exit.
+ */
+void stopZygote(void) {
+	if (zygoteFd == -1) {
+		return;
+	}
+	epoll_ctl(eventFd, EPOLL_CTL_DEL, zygoteFd, NULL);
+	close(zygoteFd);
+	zygoteFd = -1;
+	for (int i = 0; i < numZygoteSlots; i++) {
+		close(zygoteSlots[i].fd);
+	}
+	numZygoteSlots = 0;
+	zygoteRequested = 0;
+}
+
+/*
+ * Function: requestSlots
+ * ----------------------------
+ *   Asks the zygote for enough slots to fill the pool. The slots arrive through the event loop.
+ */
+void requestSlots(void) {
+	unsigned char wanted = ZYGOTE_SLOTS - numZygoteSlots - zygoteRequested;
+	if (zygoteFd == -1 || wanted == 0) {
+		return;
+	}
+	if (send(zygoteFd, &wanted, 1, MSG_NOSIGNAL) == 1) {
+		zygoteRequested += wanted;
+	}
+}
+
+/*
+ * Function: receiveSlots
+ * ----------------------------
+ *   Adds the slots the zygote has sent to the pool without blocking. If the zygote has exited,
+ *   the zygote launcher is stopped and launches fall back to spawn.
+ */
+void receiveSlots(void) {
+	while (zygoteFd != -1) {
+		pid_t pid;
+		int fd;
+		int numFds;
+		ssize_t n = recvFds(zygoteFd, &pid, sizeof(pid), &fd, 1, &numFds, MSG_DONTWAIT);
+		if (n == -1 && errno == EAGAIN) {
+			return;
+		}
+		if (n <= 0) {
+			stopZygote();
+			return;
+		}
+		zygoteRequested--;
+		if (numFds == 1 && numZygoteSlots < ZYGOTE_SLOTS) {
+			zygoteSlots[numZygoteSlots++] = (slot_t){ pid, fd };
+		}
+		else if (numFds == 1) {
+			close(fd);
+		}
+	}
+}
+
+/*
+ * Function: zygoteSlotReady
+ * ----------------------------
+ *   Checks for a ready slot, waiting up to ZYGOTE_WAIT_MS for one that is being forked.
+ *
+ *   returns: true if a slot is ready; false otherwise
+ */
+bool zygoteSlotReady(void) {
+	receiveSlots();
+	if (numZygoteSlots == 0 && zygoteRequested > 0) {
+		struct pollfd pfd = { .fd = zygoteFd, .events = POLLIN };
+		if (poll(&pfd, 1, ZYGOTE_WAIT_MS) > 0) {
+			receiveSlots();
+		}
+	}
+	return numZygoteSlots > 0;
+}
+
+/*
+ * Function: zygoteLaunch
+ * ----------------------------
+ *   Launches a command in a ready zygote slot. The slot gets the path, argv and environment in
+ *   one message, with the working directory and stdio passed as file descriptors, and only has
+ *   to exec. The pool is refilled in the background.
+ *
+ *   launch: what to launch; inFd/outFd are the final stdin/stdout or -1 to inherit
+ *
+ *   returns: the pid of the child; -1 if the request could not be handed to a slot (nothing is
+ *   printed, the caller falls back to another backend)
+ *
+ *   notes: like with vfork, a command that fails to exec is reported here and its slot exits
+ *   with 1
+ */
+pid_t zygoteLaunch(const launch_t* launch) {
+	static char buf[ZYGOTE_MSG_SIZE];
+	slotRequest_t request = { launch->background, launch->pgid, 0, 0 };
+	size_t len = sizeof(request);
+	const char* path = launch->resolved != NULL ? launch->resolved->path : "";
+	size_t pathLen = strlen(path) + 1;
+	if (len + pathLen > sizeof(buf)) {
+		return -1;
+	}
+	memcpy(buf + len, path, pathLen);
+	len += pathLen;
+	// argv and then the environment, each string terminated
+	for (int pass = 0; pass < 2; pass++) {
+		char** strings = pass == 0 ? launch->argv : environ;
+		for (int i = 0; strings[i] != NULL; i++) {
+			size_t stringLen = strlen(strings[i]) + 1;
+			if (len + stringLen > sizeof(buf)) {
+				return -1;
+			}
+			memcpy(buf + len, strings[i], stringLen);
+			len += stringLen;
+			*(pass == 0 ? &request.argc : &request.envc) += 1;
+		}
+	}
+	memcpy(buf, &request, sizeof(request));
+
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd == -1) {
+		return -1;
+	}
+	int fds[4] = { cwd, launch->inFd != -1 ? launch->inFd : STDIN_FILENO,
+		launch->outFd != -1 ? launch->outFd : STDOUT_FILENO, STDERR_FILENO };
+	pid_t spawnPid = -1;
+	while (spawnPid == -1 && numZygoteSlots > 0) {
+		slot_t slot = zygoteSlots[--numZygoteSlots];
+		if (sendFds(slot.fd, buf, len, fds, 4) == 0) {
+			// the slot's end is close-on-exec, so EOF means the exec succeeded
+			int err = 0;
+			ssize_t n;
+			do {
+				n = read(slot.fd, &err, sizeof(err));
+			} while (n == -1 && errno == EINTR);
+			if (n == sizeof(err)) {
+				errno = err;
+				perror(launch->command->command);
+			}
+			spawnPid = slot.pid;
+		}
+		close(slot.fd);
+	}
+	close(cwd);
+	requestSlots();
+	return spawnPid;
+}
+
+/*
+ * Function: launchCommand
+ * ----------------------------
+ *   Launches an external command with the selected backend. If vfork is unavailable the command
+ *   falls back to fork; if the zygote has no slot ready it falls back to spawn. Pipeline built ins
+ *   (see stageBuiltin) always use fork since the child runs shell code. lastLauncher records the
+ *   backend that was actually used.
+ *
+ *   command: a pointer to the command struct
+ *   background: whether the command runs in the background
+ *   pipeIn: read end of the pipe from the previous stage or -1
+ *   pipeOut: write end of the pipe to the next stage or -1
+ *   pgid: process group to put the child in, 0 for a new group, -1 for the shell's
+ *
+ *   returns: the pid of the child; -1 if no child was started (the error is printed)
+ */
+pid_t launchCommand(command_t* command, bool background, int pipeIn, int pipeOut, pid_t pgid) {
+	launch_t launch = { command, command->argv, background, NULL, pipeIn, pipeOut, pgid, NULL };
+	anyLaunched = true;
+	if (pipeIn != -1 || pipeOut != -1) {
+		launch.stageFn = stageBuiltin(command);
+	}
+	if (launch.stageFn == NULL) {
+		// resolve in the shell so the child does not have to probe $PATH
+		launch.resolved = lookupCommandPath(command->command);
+	}
+	if (launcherBackend == LAUNCHER_FORK || launch.stageFn != NULL) {
+		lastLauncher = LAUNCHER_FORK;
+		return forkLaunch(&launch);
+	}
+
+	int inFd, outFd;
+	if (openRedirections(command, background && pipeIn == -1, background && pipeOut == -1, &inFd, &outFd) == -1) {
+		return -1;
+	}
+	launch.inFd = inFd != -1 ? inFd : pipeIn;
+	launch.outFd = outFd != -1 ? outFd : pipeOut;
+
+	pid_t spawnPid = -1;
+	if (launcherBackend == LAUNCHER_ZYGOTE && zygoteSlotReady()) {
+		lastLauncher = LAUNCHER_ZYGOTE;
+		spawnPid = zygoteLaunch(&launch);
+	}
+	if (spawnPid == -1 && (launcherBackend == LAUNCHER_SPAWN || launcherBackend == LAUNCHER_ZYGOTE)) {
+		lastLauncher = LAUNCHER_SPAWN;
+		spawnPid = spawnLaunch(&launch);
+	}
+	else if (launcherBackend == LAUNCHER_VFORK) {
+		lastLauncher = LAUNCHER_VFORK;
+		spawnPid = vforkLaunch(&launch);
+	}
+
+	if (inFd != -1) {
+		close(inFd);
+	}
+	if (outFd != -1) {
+		close(outFd);
+	}
+	if (spawnPid == -1 && lastLauncher == LAUNCHER_VFORK) {
+		lastLauncher = LAUNCHER_FORK;
+		launch.inFd = pipeIn;
+		launch.outFd = pipeOut;
+		spawnPid = forkLaunch(&launch);
+	}
+	return spawnPid;
+}
+
+/*
+ * Function: copyFd
+ * ----------------------------
+ *   Copies everything from one fd to another. When either side is a pipe the data is moved with
+ *   splice() and never passes through user space; otherwise it falls back to read/write.
+ *
+ *   inFd: the fd to copy from until EOF
+ *   outFd: the fd to copy to
+ *
+ *   returns: 0 if successful; -1 otherwise (errno is set)
+ */
+int copyFd(int inFd, int outFd) {
+	ssize_t n;
+	while ((n = splice(inFd, NULL, outFd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0);
+	if (n == 0) {
+		return 0;
+	}
+	if (errno != EINVAL) {
+		return -1;
+	}
+
+	char buf[COPY_BUF_SIZE];
+	while ((n = read(inFd, buf, sizeof(buf))) > 0) {
+		if (writeAll(outFd, buf, n) == -1) {
+			return -1;
+		}
+	}
+	return n == 0 ? 0 : -1;
+}
+
+/*
+ * Function: writeAll
+ * ----------------------------
+ *   Writes a whole buffer, retrying short writes.
+ *
+ *   fd: the fd to write to
+ *   buf: the data to write
+ *   len: the number of bytes to write
+ *
+ *   returns: 0 if successful; -1 otherwise (errno is set)
+ */
+int writeAll(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Function: spliceAll
+ * ----------------------------
+ *   Moves exactly len bytes out of a pipe with splice().
+ *
+ *   inFd: the pipe to move from
+ *   outFd: the fd to move to
+ *   len: the number of bytes to move
+ *
+ *   returns: 0 if successful; -1 otherwise (errno is set)
+ */
+int spliceAll(int inFd, int outFd, size_t len) {
+	while (len > 0) {
+		ssize_t n = splice(inFd, NULL, outFd, NULL, len, SPLICE_F_MOVE);
+		if (n <= 0) {
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Function: catStage
+ * ----------------------------
+ *   Pipeline built in cat: copies the named files (or stdin, also named -) to stdout with
+ *   copyFd, so data flowing through the pipeline is spliced rather than copied.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if a file could not be copied
+ */
+int catStage(command_t* command) {
+	int retVal = 0;
+	if (command->numArgs == 0 && copyFd(STDIN_FILENO, STDOUT_FILENO) == -1) {
+		perror("cat");
+		retVal = 1;
+	}
+	for (int i = 0; i < command->numArgs; i++) {
+		char* file = command->args[i];
+		int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+		if (fd == -1 || copyFd(fd, STDOUT_FILENO) == -1) {
+			fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+			retVal = 1;
+		}
+		if (fd > STDIN_FILENO) {
+			close(fd);
+		}
+	}
+	return retVal;
+}
+
+/*
+ * Function: teeStage
+ * ----------------------------
+ *   Pipeline built in tee [-a] file...: copies stdin to stdout and every file. When stdin and
+ *   stdout are pipes, tee() duplicates each chunk into stdout and a scratch pipe per extra file
+ *   and splice() moves it into the files, so the data never passes through user space.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if a file could not be opened or written
+ */
+int teeStage(command_t* command) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	int first = 0;
+	if (command->numArgs > 0 && strcmp(command->args[0], "-a") == 0) {
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+		first = 1;
+	}
+	int numFiles = command->numArgs - first;
+	int fds[numFiles > 0 ? numFiles : 1];
+	int retVal = 0;
+	for (int i = 0; i < numFiles; i++) {
+		fds[i] = open(command->args[first + i], flags, 0644);
+		if (fds[i] == -1) {
+			perror(command->args[first + i]);
+			retVal = 1;
+		}
+	}
+
+	// scratch pipe as large as stdin's so one tee() can always duplicate a whole chunk into it
+	int scratch[2] = { -1, -1 };
+	// splice() cannot write to O_APPEND files, so -a always copies
+	int pipeSize = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+	bool spliced = first == 0 && pipeSize > 0 && fcntl(STDOUT_FILENO, F_GETPIPE_SZ) > 0
+		&& (numFiles < 2 || (pipe(scratch) == 0 && fcntl(scratch[1], F_SETPIPE_SZ, pipeSize) >= pipeSize));
+
+	ssize_t n = 0;
+	if (spliced) {
+		while ((n = tee(STDIN_FILENO, STDOUT_FILENO, SPLICE_CHUNK, 0)) > 0) {
+			int last = -1;
+			for (int i = 0; i < numFiles; i++) {
+				if (fds[i] == -1) {
+					continue;
+				}
+				if (last != -1 && (tee(STDIN_FILENO, scratch[1], n, 0) != n || spliceAll(scratch[0], fds[last], n) == -1)) {
+					perror("tee");
+					retVal = 1;
+				}
+				last = i;
+			}
+			// the last file (or nothing) consumes the chunk from stdin
+			if (last != -1 ? spliceAll(STDIN_FILENO, fds[last], n) == -1 : spliceAll(STDIN_FILENO, openDevNull(), n) == -1) {
+				perror("tee");
+				retVal = 1;
+				break;
+			}
+		}
+	}
+	else {
+		char buf[COPY_BUF_SIZE];
+		while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+			if (writeAll(STDOUT_FILENO, buf, n) == -1) {
+				break;
+			}
+			for (int i = 0; i < numFiles; i++) {
+				if (fds[i] != -1 && writeAll(fds[i], buf, n) == -1) {
+					perror(command->args[first + i]);
+					close(fds[i]);
+					fds[i] = -1;
+					retVal = 1;
+				}
+			}
+		}
+	}
+	if (n == -1) {
+		perror("tee");
+		retVal = 1;
+	}
+	return retVal;
+}
+
+/*
+ * Function: openDevNull
+ * ----------------------------
+ *   Gets an fd open for writing to /dev/null, opening it the first time.
+ *
+ *   returns: the fd, or -1 if /dev/null could not be opened
+ */
+int openDevNull(void) {
+	static int devNull = -1;
+	if (devNull == -1) {
+		devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	}
+	return devNull;
+}
+
+/*
+ * Function: stageBuiltin
+ * ----------------------------
+ *   Looks up the pipeline built in for a pipeline stage. cat and tee are run by the shell itself
+ *   (in a forked child) when they have no options besides tee's -a, as are the built ins
+ *   registered with BUILTIN_STAGE.
+ *
+ *   command: a pointer to the command struct of the stage
+ *
+ *   returns: the built in to run, or NULL to exec the command
+ */
+stageFn_t stageBuiltin(command_t* command) {
+	bool cat = strcmp(command->command, CAT_CMD) == 0;
+	bool tee = strcmp(command->command, TEE_CMD) == 0;
+	if (!cat && !tee) {
+		const builtin_t* builtin = findBuiltin(command->command);
+		return builtin != NULL && (builtin->flags & BUILTIN_STAGE) ? builtin->fn : NULL;
+	}
+	for (int i = 0; i < command->numArgs; i++) {
+		char* arg = command->args[i];
+		if (arg[0] == '-' && arg[1] != '\0' && !(tee && i == 0 && strcmp(arg, "-a") == 0)) {
+			return NULL;
+		}
+	}
+	return cat ? catStage : teeStage;
+}
+
+/*
+ * Function: countStages
+ * ----------------------------
+ *   Counts the stages of a pipeline.
+ *
+ *   pipeline: a pointer to the command struct of the first stage
+ *
+ *   returns: the number of stages
+ */
+int countStages(command_t* pipeline) {
+	int numStages = 0;
+	for (command_t* stage = pipeline; stage != NULL; stage = stage->next) {
+		numStages++;
+	}
+	return numStages;
+}
+
+/*
+ * Function: startPipeline
+ * ----------------------------
+ *   Starts every stage of a pipeline without waiting for it. Every stage gets its own process,
+ *   connected to the next by a pipe whose capacity can be set with $SMALLSH_PIPE_SIZE. Stages of a
+ *   background pipeline share a new process group; foreground stages stay in the shell's group so
+ *   they get the terminal's SIGINT. Started stages are added to the job table.
+ *
+ *   pipeline: a pointer to the command struct of the first stage
+ *   background: whether the pipeline runs in the background
+ *   parallelJob: the number of the parallel job the pipeline runs as, 0 if none
+ *   lastOut: the stdout of the last stage unless it redirects it, -1 for the shell's (or /dev/null
+ *   in the background)
+ *   pids: an array with room for every stage, filled with the pids of the started stages
+ *   lastPid: set to the pid of the last stage, or -1 if it was not started
+ *
+ *   returns: the number of stages started
+ */
+int startPipeline(command_t* pipeline, bool background, int parallelJob, int lastOut, pid_t* pids, pid_t* lastPid) {
+	char* pipeSizeEnv = getenv(PIPE_SIZE_ENV);
+	int pipeSize = pipeSizeEnv ? atoi(pipeSizeEnv) : 0;
+	int numPids = 0;
+	pid_t pgid = background && pipeline->next != NULL ? 0 : -1;
+	int pipeIn = -1;
+	*lastPid = -1;
+
+	for (command_t* stage = pipeline; stage != NULL; stage = stage->next) {
+		int fds[2] = { -1, -1 };
+		if (stage->next != NULL) {
+			if (pipe2(fds, O_CLOEXEC) == -1) {
+				perror("pipe");
+				break;
+			}
+			if (pipeSize > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipeSize) == -1) {
+				perror(PIPE_SIZE_ENV);
+			}
+		}
+
+		uint64_t launchStart = traceClock();
+		pid_t spawnPid = launchCommand(stage, background, pipeIn, stage->next != NULL ? fds[1] : lastOut, pgid);
+		traceRecord(launcherName(lastLauncher), "launch", spawnPid != -1 ? spawnPid : 0, launchStart);
+		if (pipeIn != -1) {
+			close(pipeIn);
+		}
+		if (fds[1] != -1) {
+			close(fds[1]);
+		}
+		pipeIn = fds[0];
+
+		if (spawnPid != -1) {
+			// SIGCHLD is only read by the event loop, so the child is tracked before it can be reaped
+			addJob(spawnPid, background, stage->next == NULL, parallelJob);
+			pids[numPids++] = spawnPid;
+			if (pgid == 0) {
+				pgid = spawnPid;
+			}
+			if (pgid != -1) {
+				// the child does this too, whichever runs first wins the race
+				setpgid(spawnPid, pgid);
+			}
+		}
+		if (stage->next == NULL) {
+			*lastPid = spawnPid;
+		}
+	}
+	if (pipeIn != -1) {
+		close(pipeIn);
+	}
+	return numPids;
+}
+
+/*
+ * Function: runPipeline
+ * ----------------------------
+ *   Runs a pipeline of one or more commands with startPipeline, waiting for every stage of a
+ *   foreground pipeline. The status of the pipeline is that of its last stage. The stdout and
+ *   stderr of a background pipeline are captured with openJobOutput.
+ *
+ *   pipeline: a pointer to the command struct of the first stage
+ */
+void runPipeline(command_t* pipeline) {
+	bool background = pipeline->isBackground && backgroundEnabled;
+	int numStages = countStages(pipeline);
+	if (background && numJobs + numStages > MAX_JOBS) {
+		fprintf(stderr, "Error: too many background jobs (limit %d)\n", MAX_JOBS);
+		return;
+	}
+
+	pid_t* pids = arenaAlloc(&commandArena, sizeof(*pids) * numStages);
+	pid_t lastPid;
+	if (!background) {
+		startUsage(&foregroundUsage);
+	}
+	// a background job writes stdout and stderr into a capture pipe, which stands in for the shell's
+	// stderr while the job starts so every stage inherits it
+	jobOutput_t* output = NULL;
+	int savedErr = -1;
+	if (background) {
+		int captureFd;
+		output = openJobOutput(&captureFd);
+		if (output != NULL) {
+			fflush(stderr);
+			savedErr = swapFd(captureFd, STDERR_FILENO);
+		}
+	}
+	int numPids = startPipeline(pipeline, background, 0, savedErr != -1 ? STDERR_FILENO : -1, pids, &lastPid);
+	if (savedErr != -1) {
+		fflush(stderr);
+		dup2(savedErr, STDERR_FILENO);
+		close(savedErr);
+	}
+	if (output != NULL) {
+		output->pid = lastPid;
+		if (lastPid == -1) {
+			// nothing to keep, but the errors of the failed launch belong on the terminal
+			closeJobOutput(output, true);
+		}
+	}
+
+	if (lastPid == -1) {
+		// the last stage was not started, report it like a child that exited with 1
+		if (!background) {
+			foregroundStatus = W_EXITCODE(1, 0);
+			statusInitialized = true;
+		}
+	}
+	// background
+	else if (background) {
+		lastBackgroundPid = lastPid;
+		printf("background pid is %d\n", lastPid);
+		fflush(stdout);
+	}
+	if (!background) {
+		// foreground, wait for every stage to complete
+		waitForeground(pids, numPids);
+		clock_gettime(CLOCK_MONOTONIC, &foregroundUsage.end);
+		// check for signal termination
+		if (lastPid != -1 && WIFSIGNALED(foregroundStatus)) {
+			printf("terminated by signal %d\n", WTERMSIG(foregroundStatus));
+			fflush(stdout);
+		}
+		// set status to initialized
+		statusInitialized = true;
+	}
+}
+
+/*
+ * Function: openJobOutput
+ * ----------------------------
+ *   Sets up the capture of a background job's output: a pipe whose read end the event loop drains
+ *   into a ring buffer of $SMALLSH_JOB_OUTPUT_SIZE bytes. The slot of the oldest finished job is
+ *   reused when every slot is taken.
+ *
+ *   captureFd: set to the write end of the pipe, for the job's stdout and stderr
+ *
+ *   returns: a pointer to the job's output, whose pid the caller sets; NULL if output is not
+ *   captured (the size is 0, every slot belongs to a running job, or the pipe failed)
+ */
+jobOutput_t* openJobOutput(int* captureFd) {
+	char* sizeEnv = getenv(OUTPUT_SIZE_ENV);
+	long size = sizeEnv != NULL ? atol(sizeEnv) : DEFAULT_OUTPUT_SIZE;
+	if (size <= 0) {
+		return NULL;
+	}
+	jobOutput_t* output = NULL;
+	for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+		jobOutput_t* slot = &jobOutputs[i];
+		if (slot->pid == 0) {
+			output = slot;
+			break;
+		}
+		if (slot->done && slot->fd == -1 && (output == NULL || slot->number < output->number)) {
+			output = slot;
+		}
+	}
+	int fds[2];
+	if (output == NULL || pipe2(fds, O_CLOEXEC) == -1) {
+		return NULL;
+	}
+	// only the shell's end is non-blocking
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = fds[0];
+	if (epoll_ctl(eventFd, EPOLL_CTL_ADD, fds[0], &event) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	if (output->pid != 0) {
+		closeJobOutput(output, false);
+	}
+	output->buf = malloc(size);
+	output->size = size;
+	output->written = 0;
+	output->number = ++numJobOutputs;
+	output->fd = fds[0];
+	output->done = false;
+	output->pid = -1;
+	*captureFd = fds[1];
+	return output;
+}
+
+/*
+ * Function: closeJobOutput
+ * ----------------------------
+ *   Frees a job's captured output and its slot.
+ *
+ *   output: a pointer to the job's output
+ *   flush: whether to write what was captured to the shell's stderr first
+ */
+void closeJobOutput(jobOutput_t* output, bool flush) {
+	if (output->fd != -1) {
+		drainJobOutput(output);
+	}
+	if (output->fd != -1) {
+		epoll_ctl(eventFd, EPOLL_CTL_DEL, output->fd, NULL);
+		close(output->fd);
+	}
+	if (flush) {
+		writeJobOutput(output, STDERR_FILENO, 0);
+	}
+	free(output->buf);
+	output->buf = NULL;
+	output->fd = -1;
+	output->pid = 0;
+}
+
+/*
+ * Function: findJobOutput
+ * ----------------------------
+ *   Looks up the captured output of a background job.
+ *
+ *   pid: the process id of the job's last stage
+ *
+ *   returns: a pointer to the job's output, or NULL if it is not captured
+ */
+jobOutput_t* findJobOutput(pid_t pid) {
+	for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+		if (jobOutputs[i].pid == pid && pid > 0) {
+			return &jobOutputs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: findOutputFd
+ * ----------------------------
+ *   Looks up the background job a capture pipe belongs to.
+ *
+ *   fd: the read end of the pipe
+ *
+ *   returns: a pointer to the job's output, or NULL if fd is not a capture pipe
+ */
+jobOutput_t* findOutputFd(int fd) {
+	for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+		if (jobOutputs[i].pid != 0 && jobOutputs[i].fd == fd) {
+			return &jobOutputs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: drainJobOutput
+ * ----------------------------
+ *   Reads everything a capture pipe holds into the job's ring buffer without blocking, overwriting
+ *   the oldest output once the buffer is full. The pipe is closed at EOF.
+ *
+ *   output: a pointer to the job's output
+ */
+void drainJobOutput(jobOutput_t* output) {
+	while (true) {
+		size_t pos = output->written % output->size;
+		ssize_t n = read(output->fd, output->buf + pos, output->size - pos);
+		if (n > 0) {
+			output->written += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			return;
+		}
+		break;
+	}
+	epoll_ctl(eventFd, EPOLL_CTL_DEL, output->fd, NULL);
+	close(output->fd);
+	output->fd = -1;
+}
+
+/*
+ * Function: writeJobOutput
+ * ----------------------------
+ *   Writes a job's captured output from an offset on.
+ *
+ *   output: a pointer to the job's output
+ *   fd: the file descriptor to write to
+ *   from: the offset in the job's output to start at
+ *
+ *   returns: the offset the output was written up to
+ *
+ *   notes: output the ring has already overwritten is skipped with a note on stderr
+ */
+uint64_t writeJobOutput(const jobOutput_t* output, int fd, uint64_t from) {
+	if (output->written - from > output->size) {
+		fprintf(stderr, "jobs: %llu bytes of output were dropped\n", (unsigned long long)(output->written - output->size - from));
+		from = output->written - output->size;
+	}
+	size_t start = from % output->size;
+	size_t length = output->written - from;
+	// the oldest bytes run to the end of the buffer, the rest wraps around to its start
+	size_t first = length < output->size - start ? length : output->size - start;
+	writeAll(fd, output->buf + start, first);
+	writeAll(fd, output->buf, length - first);
+	return output->written;
+}
+
+/*
+ * Function: followJobOutput
+ * ----------------------------
+ *   Writes a job's captured output to stdout and keeps writing what the job prints until its pipe
+ *   is at EOF. ^C stops following.
+ *
+ *   output: a pointer to the job's output
+ */
+void followJobOutput(jobOutput_t* output) {
+	uint64_t printed = writeJobOutput(output, STDOUT_FILENO, 0);
+	sigset_t oldMask;
+	int intFd = openInterruptFd(&oldMask);
+	while (output->fd != -1) {
+		if (waitInterruptible(intFd, NULL)) {
+			break;
+		}
+		printed = writeJobOutput(output, STDOUT_FILENO, printed);
+	}
+	closeInterruptFd(intFd, &oldMask);
+}
+
+/*
+ * Function: jobsBuiltin
+ * ----------------------------
+ *   Built in jobs [-o pid | -f pid]: lists the background jobs with the status and amount of output
+ *   of every job whose output is captured. -o writes a job's captured output, -f follows it until
+ *   the job closes its output.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if the arguments are invalid or the job's output is not captured
+ */
+int jobsBuiltin(command_t* command) {
+	// pick up what was reaped or printed since the event loop last ran
+	dispatchEvents(0);
+	if (command->numArgs == 0) {
+		for (long number = 1; number <= numJobOutputs; number++) {
+			for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+				jobOutput_t* output = &jobOutputs[i];
+				if (output->pid <= 0 || output->number != number) {
+					continue;
+				}
+				printf("pid %d, %llu bytes of output: ", output->pid, (unsigned long long)output->written);
+				if (output->done) {
+					printStatus(output->status);
+				}
+				else {
+					printf("running\n");
+				}
+			}
+		}
+		for (size_t i = 0; i < JOB_TABLE_SIZE; i++) {
+			job_t* job = &jobTable[i];
+			if (job->pid != 0 && job->background && job->lastStage && job->parallelJob == 0 && findJobOutput(job->pid) == NULL) {
+				printf("pid %d, output not captured: running\n", job->pid);
+			}
+		}
+		fflush(stdout);
+		return 0;
+	}
+
+	char* end;
+	long pid = command->numArgs == 2 ? strtol(command->args[1], &end, 10) : 0;
+	bool follow = strcmp(command->args[0], "-f") == 0;
+	if (command->numArgs != 2 || (!follow && strcmp(command->args[0], "-o") != 0) || *end != '\0' || pid <= 0) {
+		fprintf(stderr, "usage: jobs [-o pid | -f pid]\n");
+		return 1;
+	}
+	jobOutput_t* output = findJobOutput(pid);
+	if (output == NULL) {
+		fprintf(stderr, "jobs: no captured output for pid %ld\n", pid);
+		return 1;
+	}
+	fflush(stdout);
+	if (follow) {
+		followJobOutput(output);
+	}
+	else {
+		writeJobOutput(output, STDOUT_FILENO, 0);
+	}
+	return 0;
+}
+
+/*
+ * Function: timeCommand
+ * ----------------------------
+ *   Built in time prefix: runs the rest of the line as a foreground pipeline and prints the
+ *   resources it used to stderr, so timing a command costs no extra exec.
+ *
+ *   command: a pointer to the command struct, whose command is time
+ *
+ *	 returns: 0 if successful; 1 if there was nothing to time
+ *
+ *   notes: the timed command always runs in the foreground and is never a built in
+ */
+int timeCommand(command_t* command) {
+	if (command->numArgs == 0) {
+		fprintf(stderr, "usage: time command\n");
+		return 1;
+	}
+	// drop the time prefix, the remaining words are the command
+	command->argv++;
+	command->argvCap--;
+	command->args++;
+	command->numArgs--;
+	command->command = command->argv[0];
+	command->isBackground = false;
+	runPipeline(command);
+	printUsage(stderr, &foregroundUsage);
+	return 0;
+}
+
+/*
+ * Function: showStatus
+ * ----------------------------
+ *   Built in status [-v]: prints the status of the last foreground job. With -v the resources it
+ *   used are printed too, followed by the status and resources of the last completed background
+ *   job.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0
+ */
+int showStatus(command_t* command) {
+	bool verbose = command->numArgs > 0 && strcmp(command->args[0], "-v") == 0;
+	// status variable has not been initialized
+	if (statusInitialized == false) {
+		printf("exit status 0\n");
+		fflush(stdout);
+	}
+	else {
+		printStatus(foregroundStatus);
+		if (verbose) {
+			printUsage(stdout, &foregroundUsage);
+		}
+	}
+	if (verbose && backgroundUsage.pid != 0) {
+		printf("background pid %d: ", backgroundUsage.pid);
+		printStatus(backgroundStatus);
+		printUsage(stdout, &backgroundUsage);
+	}
+	return 0;
+}
+
+/*
+ * Function: finishParallelJob
+ * ----------------------------
+ *   Records the completion of a parallel job, freeing its slot, and prints its status. Called by
+ *   reapChildren when the last stage of the job is reaped.
+ *
+ *   parallelJob: the number of the job
+ *   pid: the process id of the job's last stage
+ *   status: the wait status of the job's last stage
+ *
+ *   notes: chunks of a batch are not printed, only combined into parallelStatus
+ */
+void finishParallelJob(int parallelJob, pid_t pid, int status) {
+	parallelRunning--;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		parallelFailed++;
+	}
+	parallelStatus = combineStatus(parallelStatus, status);
+	// ^C kills the running jobs, stop starting new ones as well
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+		parallelInterrupted = true;
+	}
+	if (!parallelQuiet) {
+		printf("parallel job %d (pid %d) is done: ", parallelJob, pid);
+		printStatus(status);
+	}
+}
+
+/*
+ * Function: runParallel
+ * ----------------------------
+ *   Built in parallel [-j N] [file]: runs each line of a file (or of stdin) as a foreground
+ *   pipeline, keeping at most N of them running. N defaults to the number of online CPUs. A new
+ *   job is started as soon as the event loop reaps one, so slots never sit idle waiting on a
+ *   poll. The status of every job and a throughput summary are printed.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if every job exited with 0; 1 otherwise
+ *
+ *   notes: jobs read from stdin get /dev/null as stdin unless they redirect it. If the shell itself
+ *   reads stdin, the rest of it is read through the shell's reader so no buffered input is lost
+ */
+int runParallel(command_t* command) {
+	long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+	char* file = NULL;
+	for (int i = 0; i < command->numArgs; i++) {
+		char* arg = command->args[i];
+		char* end;
+		if (strncmp(arg, "-j", 2) == 0) {
+			char* value = arg[2] != '\0' ? arg + 2 : (i + 1 < command->numArgs ? command->args[++i] : "");
+			maxJobs = strtol(value, &end, 10);
+			if (*value == '\0' || *end != '\0' || maxJobs < 1 || maxJobs > MAX_JOBS) {
+				fprintf(stderr, "parallel: -j must be between 1 and %d\n", MAX_JOBS);
+				return 1;
+			}
+		}
+		else if (file == NULL) {
+			file = arg;
+		}
+		else {
+			fprintf(stderr, "usage: parallel [-j N] [file]\n");
+			return 1;
+		}
+	}
+	if (maxJobs < 1) {
+		maxJobs = 1;
+	}
+	// parallel < file reads the file just like parallel file
+	if (file == NULL) {
+		file = command->inputFile;
+	}
+
+	lineReader_t fileReader;
+	lineReader_t* reader = &fileReader;
+	// ... and so does parallel with a here-document
+	int docFd = -1;
+	if (file == NULL && command->hereDoc != NULL) {
+		if ((docFd = openHereDoc(command->hereDoc, command->hereDocLen)) == -1) {
+			return 1;
+		}
+		initReader(&fileReader, docFd);
+	}
+	else if (file != NULL) {
+		if (mapReader(&fileReader, file, NULL) == -1) {
+			return 1;
+		}
+	}
+	else if (shellReader->fd == STDIN_FILENO) {
+		reader = shellReader;
+	}
+	else {
+		initReader(&fileReader, STDIN_FILENO);
+	}
+	bool fromStdin = reader->fd == STDIN_FILENO;
+
+	// the usage of a parallel run is the sum over all of its jobs
+	startUsage(&foregroundUsage);
+	parallelRunning = 0;
+	parallelFailed = 0;
+	parallelInterrupted = false;
+	parallelQuiet = false;
+	int numStarted = 0;
+	bool more = true;
+
+	while (more || parallelRunning > 0) {
+		if (parallelInterrupted) {
+			more = false;
+		}
+		// every slot is busy (or there is nothing left to start), sleep until a job is reaped
+		if (!more || parallelRunning >= maxJobs) {
+			dispatchEvents(-1);
+			continue;
+		}
+		char* line = nextLine(reader);
+		if (line == NULL) {
+			if (reader->eof) {
+				more = false;
+			}
+			else {
+				waitForInput(reader->fd);
+				fillReader(reader);
+			}
+			continue;
+		}
+		if (strncmp(line, COMMENT_CHAR, 1) == 0 || isEmptyString(line)) {
+			continue;
+		}
+
+		// the job only lives until it is started, so it is parsed into the command arena and the
+		// arena is reset right after
+		command_t* pipeline = createCommand(line);
+		if (pipeline != NULL && pipeline->command != NULL) {
+			int numStages = countStages(pipeline);
+			// foreground children may use the job table's headroom, but not all of it
+			while (numJobs + numStages > MAX_JOBS && parallelRunning > 0) {
+				dispatchEvents(-1);
+			}
+			if (fromStdin && pipeline->inputFile == NULL && pipeline->hereDoc == NULL) {
+				pipeline->inputFile = "/dev/null";
+			}
+			pid_t* pids = arenaAlloc(&commandArena, sizeof(*pids) * numStages);
+			pid_t lastPid;
+			startPipeline(pipeline, false, ++numStarted, -1, pids, &lastPid);
+			if (lastPid == -1) {
+				printf("parallel job %d could not be started\n", numStarted);
+				fflush(stdout);
+				parallelFailed++;
+			}
+			else {
+				parallelRunning++;
+			}
+		}
+		arenaReset(&commandArena);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &foregroundUsage.end);
+	double elapsed = elapsedSeconds(&foregroundUsage.start, &foregroundUsage.end);
+	printf("parallel: %d jobs, %d failed, -j %ld, %.3f s, %.1f jobs/s\n", numStarted, parallelFailed,
+		maxJobs, elapsed, elapsed > 0 ? numStarted / elapsed : 0.0);
+	fflush(stdout);
+	if (reader == &fileReader) {
+		destroyReader(&fileReader);
+	}
+	if (docFd != -1) {
+		close(docFd);
+	}
+
+	foregroundStatus = W_EXITCODE(parallelFailed > 0 ? 1 : 0, 0);
+	statusInitialized = true;
+	return parallelFailed > 0 ? 1 : 0;
+}
+
+/*
+ * Function: combineStatus
+ * ----------------------------
+ *   Combines the wait statuses of the chunks of a batch: a chunk killed by a signal outranks one
+ *   that exited, and a higher exit code outranks a lower one.
+ *
+ *   combined: the status combined so far, 0 for none
+ *   status: the status to add
+ *
+ *   returns: the combined status
+ */
+int combineStatus(int combined, int status) {
+	if (WIFSIGNALED(combined)) {
+		return combined;
+	}
+	if (WIFSIGNALED(status) || exitCode(status) > exitCode(combined)) {
+		return status;
+	}
+	return combined;
+}
+
+/*
+ * Function: execSize
+ * ----------------------------
+ *   Measures what a string costs against ARG_MAX when passed to exec: its bytes, terminator and
+ *   pointer.
+ *
+ *   s: the argument or environment string
+ *
+ *   returns: the size in bytes
+ */
+size_t execSize(const char* s) {
+	return strlen(s) + 1 + sizeof(char*);
+}
+
+/*
+ * Function: runBatch
+ * ----------------------------
+ *   Built in batch [-j N] [-k N] command args...: runs a command whose arguments and environment
+ *   would exceed sysconf(_SC_ARG_MAX) as the fewest commands that fit, each given the leading
+ *   options (or the first N arguments with -k) followed by as many of the remaining arguments as
+ *   fit. Chunks run one at a time, or at most N at once with -j, on the event loop like parallel
+ *   jobs. A command that fits is run as it is.
+ *
+ *   command: a pointer to the command struct, whose command is batch
+ *
+ *	 returns: the exit code of the combined status: a chunk killed by a signal, or else the highest
+ *   exit code of any chunk
+ *
+ *   notes: the command's redirections are opened once by the shell and shared by every chunk, so
+ *   > collects the output of all of them. The rest of a pipeline runs once, reading the output of
+ *   every chunk, and its last stage decides the status. A batch always runs in the foreground
+ */
+int runBatch(command_t* command) {
+	long maxJobs = 1;
+	int numFixed = -1;
+	int first = 0;
+	while (first < command->numArgs && command->args[first][0] == '-'
+		&& (strncmp(command->args[first], "-j", 2) == 0 || strncmp(command->args[first], "-k", 2) == 0)) {
+		char* arg = command->args[first++];
+		char* value = arg[2] != '\0' ? arg + 2 : (first < command->numArgs ? command->args[first++] : "");
+		char* end;
+		long n = strtol(value, &end, 10);
+		if (arg[1] == 'j' && (*value == '\0' || *end != '\0' || n < 1 || n > MAX_JOBS)) {
+			fprintf(stderr, "batch: -j must be between 1 and %d\n", MAX_JOBS);
+			return 1;
+		}
+		if (arg[1] == 'k' && (*value == '\0' || *end != '\0' || n < 0)) {
+			fprintf(stderr, "batch: -k must be a count of arguments\n");
+			return 1;
+		}
+		if (arg[1] == 'j') {
+			maxJobs = n;
+		}
+		else {
+			numFixed = n < command->numArgs ? n : command->numArgs;
+		}
+	}
+	if (first == command->numArgs) {
+		fprintf(stderr, "usage: batch [-j N] [-k N] command args...\n");
+		return 1;
+	}
+	// drop the batch prefix and its options, the remaining words are the command
+	command->argv += first + 1;
+	command->argvCap -= first + 1;
+	command->args += first + 1;
+	command->numArgs -= first + 1;
+	command->command = command->argv[0];
+	command->isBackground = false;
+
+	// by default the options before the first operand (and a --) go to every chunk
+	if (numFixed == -1) {
+		numFixed = 0;
+		while (numFixed < command->numArgs && command->args[numFixed][0] == '-') {
+			if (strcmp(command->args[numFixed++], "--") == 0) {
+				break;
+			}
+		}
+	}
+	if (numFixed > command->numArgs) {
+		numFixed = command->numArgs;
+	}
+
+	long limit = sysconf(_SC_ARG_MAX) - BATCH_HEADROOM;
+	size_t fixedSize = execSize(command->command) + sizeof(char*);
+	for (char** env = environ; *env != NULL; env++) {
+		fixedSize += execSize(*env);
+	}
+	for (int i = 0; i < numFixed; i++) {
+		fixedSize += execSize(command->args[i]);
+	}
+	size_t totalSize = fixedSize;
+	for (int i = numFixed; i < command->numArgs; i++) {
+		totalSize += execSize(command->args[i]);
+	}
+	if ((long)totalSize <= limit) {
+		runPipeline(command);
+		return exitCode(foregroundStatus);
+	}
+	if ((long)fixedSize >= limit) {
+		fprintf(stderr, "batch: the environment and fixed arguments alone exceed ARG_MAX\n");
+		return 1;
+	}
+
+	startUsage(&foregroundUsage);
+	// the rest of the pipeline is started once, reading one pipe that every chunk writes to
+	command_t* tail = command->next;
+	pid_t* tailPids = NULL;
+	int numTailPids = 0;
+	pid_t tailLastPid = -1;
+	int pipeOut = -1;
+	if (tail != NULL) {
+		int pipeFds[2];
+		if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+			perror("pipe");
+			foregroundStatus = W_EXITCODE(1, 0);
+			statusInitialized = true;
+			return 1;
+		}
+		int savedPipeIn = swapFd(pipeFds[0], STDIN_FILENO);
+		tailPids = arenaAlloc(&commandArena, sizeof(*tailPids) * countStages(tail));
+		if (savedPipeIn != -1) {
+			numTailPids = startPipeline(tail, false, 0, -1, tailPids, &tailLastPid);
+			dup2(savedPipeIn, STDIN_FILENO);
+			close(savedPipeIn);
+		}
+		pipeOut = pipeFds[1];
+	}
+
+	// every chunk shares the redirections, > is truncated once and not by every chunk
+	int inFd, outFd;
+	int savedIn = -1, savedOut = -1;
+	if (openRedirections(command, false, false, &inFd, &outFd) == -1) {
+		if (pipeOut != -1) {
+			close(pipeOut);
+		}
+		waitForeground(tailPids, numTailPids);
+		foregroundStatus = W_EXITCODE(1, 0);
+		statusInitialized = true;
+		return 1;
+	}
+	if (outFd == -1) {
+		outFd = pipeOut;
+	}
+	else if (pipeOut != -1) {
+		close(pipeOut);
+	}
+	fflush(stdout);
+	if (inFd != -1) {
+		savedIn = swapFd(inFd, STDIN_FILENO);
+	}
+	if (outFd != -1) {
+		savedOut = swapFd(outFd, STDOUT_FILENO);
+	}
+
+	parallelRunning = 0;
+	parallelFailed = 0;
+	parallelInterrupted = false;
+	parallelStatus = 0;
+	parallelQuiet = true;
+	int numChunks = 0;
+	// filling each chunk as far as it goes gives the fewest chunks
+	for (int next = numFixed; next < command->numArgs && !parallelInterrupted; ) {
+		if (parallelRunning >= maxJobs) {
+			dispatchEvents(-1);
+			continue;
+		}
+		int end = next;
+		size_t size = fixedSize;
+		while (end < command->numArgs && (end == next || (long)(size + execSize(command->args[end])) <= limit)) {
+			size += execSize(command->args[end++]);
+		}
+		command_t* chunk = arenaAlloc(&commandArena, sizeof(*chunk));
+		initCommand(chunk);
+		chunk->command = command->command;
+		chunk->numArgs = numFixed + end - next;
+		chunk->argvCap = chunk->numArgs + 2;
+		chunk->argv = arenaAlloc(&commandArena, sizeof(*chunk->argv) * chunk->argvCap);
+		chunk->argv[0] = command->command;
+		memcpy(chunk->argv + 1, command->args, sizeof(*chunk->argv) * numFixed);
+		memcpy(chunk->argv + 1 + numFixed, command->args + next, sizeof(*chunk->argv) * (end - next));
+		chunk->argv[chunk->numArgs + 1] = NULL;
+		chunk->args = chunk->argv + 1;
+		next = end;
+
+		while (numJobs + 1 > MAX_JOBS && parallelRunning > 0) {
+			dispatchEvents(-1);
+		}
+		pid_t pid, lastPid;
+		startPipeline(chunk, false, ++numChunks, -1, &pid, &lastPid);
+		if (lastPid == -1) {
+			parallelStatus = combineStatus(parallelStatus, W_EXITCODE(1, 0));
+		}
+		else {
+			parallelRunning++;
+		}
+	}
+	while (parallelRunning > 0) {
+		dispatchEvents(-1);
+	}
+	parallelQuiet = false;
+
+	fflush(stdout);
+	if (savedIn != -1) {
+		dup2(savedIn, STDIN_FILENO);
+		close(savedIn);
+	}
+	// restoring stdout closes the shell's copy of the pipe, so the rest of the pipeline sees EOF
+	if (savedOut != -1) {
+		dup2(savedOut, STDOUT_FILENO);
+		close(savedOut);
+	}
+	if (tail != NULL) {
+		waitForeground(tailPids, numTailPids);
+		if (tailLastPid == -1) {
+			foregroundStatus = W_EXITCODE(1, 0);
+		}
+	}
+	else {
+		foregroundStatus = parallelStatus;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &foregroundUsage.end);
+	statusInitialized = true;
+	if (WIFSIGNALED(foregroundStatus)) {
+		printf("terminated by signal %d\n", WTERMSIG(foregroundStatus));
+		fflush(stdout);
+	}
+	return exitCode(foregroundStatus);
+}
+
+/*
+ * Function: runServer
+ * ----------------------------
+ *   Server mode: listens on a Unix domain socket and runs the command lines clients send, many
+ *   clients at once on the shell's event loop. Every request is a serverRequest_t followed by a
+ *   command line, and is answered with a serverReply_t followed by any captured output once every
+ *   stage of the command has been reaped. A client can pass its own stdin, stdout and stderr along
+ *   with the request (SCM_RIGHTS); otherwise they are /dev/null, or capture pipes for stdout and
+ *   stderr if SERVER_CAPTURE is set. Each connection runs one command at a time.
+ *
+ *   path: the path of the socket, an existing socket there is replaced
+ *
+ *   returns: 0 once SIGTERM or SIGINT stops the server; 1 if it could not be started
+ *
+ *   notes: commands run as pipelines of processes; built ins that change the shell's own state
+ *   (cd, exit, ...) are not available to clients. On SIGTERM or SIGINT the server stops accepting
+ *   requests, writes the trace (if tracing) and removes the socket; commands still running are
+ *   left running, like background children when the shell exits
+ */
+int runServer(const char* path) {
+	// keep the socket and the saved stdio out of 0-2 if the server was started with them closed
+	int fd;
+	while ((fd = open("/dev/null", O_RDWR)) != -1 && fd <= STDERR_FILENO);
+	if (fd != -1) {
+		close(fd);
+	}
+	if (initShell() == -1) {
+		return 1;
+	}
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	serverFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (serverFd == -1 || bind(serverFd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+		|| listen(serverFd, SERVER_BACKLOG) == -1) {
+		perror(path);
+		return 1;
+	}
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = serverFd;
+	if (epoll_ctl(eventFd, EPOLL_CTL_ADD, serverFd, &event) == -1) {
+		perror("epoll_ctl");
+		return 1;
+	}
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+	// a client that goes away must not take the server down with SIGPIPE; it is blocked rather than
+	// ignored, children start with childSignalMask and keep the default disposition
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	// SIGTERM and SIGINT are read from the epoll set, so the loop ends and the server cleans up
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	stopFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	event.data.fd = stopFd;
+	if (stopFd == -1 || epoll_ctl(eventFd, EPOLL_CTL_ADD, stopFd, &event) == -1) {
+		perror("signalfd");
+		close(serverFd);
+		unlink(path);
+		return 1;
+	}
+
+	while (!exitRequested) {
+		dispatchEvents(-1);
+	}
+	close(serverFd);
+	unlink(path);
+	if (numTraceEvents > 0) {
+		writeTrace(traceFile);
+	}
+	return 0;
+}
+
+/*
+ * Function: acceptClients
+ * ----------------------------
+ *   Accepts every pending connection on the server socket. Connections beyond MAX_CLIENTS are
+ *   closed right away.
+ */
+void acceptClients(void) {
+	int fd;
+	while ((fd = accept4(serverFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		client_t* client = NULL;
+		for (int i = 0; i < MAX_CLIENTS && client == NULL; i++) {
+			if (clients[i].fd == -1) {
+				client = &clients[i];
+			}
+		}
+		struct epoll_event event = { 0 };
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (client == NULL || epoll_ctl(eventFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			close(fd);
+			continue;
+		}
+		memset(client, 0, sizeof(*client));
+		client->fd = fd;
+		client->captureFds[0] = -1;
+		client->captureFds[1] = -1;
+	}
+}
+
+/*
+ * Function: clientEvent
+ * ----------------------------
+ *   Handles an event on a client connection or capture pipe.
+ *
+ *   fd: the file descriptor the event is for
+ *   events: the epoll events
+ */
+void clientEvent(int fd, uint32_t events) {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		client_t* client = &clients[i];
+		if (client->fd == -1) {
+			continue;
+		}
+		if (fd == client->captureFds[0] || fd == client->captureFds[1]) {
+			readCapture(client, fd == client->captureFds[1]);
+			return;
+		}
+		if (fd != client->fd) {
+			continue;
+		}
+		if (client->busy) {
+			// only a hang up gets here, requests wait until the reply is sent
+			epoll_ctl(eventFd, EPOLL_CTL_DEL, fd, NULL);
+			client->hungUp = true;
+		}
+		else if (events & EPOLLIN) {
+			readRequest(client);
+		}
+		else {
+			closeClient(client);
+		}
+		return;
+	}
+}
+
+/*
+ * Function: readRequest
+ * ----------------------------
+ *   Reads a request from a client and starts its command. The client's stdio (or capture pipes)
+ *   are swapped in for the shell's own while the pipeline is started, so every launch backend
+ *   hands them to the children unchanged.
+ *
+ *   client: a pointer to the client
+ */
+void readRequest(client_t* client) {
+	static char buf[SERVER_REQUEST_SIZE + 1];
+	int fds[3];
+	int numFds;
+	ssize_t n = recvFds(client->fd, buf, SERVER_REQUEST_SIZE, fds, 3, &numFds, MSG_DONTWAIT);
+	if (n == -1 && errno == EAGAIN) {
+		return;
+	}
+	serverRequest_t request;
+	if (n < (ssize_t)sizeof(request)) {
+		// EOF or garbage
+		for (int i = 0; i < numFds; i++) {
+			close(fds[i]);
+		}
+		closeClient(client);
+		return;
+	}
+	memcpy(&request, buf, sizeof(request));
+	buf[n] = '\0';
+	char* line = buf + sizeof(request);
+
+	// stdin, stdout and stderr: passed by the client, captured, or /dev/null
+	int stdio[3];
+	int used = 0;
+	for (int i = 0; i < 3; i++) {
+		stdio[i] = -1;
+		if ((request.flags & (SERVER_STDIN << i)) && used < numFds) {
+			stdio[i] = fds[used++];
+		}
+		else if (i > 0 && (request.flags & SERVER_CAPTURE)) {
+			int pipeFds[2];
+			if (pipe2(pipeFds, O_CLOEXEC) == 0) {
+				// only the shell's end is non-blocking
+				fcntl(pipeFds[0], F_SETFL, O_NONBLOCK);
+				struct epoll_event event = { 0 };
+				event.events = EPOLLIN;
+				event.data.fd = pipeFds[0];
+				epoll_ctl(eventFd, EPOLL_CTL_ADD, pipeFds[0], &event);
+				client->captureFds[i - 1] = pipeFds[0];
+				stdio[i] = pipeFds[1];
+			}
+		}
+		if (stdio[i] == -1) {
+			stdio[i] = open("/dev/null", i == 0 ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CLOEXEC);
+		}
+	}
+	while (used < numFds) {
+		close(fds[used++]);
+	}
+	if (client->captureFds[0] != -1 || client->captureFds[1] != -1) {
+		if (client->capture == NULL) {
+			client->capture = malloc(SERVER_CAPTURE_SIZE * 2);
+		}
+		client->captureLength[0] = 0;
+		client->captureLength[1] = 0;
+		client->truncated = false;
+	}
+
+	client->busy = true;
+	client->started = false;
+	client->running = 0;
+	client->status = W_EXITCODE(1, 0);
+	startUsage(&client->usage);
+	fflush(stdout);
+	fflush(stderr);
+	int saved[3];
+	for (int i = 0; i < 3; i++) {
+		saved[i] = swapFd(stdio[i], i);
+	}
+
+	// the command only lives until it is started, like a parallel job
+	command_t* pipeline = createCommand(line);
+	if (pipeline != NULL && pipeline->command != NULL) {
+		int numStages = countStages(pipeline);
+		if (numJobs + numStages > MAX_JOBS) {
+			fprintf(stderr, "Error: too many jobs (limit %d)\n", MAX_JOBS);
+		}
+		else {
+			pid_t* pids = arenaAlloc(&commandArena, sizeof(*pids) * numStages);
+			pid_t lastPid;
+			client->running = startPipeline(pipeline, false, 0, -1, pids, &lastPid);
+			client->started = lastPid != -1;
+			for (int i = 0; i < client->running; i++) {
+				findJob(pids[i])->client = client - clients + 1;
+			}
+		}
+	}
+	arenaReset(&commandArena);
+
+	fflush(stderr);
+	for (int i = 0; i < 3; i++) {
+		if (saved[i] != -1) {
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	}
+	// the children hold the write ends of the capture pipes now
+	struct epoll_event event = { 0 };
+	epoll_ctl(eventFd, EPOLL_CTL_MOD, client->fd, &event);
+	finishClientStage(client, false, 0, NULL);
+}
+
+/*
+ * Function: readCapture
+ * ----------------------------
+ *   Reads a command's output from a capture pipe. Output beyond SERVER_CAPTURE_SIZE is read and
+ *   dropped so the command does not block; the reply says it was truncated.
+ *
+ *   client: a pointer to the client
+ *   stream: 0 for stdout, 1 for stderr
+ */
+void readCapture(client_t* client, int stream) {
+	char discard[COPY_BUF_SIZE];
+	int fd = client->captureFds[stream];
+	while (true) {
+		uint32_t length = client->captureLength[stream];
+		char* buf = length < SERVER_CAPTURE_SIZE ? client->capture + stream * SERVER_CAPTURE_SIZE + length : discard;
+		size_t room = length < SERVER_CAPTURE_SIZE ? SERVER_CAPTURE_SIZE - length : sizeof(discard);
+		ssize_t n = read(fd, buf, room);
+		if (n == -1 && errno == EAGAIN) {
+			// drained for now, only EOF or an error closes the pipe
+			return;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		if (buf == discard) {
+			client->truncated = true;
+		}
+		else {
+			client->captureLength[stream] += n;
+		}
+	}
+	epoll_ctl(eventFd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	client->captureFds[stream] = -1;
+	finishClientStage(client, false, 0, NULL);
+}
+
+/*
+ * Function: finishClientStage
+ * ----------------------------
+ *   Records a reaped stage of a client's command, and sends the reply once every stage has been
+ *   reaped and the capture pipes are at EOF. Called by reapChildren, and with a NULL rusage to
+ *   check for completion after anything else the reply waits for.
+ *
+ *   client: a pointer to the client
+ *   lastStage: whether the stage is the last of the pipeline
+ *   status: the wait status of the stage
+ *   ru: the resource usage of the stage, or NULL if no stage was reaped
+ */
+void finishClientStage(client_t* client, bool lastStage, int status, const struct rusage* ru) {
+	if (ru != NULL) {
+		addUsage(&client->usage, ru);
+		client->running--;
+		if (lastStage) {
+			client->status = status;
+		}
+	}
+	if (!client->busy || client->running > 0 || client->captureFds[0] != -1 || client->captureFds[1] != -1) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &client->usage.end);
+	client->busy = false;
+	if (client->hungUp) {
+		closeClient(client);
+		return;
+	}
+
+	serverReply_t reply = { 0 };
+	reply.status = client->status;
+	reply.started = client->started;
+	reply.truncated = client->truncated;
+	reply.seconds = elapsedSeconds(&client->usage.start, &client->usage.end);
+	reply.ru = client->usage.ru;
+	reply.outLength = client->capture != NULL ? client->captureLength[0] : 0;
+	reply.errLength = client->capture != NULL ? client->captureLength[1] : 0;
+	struct iovec iov[3] = {
+		{ &reply, sizeof(reply) },
+		{ client->capture, reply.outLength },
+		{ client->capture != NULL ? client->capture + SERVER_CAPTURE_SIZE : NULL, reply.errLength },
+	};
+	struct msghdr msg = { 0 };
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	// the socket buffer holds a whole reply, one is sent per request
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+		closeClient(client);
+		return;
+	}
+	// take the next request
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = client->fd;
+	epoll_ctl(eventFd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/*
+ * Function: closeClient
+ * ----------------------------
+ *   Closes a client connection, freeing its slot. A command still running is left to finish, its
+ *   reply is dropped.
+ *
+ *   client: a pointer to the client
+ */
+void closeClient(client_t* client) {
+	if (client->busy) {
+		epoll_ctl(eventFd, EPOLL_CTL_DEL, client->fd, NULL);
+		client->hungUp = true;
+		return;
+	}
+	close(client->fd);
+	free(client->capture);
+	client->capture = NULL;
+	client->fd = -1;
+}
+
+/*
+ * Function: exitShell
+ * ----------------------------
+ *   Built in exit: kills the background children and makes the shell exit after this command.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0
+ */
+int exitShell(command_t* command) {
+	exitRequested = true;
+	// kill any remaining child processes
+	killJobs(SIGKILL);
+	return 0;
+}
+
+/*
+ * Function: echoBuiltin
+ * ----------------------------
+ *   Built in echo [-neE] args...: prints the args separated by spaces, followed by a new line
+ *   unless -n is given. With -e backslash escapes are expanded like in a printf %b argument, and
+ *   \c stops the output; -E turns that off again. Like /bin/echo, only leading args made of
+ *   nothing but these letters are options.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if the output could not be written
+ */
+int echoBuiltin(command_t* command) {
+	int first = 0;
+	bool newLine = true;
+	bool escapes = false;
+	for (; first < command->numArgs; first++) {
+		const char* arg = command->args[first];
+		if (arg[0] != '-' || arg[1] == '\0' || arg[strspn(arg + 1, "neE") + 1] != '\0') {
+			break;
+		}
+		for (arg++; *arg != '\0'; arg++) {
+			newLine = newLine && *arg != 'n';
+			escapes = *arg == 'e' ? true : (*arg == 'E' ? false : escapes);
+		}
+	}
+	bool stop = false;
+	for (int i = first; i < command->numArgs && !stop; i++) {
+		if (!escapes) {
+			fputs(command->args[i], stdout);
+		}
+		for (const char* s = command->args[i]; escapes && *s != '\0' && !stop; s++) {
+			if (*s == '\\') {
+				s += printEscape(s + 1, true, &stop);
+			}
+			else {
+				putchar(*s);
+			}
+		}
+		if (i + 1 < command->numArgs && !stop) {
+			putchar(' ');
+		}
+	}
+	if (newLine && !stop) {
+		putchar('\n');
+	}
+	return fflush(stdout) == EOF ? 1 : 0;
+}
+
+/*
+ * Function: printEscape
+ * ----------------------------
+ *   Prints the character of a backslash escape as printf understands it: \a \b \f \n \r \t \v
+ *   \\ and octal \NNN (\0NNN for %b).
+ *
+ *   s: the characters after the backslash
+ *   inArg: whether the escape is in a %b argument, where \c stops all output
+ *   stop: set to true by \c in a %b argument
+ *
+ *   returns: the number of characters of s the escape used
+ */
+size_t printEscape(const char* s, bool inArg, bool* stop) {
+	static const char escapes[] = "a\ab\bf\fn\nr\rt\tv\v\\\\";
+	if (*s == '\0') {
+		putchar('\\');
+		return 0;
+	}
+	if (inArg && *s == 'c') {
+		*stop = true;
+		return 1;
+	}
+	if (*s >= '0' && *s <= '7') {
+		// %b arguments write octal escapes as \0NNN
+		size_t len = inArg && *s == '0' ? 1 : 0;
+		size_t maxLen = len + 3;
+		int value = 0;
+		while (len < maxLen && s[len] >= '0' && s[len] <= '7') {
+			value = value * 8 + s[len++] - '0';
+		}
+		putchar(value);
+		return len;
+	}
+	for (size_t i = 0; escapes[i] != '\0'; i += 2) {
+		if (escapes[i] == *s) {
+			putchar(escapes[i + 1]);
+			return 1;
+		}
+	}
+	putchar('\\');
+	putchar(*s);
+	return 1;
+}
+
+/*
+ * Function: printfNumber
+ * ----------------------------
+ *   Converts a printf argument to a number. Arguments starting with a quote stand for the code of
+ *   the next character.
+ *
+ *   arg: the argument, or NULL if the arguments ran out
+ *   value: set to the number
+ *
+ *   returns: true if the whole argument was a number; false otherwise (the error is printed)
+ */
+bool printfNumber(const char* arg, long double* value) {
+	if (arg == NULL || *arg == '\0') {
+		*value = 0;
+		return true;
+	}
+	if (*arg == '\'' || *arg == '"') {
+		*value = (unsigned char)arg[1];
+		return true;
+	}
+	char* end;
+	errno = 0;
+	// integers keep all of their precision
+	if (strpbrk(arg, ".eEpP") == NULL || strncmp(arg, "0x", 2) == 0) {
+		*value = strtoll(arg, &end, 0);
+	}
+	else {
+		*value = strtold(arg, &end);
+	}
+	if (*end != '\0' || errno != 0) {
+		fprintf(stderr, "printf: %s: invalid number\n", arg);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Function: printfBuiltin
+ * ----------------------------
+ *   Built in printf format args...: prints the args as described by the format, with the
+ *   conversions %s %b %c %d %i %u %o %x %X %e %f %g (and their flags, width and precision) and
+ *   backslash escapes. The format is reused while args remain.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if an arg or conversion was invalid; 2 without a format
+ */
+int printfBuiltin(command_t* command) {
+	if (command->numArgs == 0) {
+		fprintf(stderr, "usage: printf format [arguments]\n");
+		return 2;
+	}
+	const char* format = command->args[0];
+	char** args = command->args + 1;
+	int numArgs = command->numArgs - 1;
+	int next = 0;
+	int retVal = 0;
+	bool stop = false;
+	do {
+		int used = next;
+		for (const char* p = format; *p != '\0' && !stop; p++) {
+			if (*p == '\\') {
+				p += printEscape(p + 1, false, &stop);
+				continue;
+			}
+			if (*p != '%') {
+				putchar(*p);
+				continue;
+			}
+			if (p[1] == '%') {
+				putchar('%');
+				p++;
+				continue;
+			}
+
+			// copy the flags, width and precision into a format for one value
+			char spec[32] = "%";
+			size_t len = 1;
+			p++;
+			while (*p != '\0' && strchr("-+ #0", *p) != NULL && len < 8) {
+				spec[len++] = *p++;
+			}
+			while (isdigit((unsigned char)*p) && len < 16) {
+				spec[len++] = *p++;
+			}
+			if (*p == '.') {
+				spec[len++] = *p++;
+				while (isdigit((unsigned char)*p) && len < 24) {
+					spec[len++] = *p++;
+				}
+			}
+			const char* arg = next < numArgs ? args[next++] : NULL;
+			long double value;
+			switch (*p) {
+			case 's':
+			case 'c':
+				spec[len++] = 's';
+				// %c prints the first character of its arg
+				printf(spec, arg == NULL ? "" : *p == 's' ? arg : (char[]){ arg[0], '\0' });
+				break;
+			case 'b':
+				for (const char* b = arg ? arg : ""; *b != '\0' && !stop; b++) {
+					if (*b == '\\') {
+						b += printEscape(b + 1, true, &stop);
+					}
+					else {
+						putchar(*b);
+					}
+				}
+				break;
+			case 'd':
+			case 'i':
+				if (!printfNumber(arg, &value)) {
+					retVal = 1;
+				}
+				strcpy(spec + len, "lld");
+				printf(spec, (long long)value);
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				if (!printfNumber(arg, &value)) {
+					retVal = 1;
+				}
+				spec[len++] = 'l';
+				spec[len++] = 'l';
+				spec[len++] = *p;
+				printf(spec, (unsigned long long)(long long)value);
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+				if (!printfNumber(arg, &value)) {
+					retVal = 1;
+				}
+				spec[len++] = 'L';
+				spec[len++] = *p;
+				printf(spec, value);
+				break;
+			default:
+				fprintf(stderr, "printf: %%%c: invalid conversion\n", *p);
+				fflush(stdout);
+				return 1;
+			}
+		}
+		// a format that takes no args is printed once
+		if (next == used) {
+			break;
+		}
+	} while (next < numArgs && !stop);
+	if (fflush(stdout) == EOF) {
+		retVal = 1;
+	}
+	return retVal;
+}
+
+/*
+ * Function: trueBuiltin
+ * ----------------------------
+ *   Built in true.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0
+ */
+int trueBuiltin(command_t* command) {
+	return 0;
+}
+
+/*
+ * Function: falseBuiltin
+ * ----------------------------
+ *   Built in false.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 1
+ */
+int falseBuiltin(command_t* command) {
+	return 1;
+}
+
+/*
+ * Function: testInteger
+ * ----------------------------
+ *   Converts an operand of an integer comparison.
+ *
+ *   arg: the operand
+ *   value: set to its value
+ *
+ *   returns: true if the operand is an integer; false otherwise (the error is printed)
+ */
+bool testInteger(const char* arg, long long* value) {
+	char* end;
+	errno = 0;
+	*value = strtoll(arg, &end, 10);
+	if (end == arg || errno != 0) {
+		fprintf(stderr, "test: %s: integer expression expected\n", arg);
+		return false;
+	}
+	// trailing blanks are allowed
+	while (isspace((unsigned char)*end)) {
+		end++;
+	}
+	if (*end != '\0') {
+		fprintf(stderr, "test: %s: integer expression expected\n", arg);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Function: testUnary
+ * ----------------------------
+ *   Evaluates a unary test: -b -c -d -e -f -h -L -n -p -r -s -S -t -w -x -z.
+ *
+ *   op: the operator
+ *   arg: the operand
+ *
+ *   returns: 0 if true; 1 if false; 2 if the operator is unknown (the error is printed)
+ */
+int testUnary(const char* op, const char* arg) {
+	struct stat st;
+	if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+		fprintf(stderr, "test: %s: unary operator expected\n", op);
+		return 2;
+	}
+	switch (op[1]) {
+	case 'z':
+		return arg[0] == '\0' ? 0 : 1;
+	case 'n':
+		return arg[0] != '\0' ? 0 : 1;
+	case 'r':
+		return access(arg, R_OK) == 0 ? 0 : 1;
+	case 'w':
+		return access(arg, W_OK) == 0 ? 0 : 1;
+	case 'x':
+		return access(arg, X_OK) == 0 ? 0 : 1;
+	case 't':
+		return isatty(atoi(arg)) ? 0 : 1;
+	case 'h':
+	case 'L':
+		return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+	case 'b':
+	case 'c':
+	case 'd':
+	case 'e':
+	case 'f':
+	case 'p':
+	case 's':
+	case 'S':
+		break;
+	default:
+		fprintf(stderr, "test: %s: unary operator expected\n", op);
+		return 2;
+	}
+	if (stat(arg, &st) == -1) {
+		return 1;
+	}
+	switch (op[1]) {
+	case 'b':
+		return S_ISBLK(st.st_mode) ? 0 : 1;
+	case 'c':
+		return S_ISCHR(st.st_mode) ? 0 : 1;
+	case 'd':
+		return S_ISDIR(st.st_mode) ? 0 : 1;
+	case 'f':
+		return S_ISREG(st.st_mode) ? 0 : 1;
+	case 'p':
+		return S_ISFIFO(st.st_mode) ? 0 : 1;
+	case 's':
+		return st.st_size > 0 ? 0 : 1;
+	case 'S':
+		return S_ISSOCK(st.st_mode) ? 0 : 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Function: testBinary
+ * ----------------------------
+ *   Evaluates a binary test: = == != -eq -ne -lt -le -gt -ge -nt -ot.
+ *
+ *   left: the left operand
+ *   op: the operator
+ *   right: the right operand
+ *
+ *   returns: 0 if true; 1 if false; 2 if the operator or an operand is invalid (the error is
+ *   printed); -1 if op is not a binary operator
+ */
+int testBinary(const char* left, const char* op, const char* right) {
+	static const char* intOps[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+		return strcmp(left, right) == 0 ? 0 : 1;
+	}
+	if (strcmp(op, "!=") == 0) {
+		return strcmp(left, right) != 0 ? 0 : 1;
+	}
+	if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+		struct stat leftSt, rightSt;
+		bool leftOk = stat(left, &leftSt) == 0;
+		bool rightOk = stat(right, &rightSt) == 0;
+		if (op[1] == 'o') {
+			// -ot is -nt with the operands swapped
+			bool tmpOk = leftOk;
+			leftOk = rightOk;
+			rightOk = tmpOk;
+			struct stat tmpSt = leftSt;
+			leftSt = rightSt;
+			rightSt = tmpSt;
+		}
+		if (!leftOk) {
+			return 1;
+		}
+		if (!rightOk) {
+			return 0;
+		}
+		return leftSt.st_mtim.tv_sec > rightSt.st_mtim.tv_sec || (leftSt.st_mtim.tv_sec == rightSt.st_mtim.tv_sec
+			&& leftSt.st_mtim.tv_nsec > rightSt.st_mtim.tv_nsec) ? 0 : 1;
+	}
+	for (size_t i = 0; i < sizeof(intOps) / sizeof(intOps[0]); i++) {
+		if (strcmp(op, intOps[i]) != 0) {
+			continue;
+		}
+		long long a, b;
+		if (!testInteger(left, &a) || !testInteger(right, &b)) {
+			return 2;
+		}
+		bool results[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+		return results[i] ? 0 : 1;
+	}
+	return -1;
+}
+
+/*
+ * Function: evalTest
+ * ----------------------------
+ *   Evaluates test operands by their number, as POSIX specifies: none is false, one is true if it
+ *   is not empty, two are a unary test and three are a binary test; a leading ! negates.
+ *
+ *   args: the operands
+ *   numArgs: the number of operands
+ *
+ *   returns: 0 if true; 1 if false; 2 on a syntax error (the error is printed)
+ */
+int evalTest(char** args, int numArgs) {
+	int retVal;
+	switch (numArgs) {
+	case 0:
+		return 1;
+	case 1:
+		return args[0][0] != '\0' ? 0 : 1;
+	case 2:
+		if (strcmp(args[0], "!") == 0) {
+			return evalTest(args + 1, 1) == 0 ? 1 : 0;
+		}
+		return testUnary(args[0], args[1]);
+	case 3:
+		retVal = testBinary(args[0], args[1], args[2]);
+		if (retVal != -1) {
+			return retVal;
+		}
+		break;
+	default:
+		break;
+	}
+	if (strcmp(args[0], "!") == 0) {
+		retVal = evalTest(args + 1, numArgs - 1);
+		return retVal == 2 ? 2 : !retVal;
+	}
+	if (numArgs == 3 && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+		return evalTest(args + 1, 1);
+	}
+	fprintf(stderr, "test: too many arguments\n");
+	return 2;
+}
+
+/*
+ * Function: testBuiltin
+ * ----------------------------
+ *   Built in test expression and [ expression ].
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if the expression is true; 1 if it is false; 2 on a syntax error
+ */
+int testBuiltin(command_t* command) {
+	int numArgs = command->numArgs;
+	if (strcmp(command->command, TEST_BRACKET_CMD) == 0) {
+		if (numArgs == 0 || strcmp(command->args[numArgs - 1], "]") != 0) {
+			fprintf(stderr, "[: missing ]\n");
+			return 2;
+		}
+		numArgs--;
 	}
+	return evalTest(command->args, numArgs);
 }
 
 /*
- * Function: printCommand
+ * Function: pwdBuiltin
  * ----------------------------
- *   Prints out a given command struct for testing purposes.
+ *   Built in pwd: prints the current directory.
  *
- *   command: a pointer to the command struct to print out
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 otherwise
  */
-void printCommand(command_t* command) {
+int pwdBuiltin(command_t* command) {
+	char* cwd = getcwd(NULL, 0);
+	if (cwd == NULL) {
+		perror("pwd");
+		return 1;
+	}
+	puts(cwd);
+	free(cwd);
+	return fflush(stdout) == EOF ? 1 : 0;
+}
 
-	if (command->isBackground) {
-		printf("Background: True\n");
-		fflush(stdout);
+/*
+ * Function: parseSignal
+ * ----------------------------
+ *   Converts a signal number or name (with or without SIG) to a signal number.
+ *
+ *   name: the number or name
+ *
+ *   returns: the signal number, or -1 if it is not a signal
+ */
+int parseSignal(const char* name) {
+	static const struct { const char* name; int signo; } signals[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL }, { "TRAP", SIGTRAP },
+		{ "ABRT", SIGABRT }, { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+		{ "SEGV", SIGSEGV }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+		{ "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN },
+		{ "TTOU", SIGTTOU }, { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "WINCH", SIGWINCH },
+	};
+	if (isdigit((unsigned char)name[0])) {
+		char* end;
+		long signo = strtol(name, &end, 10);
+		return *end == '\0' && signo < NSIG ? (int)signo : -1;
 	}
-	else {
-		printf("Background: False\n");
-		fflush(stdout);
+	if (strncmp(name, "SIG", 3) == 0) {
+		name += 3;
 	}
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		if (strcmp(name, signals[i].name) == 0) {
+			return signals[i].signo;
+		}
+	}
+	return -1;
+}
 
-	if (command->command) {
-		printf("Command Name: %s\n", command->command);
-		fflush(stdout);
+/*
+ * Function: killBuiltin
+ * ----------------------------
+ *   Built in kill [-s signal | -signal] pid...: sends a signal (SIGTERM by default) to processes.
+ *   A negative pid names a process group.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if every signal was sent; 1 otherwise
+ */
+int killBuiltin(command_t* command) {
+	int signo = SIGTERM;
+	int first = 0;
+	if (command->numArgs > 1 && strcmp(command->args[0], "-s") == 0) {
+		signo = parseSignal(command->args[1]);
+		first = 2;
 	}
-	else {
-		printf("Not a command.\n");
-		fflush(stdout);
+	else if (command->numArgs > 0 && command->args[0][0] == '-' && !isdigit((unsigned char)command->args[0][1])) {
+		signo = parseSignal(command->args[0] + 1);
+		first = 1;
+	}
+	else if (command->numArgs > 1 && command->args[0][0] == '-' && strcmp(command->args[0], "--") != 0) {
+		// -9 is a signal number only when a pid follows it
+		signo = parseSignal(command->args[0] + 1);
+		first = 1;
+	}
+	else if (command->numArgs == 1 && command->args[0][0] == '-' && isdigit((unsigned char)command->args[0][1])) {
+		// a lone -9 is a signal without a pid, not process group 9 (-- -9 names the group)
+		fprintf(stderr, "usage: kill [-s signal | -signal] pid...\n");
+		return 1;
+	}
+	if (signo == -1) {
+		fprintf(stderr, "kill: %s: invalid signal specification\n", command->args[first - 1]);
+		return 1;
+	}
+	if (first < command->numArgs && strcmp(command->args[first], "--") == 0) {
+		first++;
+	}
+	if (first == command->numArgs) {
+		fprintf(stderr, "usage: kill [-s signal | -signal] pid...\n");
+		return 1;
 	}
 
-	printf("numArgs: %d\n", command->numArgs);
-	fflush(stdout);
+	int retVal = 0;
+	for (int i = first; i < command->numArgs; i++) {
+		char* end;
+		long pid = strtol(command->args[i], &end, 10);
+		if (*end != '\0' || end == command->args[i]) {
+			fprintf(stderr, "kill: %s: arguments must be process ids\n", command->args[i]);
+			retVal = 1;
+		}
+		else if (kill((pid_t)pid, signo) == -1) {
+			fprintf(stderr, "kill: (%ld): %s\n", pid, strerror(errno));
+			retVal = 1;
+		}
+	}
+	return retVal;
+}
 
+/*
+ * Function: sleepBuiltin
+ * ----------------------------
+ *   Built in sleep seconds...: sleeps for the sum of its args, which may be fractions and have an
+ *   s, m, h or d suffix. The shell ignores SIGINT, so it is waited for with waitInterruptible to
+ *   let ^C interrupt the sleep like it would kill an external sleep. Events, like background
+ *   output, are still handled while sleeping.
+ *
+ *   command: a pointer to the command struct
+ *
+ *	 returns: 0 if successful; 1 if an arg is invalid; builtinSignal is set if interrupted
+ */
+int sleepBuiltin(command_t* command) {
+	double seconds = 0;
 	for (int i = 0; i < command->numArgs; i++) {
-		printf("Arg %d: %s\n", i, command->args[i]);
-		fflush(stdout);
+		char* end;
+		double value = strtod(command->args[i], &end);
+		double unit = *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 1;
+		if (end == command->args[i] || value < 0 || (*end != '\0' && (strchr("smhd", *end) == NULL || end[1] != '\0'))) {
+			fprintf(stderr, "sleep: invalid time interval '%s'\n", command->args[i]);
+			return 1;
+		}
+		seconds += value * unit;
 	}
-	
-	if (command->inputFile) {
-		printf("Input File: %s\n", command->inputFile);
-		fflush(stdout);
+	if (command->numArgs == 0) {
+		fprintf(stderr, "sleep: missing operand\n");
+		return 1;
 	}
-	else {
-		printf("No input file.\n");
-		fflush(stdout);
+
+	struct timespec deadline, current;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)seconds;
+	deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
 
-	if (command->outputFile) {
-		printf("Output File: %s\n", command->outputFile);
-		fflush(stdout);
+	sigset_t oldMask;
+	int intFd = openInterruptFd(&oldMask);
+	while (true) {
+		clock_gettime(CLOCK_MONOTONIC, &current);
+		double remaining = elapsedSeconds(&current, &deadline);
+		if (remaining <= 0) {
+			break;
+		}
+		struct timespec timeout = { (time_t)remaining, (long)((remaining - (time_t)remaining) * 1e9) };
+		// an early return (an event, or EINTR for SIGTSTP) just means the remaining time is recomputed
+		if (waitInterruptible(intFd, &timeout)) {
+			builtinSignal = SIGINT;
+			break;
+		}
 	}
-	else {
-		printf("No output file.\n");
-		fflush(stdout);
+	closeInterruptFd(intFd, &oldMask);
+	return 0;
+}
+
+/*
+ * Function: initBuiltins
+ * ----------------------------
+ *   Fills the built in hash table, hashing names with hashString and probing linearly.
+ */
+void initBuiltins(void) {
+	static const builtin_t builtins[] = {
+		{ EXIT_CMD, exitShell, 0 },
+		{ CD_CMD, changeDirectory, 0 },
+		{ STATUS_CMD, showStatus, 0 },
+		{ LAUNCHER_CMD, setLauncher, 0 },
+		{ HASH_CMD, hashCommands, 0 },
+		{ PARALLEL_CMD, runParallel, 0 },
+		{ JOBS_CMD, jobsBuiltin, 0 },
+		{ TRACE_CMD, traceBuiltin, 0 },
+		{ TIME_CMD, timeCommand, BUILTIN_PREFIX },
+		{ BATCH_CMD, runBatch, BUILTIN_PREFIX },
+		{ "echo", echoBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "printf", printfBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "true", trueBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "false", falseBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "test", testBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ TEST_BRACKET_CMD, testBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "pwd", pwdBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "kill", killBuiltin, BUILTIN_COMMAND | BUILTIN_STAGE },
+		{ "sleep", sleepBuiltin, BUILTIN_COMMAND },
+	};
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		size_t slot = hashString(builtins[i].name) & (BUILTIN_TABLE_SIZE - 1);
+		while (builtinTable[slot].name != NULL) {
+			slot = (slot + 1) & (BUILTIN_TABLE_SIZE - 1);
+		}
+		builtinTable[slot] = builtins[i];
 	}
 }
 
 /*
- * Function: initCommand
+ * Function: findBuiltin
  * ----------------------------
- *   Initializes a given command struct with default values.
+ *   Looks up a built in by name.
  *
- *   command: a pointer to the command struct to print out
+ *   name: the command name
+ *
+ *   returns: a pointer to the built in, or NULL if the command is not built in
  */
-void initCommand(command_t* command) {
-	command->command = NULL;
-	command->numArgs = 0;
-	command->args = 0;
-	command->inputFile = NULL;
-	command->outputFile = NULL;
-	command->isBackground = false;
+const builtin_t* findBuiltin(const char* name) {
+	size_t slot = hashString(name) & (BUILTIN_TABLE_SIZE - 1);
+	while (builtinTable[slot].name != NULL) {
+		if (strcmp(builtinTable[slot].name, name) == 0) {
+			return &builtinTable[slot];
+		}
+		slot = (slot + 1) & (BUILTIN_TABLE_SIZE - 1);
+	}
+	return NULL;
 }
 
 /*
- * Function: destroyCommand
+ * Function: swapFd
  * ----------------------------
- *   Frees dynamically allocated memory associated with given command structure
+ *   Moves an fd onto a standard fd of the shell, keeping a copy of the original.
  *
- *   command: a pointer to the command structure to destroy
+ *   fd: the fd to install, which is closed
+ *   target: the standard fd to replace
+ *
+ *   returns: a close-on-exec copy of the original target, or -1 if it could not be saved (the error
+ *   is printed and fd is closed)
  */
-void destroyCommand(command_t* command) {
-	if (command->command) {
-		free(command->command);
-	}
-	if (command->args) {
-		for (int i = 0; i < command->numArgs; i++) {
-			free(command->args[i]);
+int swapFd(int fd, int target) {
+	int saved = fcntl(target, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+	if (saved == -1 || dup2(fd, target) == -1) {
+		perror("dup2");
+		if (saved != -1) {
+			close(saved);
 		}
-		free(command->args);
+		saved = -1;
 	}
-	if (command->inputFile) {
-		free(command->inputFile);
+	close(fd);
+	return saved;
+}
+
+/*
+ * Function: runBuiltin
+ * ----------------------------
+ *   Runs a built in in the shell process. Its < and > redirections are applied by swapping the
+ *   shell's own stdin/stdout for the duration of the call. Built ins standing in for commands set
+ *   the foreground status like the command would.
+ *
+ *   builtin: a pointer to the built in
+ *   command: a pointer to the command struct
+ *
+ *   returns: the built in's return value, or 1 if its redirections failed
+ */
+int runBuiltin(const builtin_t* builtin, command_t* command) {
+	int savedIn = -1, savedOut = -1;
+	int retVal = 1;
+	if (builtin->flags & BUILTIN_PREFIX) {
+		return builtin->fn(command);
 	}
-	if (command->outputFile) {
-		free(command->outputFile);
+
+	int inFd, outFd;
+	if (openRedirections(command, false, false, &inFd, &outFd) == 0) {
+		// anything buffered belongs to the shell's stdout, not the file
+		fflush(stdout);
+		if (inFd != -1) {
+			savedIn = swapFd(inFd, STDIN_FILENO);
+		}
+		if (outFd != -1) {
+			savedOut = swapFd(outFd, STDOUT_FILENO);
+		}
+		if ((inFd == -1 || savedIn != -1) && (outFd == -1 || savedOut != -1)) {
+			builtinSignal = 0;
+			retVal = builtin->fn(command);
+		}
+		fflush(stdout);
+		if (savedIn != -1) {
+			dup2(savedIn, STDIN_FILENO);
+			close(savedIn);
+		}
+		if (savedOut != -1) {
+			dup2(savedOut, STDOUT_FILENO);
+			close(savedOut);
+		}
+	}
+
+	if (builtin->flags & BUILTIN_COMMAND) {
+		if (builtinSignal != 0) {
+			foregroundStatus = W_EXITCODE(0, builtinSignal);
+			printf("terminated by signal %d\n", builtinSignal);
+			fflush(stdout);
+			builtinSignal = 0;
+		}
+		else {
+			foregroundStatus = W_EXITCODE(retVal & 0xff, 0);
+		}
+		statusInitialized = true;
 	}
-	free(command);
+	return retVal;
 }
 
 /*
- * Function: startShell
+ * Function: initShell
  * ----------------------------
- *   Starts the shell
+ *   Sets up what every mode of the shell needs: signal handling, the event loop, $$ and the launch
+ *   backend.
+ *
+ *   returns: 0 if successful; -1 otherwise (the error is printed)
  */
-int startShell(void) {
-	bool exitBool = false;
-	bool statusInitialized = false;
+int initShell(void) {
+	initBuiltins();
 
 	// signal handling
-	struct sigaction SIGINT_action = { { 0 } }, SIGTSTP_action = { { 0 } }, SIGCHLD_action = { { 0 } };
+	struct sigaction SIGINT_action = { { 0 } }, SIGTSTP_action = { { 0 } };
 
 	// ignore SIGINT by default
 	SIGINT_action.sa_handler = SIG_IGN;
@@ -625,211 +7266,345 @@ int startShell(void) {
 	SIGTSTP_action.sa_flags = SA_RESTART;
 	sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
-	// default SIGCHLD handler
-	SIGCHLD_action.sa_sigaction = handle_SIGCHLD;
-	sigemptyset(&SIGCHLD_action.sa_mask);
-	SIGCHLD_action.sa_flags = SA_RESTART | SA_SIGINFO | SA_NOCLDSTOP;
-	sigaction(SIGCHLD, &SIGCHLD_action, NULL);
-
-	while (!exitBool) {
-		char* buffPtr = NULL;
-		size_t size = 0;
-		char* currLine = NULL;
-
-		currLine = getCommand(&buffPtr, &size);
-		command_t* currCommand = createCommand(currLine);
-		if (strcmp(currCommand->command, EXIT_CMD) == 0) {
-			exitBool = true;
-			// kill any remaining child processes
-			llNode* tmp = head;
-			while (tmp != NULL) {
-				kill(tmp->pid, SIGKILL);
-				tmp = tmp->next;
-			}
-		}
-		else if (strcmp(currCommand->command, CD_CMD) == 0) {
-			// changeDirectory built in
-			changeDirectory(currCommand);
-		}
-		else if (strcmp(currCommand->command, STATUS_CMD) == 0) {
-			// status variable has not been initialized
-			if (statusInitialized == false) {
-				printf("exit status 0\n");
-				fflush(stdout);
-			}
-			else {
-				printStatus(status);
-				fflush(stdout);
-			}
-		}
-		else {
-			// spawn child process and divert command to exec()
-			// build newargv[] array, add a spot for the command and the terminating NULL pointer
-			int size = currCommand->numArgs + 2;
-			char* newargv[size];
-
-			// set null ptr terminator
-			newargv[size - 1] = NULL;
-			newargv[0] = currCommand->command;
+	// SIGCHLD is handled by the event loop
+	if (initEventLoop() == -1) {
+		return -1;
+	}
 
-			// set args
-			for (int i = 0; i < currCommand->numArgs; i++) {
-				newargv[i + 1] = currCommand->args[i];
-			}
+	shellPidLength = sprintf(shellPid, "%d", getpid());
 
-			// Fork a new process
-			pid_t spawnPid = fork();
+	// children start with no signals blocked
+	sigemptyset(&childSignalMask);
 
-			switch (spawnPid) {
-			case -1:
-				perror("Error");
-				exit(1);
-				break;
-			case 0:
-				// child process
-				// set SIGINT behavior if child process is foreground
-				if (!currCommand->isBackground || backgroundEnabled == false) {
-					SIGINT_action.sa_handler = SIG_DFL;
-					sigaction(SIGINT, &SIGINT_action, NULL);
-				}
-				// set SIGTSTP to be ignored for any child process
-				SIGTSTP_action.sa_handler = SIG_IGN;
-				sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-
-				// handle input/output redirection
-				if (currCommand->inputFile != NULL) {
-					// Open input file
-					int inputFD = open(currCommand->inputFile, O_RDONLY);
-					if (inputFD == -1) {
-						perror(currCommand->inputFile);
-						exit(1);
-					}
+	// pick the launch backend
+	char* launcherEnv = getenv(LAUNCHER_ENV);
+	if (launcherEnv != NULL && !parseLauncher(launcherEnv, &launcherBackend)) {
+		fprintf(stderr, "%s: unknown backend %s, using %s\n", LAUNCHER_ENV, launcherEnv, launcherName(launcherBackend));
+	}
+	// the zygote is forked while the shell is still small
+	if (launcherBackend == LAUNCHER_ZYGOTE && startZygote() == -1) {
+		launcherBackend = LAUNCHER_SPAWN;
+	}
 
-					// Redirect stdin to source file
-					int result = dup2(inputFD, 0);
-					if (result == -1) {
-						perror("Error");
-						exit(1);
-					}
+	char* traceEnv = getenv(TRACE_ENV);
+	if (traceEnv != NULL && traceEnv[0] != '\0') {
+		startTrace(traceEnv);
+	}
+	return 0;
+}
 
-					// close open file
-					if (close(inputFD) == -1) {
-						perror("Error");
-						exit(1);
-					}
-				}
-				// no input redirection specified, send to dev/null
-				else if (currCommand->isBackground && backgroundEnabled) {
-					int inputFD = open("/dev/null", O_RDONLY);
-					if (inputFD == -1) {
-						perror("/dev/null");
-						exit(1);
-					}
+/*
+ * Function: buildCommand
+ * ----------------------------
+ *   Builds the command of a simple command node, expanding its words: from its tokens, or by
+ *   scanning its line if it is a plain command line.
+ *
+ *   node: a pointer to the simple command
+ *
+ *   returns: the command, or NULL on a syntax error (the error is printed)
+ *
+ *   notes: a line is scanned in place, so a node with a line is built only once; the command is
+ *   destroyed with destroyCommand
+ */
+command_t* buildCommand(node_t* node) {
+	lexer_t lexer;
+	if (node->line != NULL) {
+		initLexer(&lexer, node->line);
+	}
+	else {
+		initReplay(&lexer, node->tokens, node->tokensEnd);
+	}
+	uint64_t expandStart = traceClock();
+	command_t* command = parseCommand(&lexer);
+	traceRecord("expand", "shell", 0, expandStart);
+	return command;
+}
 
-					// Redirect stdin to source file
-					int result = dup2(inputFD, 0);
-					if (result == -1) {
-						perror("Error");
-						exit(1);
-					}
+/*
+ * Function: buildLine
+ * ----------------------------
+ *   Parses a single line and builds the command of every simple command at the top of its list,
+ *   which is all the shell does with a line before running it. bench/parser times this.
+ *
+ *   line: the command line, which is modified
+ *
+ *   returns: the number of commands built, or -1 on a syntax error (the error is printed)
+ */
+int buildLine(char* line) {
+	parser_t parser;
+	initParser(&parser, NULL);
+	initLexer(&parser.lexer, line);
+	node_t* list = parseLine(&parser);
+	int numBuilt = 0;
+	for (node_t* node = list; node != NULL; node = node->next) {
+		if (node->kind == NODE_COMMAND) {
+			command_t* command = buildCommand(node);
+			numBuilt += command != NULL;
+			destroyCommand(command);
+		}
+	}
+	arenaReset(&parseArena);
+	return parser.failed ? -1 : numBuilt;
+}
 
-					// close open file
-					if (close(inputFD) == -1) {
-						perror("Error");
-						exit(1);
-					}
-				}
-				if (currCommand->outputFile != NULL) {
-					// Open output file
-					int outputFD = open(currCommand->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-					if (outputFD == -1) {
-						perror(currCommand->outputFile);
-						exit(1);
-					}
+/*
+ * Function: runSimple
+ * ----------------------------
+ *   Builds a simple command with buildCommand and runs it: a built in in the shell process,
+ *   anything else as a pipeline.
+ *
+ *   node: a pointer to the simple command
+ *
+ *   returns: the wait status of the command, which conditions test: the foreground status for
+ *   pipelines and built ins standing in for commands, the return value of other built ins, 0 for
+ *   a background command and 1 on a syntax error
+ */
+int runSimple(node_t* node) {
+	command_t* command = buildCommand(node);
+	int status = W_EXITCODE(command != NULL ? 0 : 1, 0);
+	// syntax error or nothing but redirections
+	if (command == NULL || command->command == NULL) {
+		destroyCommand(command);
+		return status;
+	}
+	uint64_t runStart = traceClock();
+	const builtin_t* builtin = findBuiltin(command->command);
+	// built ins only run on their own, every stage of a pipeline is a process; built ins standing
+	// in for commands run the command in the background
+	if (builtin != NULL && ((builtin->flags & BUILTIN_PREFIX) || (command->next == NULL
+		&& !((builtin->flags & BUILTIN_COMMAND) && command->isBackground && backgroundEnabled)))) {
+		int retVal = runBuiltin(builtin, command);
+		// prefixes set the foreground status of the command they ran
+		status = builtin->flags & (BUILTIN_COMMAND | BUILTIN_PREFIX) ? foregroundStatus : W_EXITCODE(retVal & 0xff, 0);
+		traceRecord(builtin->name, "builtin", 0, runStart);
+	}
+	else {
+		// spawn child processes and divert commands to exec()
+		runPipeline(command);
+		status = command->isBackground && backgroundEnabled ? W_EXITCODE(0, 0) : foregroundStatus;
+		traceRecord("pipeline", "shell", 0, runStart);
+	}
+	destroyCommand(command);
+	// ^C stops the rest of the list as well
+	if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+		listInterrupted = true;
+	}
+	return status;
+}
 
-					// Redirect stdin to source file
-					int result = dup2(outputFD, 1);
-					if (result == -1) {
-						perror("Error");
-						exit(1);
-					}
+/*
+ * Function: evalList
+ * ----------------------------
+ *   Runs the commands of a list in order, short-circuiting && and ||, until one calls exit or is
+ *   interrupted by ^C.
+ *
+ *   list: the first command of the list
+ *
+ *   returns: the wait status of the last command run, 0 if none ran
+ */
+int evalList(node_t* list) {
+	int status = W_EXITCODE(0, 0);
+	for (node_t* node = list; node != NULL && !exitRequested && !listInterrupted; node = node->next) {
+		// && runs a command only after success and || only after failure, a skipped one leaves the
+		// status as it is
+		if ((node->join == TOKEN_AND && exitCode(status) != 0) || (node->join == TOKEN_OR && exitCode(status) == 0)) {
+			continue;
+		}
+		status = evalNode(node);
+	}
+	return status;
+}
 
-					// close open file
-					if (close(outputFD) == -1) {
-						perror("Error");
-						exit(1);
-					}
-				}
-				// no output redirection specified, send to dev/null
-				else if (currCommand->isBackground && backgroundEnabled) {
-					int outputFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-					if (outputFD == -1) {
-						perror("/dev/null");
-						exit(1);
-					}
+/*
+ * Function: evalNode
+ * ----------------------------
+ *   Runs one command of a list. The condition of an if is true if its wait status is an exit
+ *   value of 0.
+ *
+ *   node: a pointer to the command
+ *
+ *   returns: the wait status of the command, 0 for an if that ran no branch
+ */
+int evalNode(node_t* node) {
+	switch (node->kind) {
+	case NODE_COMMAND:
+		return runSimple(node);
+	case NODE_IF: {
+		int status = evalList(node->cond);
+		if (exitRequested || listInterrupted) {
+			return status;
+		}
+		if (exitCode(status) == 0) {
+			return evalList(node->body);
+		}
+		return node->elseBody != NULL ? evalList(node->elseBody) : W_EXITCODE(0, 0);
+	}
+	default:
+		return evalLoop(node);
+	}
+}
 
-					// Redirect stdout to source file
-					int result = dup2(outputFD, 1);
-					if (result == -1) {
-						perror("Error");
-						exit(1);
-					}
+/*
+ * Function: loopInterrupted
+ * ----------------------------
+ *   Checks before each iteration of a loop whether it has to stop: exit was called, or ^C was
+ *   pressed. ^C while a child runs stops the child and the list with it; ^C between commands
+ *   (a loop of built ins never forks) is read from the outermost loop's signalfd, and is reported
+ *   like a built in interrupted by SIGINT.
+ *
+ *   returns: true if the loop has to stop; false otherwise
+ */
+bool loopInterrupted(void) {
+	struct signalfd_siginfo info;
+	if (!listInterrupted && loopIntFd != -1 && read(loopIntFd, &info, sizeof(info)) == sizeof(info)) {
+		listInterrupted = true;
+		foregroundStatus = W_EXITCODE(0, SIGINT);
+		statusInitialized = true;
+		printf("terminated by signal %d\n", SIGINT);
+		fflush(stdout);
+	}
+	return listInterrupted || exitRequested;
+}
 
-					// close open file
-					if (close(outputFD) == -1) {
-						perror("Error");
-						exit(1);
-					}
-				}
-				// Replace the current program with command->command
-				execvp(newargv[0], newargv);
-				// exec only returns if there is an error
-				perror(currCommand->command);
-				exit(1);
-				break;
-			default:
-				// parent process
-				// background
-				if (currCommand->isBackground && backgroundEnabled) {
-					printf("background pid is %d\n", spawnPid);
-					fflush(stdout);
-					// add child's pid to linked list
-					head = addToChildList(head, spawnPid);
-				} 
-				// foreground, wait to complete
-				else {
-					spawnPid = waitpid(spawnPid, &status, 0);
-					// check for signal termination
-					if (WIFSIGNALED(status)) {
-						printf("terminated by signal %d\n", WTERMSIG(status));
-						fflush(stdout);
-					}
-				}
-				// set status to initialized
-				statusInitialized = 1;
+/*
+ * Function: evalLoop
+ * ----------------------------
+ *   Runs a while loop while its condition is true, or a for loop once per word with the variable
+ *   set to the word. The words are expanded (globs included) when the loop starts, and the
+ *   variable is an environment variable, as $NAME reads those. The outermost loop blocks SIGINT
+ *   and polls a signalfd for it, so ^C stops a loop that runs only built ins.
+ *
+ *   node: a pointer to the loop
+ *
+ *   returns: the wait status of the last command of the body run, 0 if it never ran
+ */
+int evalLoop(node_t* node) {
+	sigset_t oldMask;
+	bool outermost = loopIntFd == -1;
+	if (outermost) {
+		loopIntFd = openInterruptFd(&oldMask);
+	}
+	int status = W_EXITCODE(0, 0);
+	if (node->kind == NODE_WHILE) {
+		while (!loopInterrupted()) {
+			int cond = evalList(node->cond);
+			if (exitCode(cond) != 0 || exitRequested || listInterrupted) {
 				break;
 			}
+			status = evalList(node->body);
+		}
+	}
+	else {
+		// the body resets the command arena, so the words are copied out of it first
+		lexer_t lexer;
+		initReplay(&lexer, node->tokens, node->tokensEnd);
+		command_t* words = parseCommand(&lexer);
+		int numWords = words != NULL && words->command != NULL ? words->numArgs + 1 : 0;
+		size_t size = sizeof(char*) * numWords;
+		for (int i = 0; i < numWords; i++) {
+			size += strlen(words->argv[i]) + 1;
+		}
+		char** values = malloc(size ? size : 1);
+		char* text = (char*)(values + numWords);
+		for (int i = 0; i < numWords; i++) {
+			size_t len = strlen(words->argv[i]) + 1;
+			values[i] = memcpy(text, words->argv[i], len);
+			text += len;
+		}
+		destroyCommand(words);
+		for (int i = 0; i < numWords && !loopInterrupted(); i++) {
+			setenv(node->name, values[i], 1);
+			status = evalList(node->body);
+		}
+		free(values);
+	}
+	if (outermost) {
+		closeInterruptFd(loopIntFd, &oldMask);
+		loopIntFd = -1;
+	}
+	return status;
+}
+
+/*
+ * Function: startShell
+ * ----------------------------
+ *   Starts the shell
+ *
+ *   reader: the line reader commands are read from (stdin or a mapped script)
+ */
+int startShell(lineReader_t* reader) {
+	shellReader = reader;
+	if (initShell() == -1) {
+		return 1;
+	}
+
+	while (!exitRequested) {
+		uint64_t readStart = traceClock();
+		// a parsed script replays the tokens of its lines instead
+		parser_t parser;
+		initParser(&parser, reader);
+		if (!nextParserLine(&parser)) {
+			// EOF, leave any background children running
+			break;
 		}
-		free(buffPtr);
-		destroyCommand(currCommand);
+		traceCommand++;
+		traceRecord("read", "shell", 0, readStart);
+		uint64_t parseStart = traceClock();
+		node_t* list = parseLine(&parser);
+		traceRecord("parse", "shell", 0, parseStart);
+		listInterrupted = false;
+		evalList(list);
+		arenaReset(&parseArena);
+		hereDocUsed = 0;
 	}
-	destroyChildList(head);
+	if (numTraceEvents > 0) {
+		writeTrace(traceFile);
+	}
+	flushNotifications();
+	destroyArena(&commandArena);
+	destroyArena(&parseArena);
+	free(parseScratch);
+	free(hereDocBuf);
 	return 0;
 }
 
 /*
 * To compile: gcc --std=c99 -Wall -g -o smallsh smallsh.c
+* Define SMALLSH_NO_MAIN to link the shell into another program, like bench/parser.c
 */
+#ifndef SMALLSH_NO_MAIN
 int main(int argc, char* argv[])
 {
-	if (argc > 1)
+	lineReader_t reader;
+	// server mode: serve command lines from clients of a Unix domain socket
+	if (argc == 3 && strcmp(argv[1], SERVER_OPTION) == 0)
+	{
+		interactive = false;
+		return runServer(argv[2]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (argc > 2)
 	{
-		printf("No arguments needed.\n");
-		printf("Example usage: ./smallsh\n");
+		printf("Too many arguments.\n");
+		printf("Example usage: ./smallsh [script] or ./smallsh --server SOCKET\n");
 		return EXIT_FAILURE;
 	}
-	startShell();
-	return EXIT_SUCCESS;
+	// script mode: run the commands of a parsed (and cached) script without prompting
+	if (argc == 2)
+	{
+		if (openScript(&reader, argv[1]) == -1)
+		{
+			return EXIT_FAILURE;
+		}
+		interactive = false;
+	}
+	// read stdin, prompting only if it is a terminal
+	else
+	{
+		initReader(&reader, STDIN_FILENO);
+		interactive = isatty(STDIN_FILENO);
+	}
+	int retVal = startShell(&reader);
+	destroyReader(&reader);
+	return retVal == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-
-
+#endif
\ No newline at end of file
@@ -1,23 +1,277 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 
+typedef struct arena_t arena_t;
+typedef struct builtin_t builtin_t;
+typedef struct client_t client_t;
 typedef struct command_t command_t;
-typedef struct llNode llNode;
-llNode* addToChildList(llNode* head, pid_t childPid);
+typedef struct dirListing_t dirListing_t;
+typedef struct globMatcher_t globMatcher_t;
+typedef struct job_t job_t;
+typedef struct jobOutput_t jobOutput_t;
+typedef struct launch_t launch_t;
+typedef struct lineReader_t lineReader_t;
+typedef struct node_t node_t;
+typedef struct parser_t parser_t;
+typedef struct pathEntry_t pathEntry_t;
+typedef struct scriptHeader_t scriptHeader_t;
+typedef enum launcher_t {
+	LAUNCHER_FORK,
+	LAUNCHER_VFORK,
+	LAUNCHER_SPAWN,
+	LAUNCHER_ZYGOTE
+} launcher_t;
+typedef enum tokenKind_t {
+	TOKEN_END,
+	TOKEN_WORD,
+	TOKEN_INPUT,
+	TOKEN_OUTPUT,
+	TOKEN_BACKGROUND,
+	TOKEN_PIPE,
+	TOKEN_SEMICOLON,
+	TOKEN_AND,
+	TOKEN_OR,
+	TOKEN_HEREDOC,
+	TOKEN_HERESTRING,
+	TOKEN_ERROR,
+	TOKEN_NEWLINE // end of a line inside a compound command, made by the parser
+} tokenKind_t;
+typedef enum nodeKind_t {
+	NODE_COMMAND,
+	NODE_IF,
+	NODE_FOR,
+	NODE_WHILE
+} nodeKind_t;
+typedef struct lexer_t lexer_t;
+typedef struct token_t token_t;
+typedef struct traceChild_t traceChild_t;
+typedef struct traceEvent_t traceEvent_t;
+typedef struct usage_t usage_t;
+typedef int (*stageFn_t)(command_t* command);
+typedef int (*builtinFn_t)(command_t* command);
+
+// server mode wire format, shared with clients
+#define SERVER_STDIN 1 // the request passes the command's stdin
+#define SERVER_STDOUT 2 // ... its stdout
+#define SERVER_STDERR 4 // ... its stderr (passed fds are in stdin, stdout, stderr order)
+#define SERVER_CAPTURE 8 // stdout and stderr not passed are captured and returned in the reply
+#define SERVER_REQUEST_SIZE 65536 // largest request, header included
+#define SERVER_CAPTURE_SIZE 32768 // bytes of each of stdout and stderr returned
+
+/* Request header, followed by the command line */
+typedef struct serverRequest_t {
+	uint32_t flags; // SERVER_* flags
+} serverRequest_t;
+
+/* Reply header, followed by outLength bytes of stdout and errLength bytes of stderr */
+typedef struct serverReply_t {
+	int32_t status; // wait status of the last stage
+	bool started; // false if the command could not be started (status is then an exit value of 1)
+	bool truncated; // captured output was cut at SERVER_CAPTURE_SIZE
+	double seconds; // wall clock time
+	struct rusage ru; // summed over the stages, ru_maxrss is the largest
+	uint32_t outLength;
+	uint32_t errLength;
+} serverReply_t;
+
+void acceptClients(void);
+int addJob(pid_t childPid, bool background, bool lastStage, int parallelJob);
+void addUsage(usage_t* usage, const struct rusage* ru);
+void* arenaAlloc(arena_t* arena, size_t size);
+void arenaReset(arena_t* arena);
+void arenaShrink(arena_t* arena, void* ptr, size_t size);
+char* arenaStrndup(arena_t* arena, const char* s, size_t n);
+size_t bufferToken(parser_t* parser, size_t size);
+command_t* buildCommand(node_t* node);
+int buildLine(char* line);
+int catStage(command_t* command);
+void compileGlob(const char* pattern, size_t len, globMatcher_t* matcher);
+int compareStrings(const void* a, const void* b);
 int changeDirectory(command_t* command);
+void clientEvent(int fd, uint32_t events);
+void closeClient(client_t* client);
+void closeInterruptFd(int intFd, const sigset_t* oldMask);
+void closeJobOutput(jobOutput_t* output, bool flush);
+int combineStatus(int combined, int status);
+size_t copyExpansion(char* out, const char* value, size_t len, bool pattern);
+int copyFd(int inFd, int outFd);
+int countStages(command_t* pipeline);
 command_t* createCommand(char* line);
-void destroyChildList(llNode* head);
+void destroyArena(arena_t* arena);
 void destroyCommand(command_t* command);
-char* expandCommand(char* commandStr, char* expStrFrom, char* expStrTo);
-char* getCommand(char** bufPtr, size_t* size);
-void handle_SIGCHLD(int signo, siginfo_t* si, void* context);
+void destroyReader(lineReader_t* reader);
+void dispatchEvents(int timeout);
+void drainJobOutput(jobOutput_t* output);
+int echoBuiltin(command_t* command);
+double elapsedSeconds(const struct timespec* start, const struct timespec* end);
+size_t encodeToken(char* out, const token_t* token);
+int evalList(node_t* list);
+int evalLoop(node_t* node);
+int evalNode(node_t* node);
+int evalTest(char** args, int numArgs);
+int exitCode(int status);
+char* expandCommand(const char* word, size_t len);
+char* expandHereDoc(const char* body, size_t len, size_t* newLen);
+void expandGlob(command_t* command, token_t* token);
+char* expandPattern(const char* word, size_t len);
+size_t expandVariable(const char* ref, const char* end, const char** value, size_t* valueLen, char* numBuf);
+size_t execSize(const char* s);
+size_t expandWord(const char* word, size_t len, bool quoted, bool pattern, char* out);
+void execResolved(const pathEntry_t* resolved, char* argv[]);
+int exitShell(command_t* command);
+void fillReader(lineReader_t* reader);
+void finishClientStage(client_t* client, bool lastStage, int status, const struct rusage* ru);
+int falseBuiltin(command_t* command);
+job_t* findJob(pid_t childPid);
+jobOutput_t* findJobOutput(pid_t pid);
+jobOutput_t* findOutputFd(int fd);
+pathEntry_t* findPathEntry(const char* name);
+const builtin_t* findBuiltin(const char* name);
+void finishParallelJob(int parallelJob, pid_t pid, int status);
+void flushNotifications(void);
+void followJobOutput(jobOutput_t* output);
+pid_t forkLaunch(const launch_t* launch);
+void forkSlot(int control);
+size_t formatNumber(char* out, long value);
+size_t formatStatus(char* out, int status);
+char* getCommand(lineReader_t* reader);
+bool globMatch(const globMatcher_t* matcher, const char* name, size_t len);
+bool hasGlobChars(const char* pattern, size_t len);
+int hashCommands(command_t* command);
+uint32_t hashString(const char* s);
 void handle_SIGTSTP(int signo);
+void initBuiltins(void);
 void initCommand(command_t* command);
+int initEventLoop(void);
+void initLexer(lexer_t* lexer, char* line);
+void initParser(parser_t* parser, lineReader_t* reader);
+void initReader(lineReader_t* reader, int fd);
+void initReplay(lexer_t* lexer, char* tokens, char* end);
+int initShell(void);
 int isEmptyString(char* s);
+int jobsBuiltin(command_t* command);
+bool isOperatorChar(char c);
+bool isKeyword(parser_t* parser, const char* keyword);
+bool isListEnd(parser_t* parser);
+bool isPlainLine(const char* line);
+size_t jobSlot(pid_t pid);
+int killBuiltin(command_t* command);
+dirListing_t* listDirectory(const char* path);
+void killJobs(int signo);
+tokenKind_t lexNext(lexer_t* lexer, token_t* token);
+pid_t launchCommand(command_t* command, bool background, int pipeIn, int pipeOut, pid_t pgid);
+const char* launcherName(launcher_t backend);
+void loadPathDirs(const char* path);
+scriptHeader_t* loadScript(const char* cachePath, const struct stat* st, const char* sourcePath);
+pathEntry_t* lookupCommandPath(const char* name);
+bool loopInterrupted(void);
 int main(int argc, char* argv[]);
-void printChildList(llNode* head);
+int mapReader(lineReader_t* reader, const char* path, struct stat* st);
+node_t* newNode(nodeKind_t kind);
+char* nextLine(lineReader_t* reader);
+bool nextScriptLine(lineReader_t* reader, lexer_t* lexer);
+bool nextParserLine(parser_t* parser);
+void notifyBackgroundDone(pid_t pid, int status);
+int openDevNull(void);
+int openHereDoc(const char* body, size_t len);
+int openInterruptFd(sigset_t* oldMask);
+jobOutput_t* openJobOutput(int* captureFd);
+int openRedirections(command_t* command, bool nullIn, bool nullOut, int* inFd, int* outFd);
+int openScript(lineReader_t* reader, const char* path);
+command_t* parseCommand(lexer_t* lexer);
+node_t* parseBody(parser_t* parser);
+node_t* parseCompound(parser_t* parser);
+node_t* parseFor(parser_t* parser);
+node_t* parseIf(parser_t* parser, bool elif);
+node_t* parseLine(parser_t* parser);
+node_t* parseList(parser_t* parser);
+bool parseLauncher(const char* name, launcher_t* backend);
+int parseSignal(const char* name);
+scriptHeader_t* parseScript(lineReader_t* reader, const struct stat* st, const char* sourcePath);
+node_t* parseSimple(parser_t* parser);
+node_t* parseWhile(parser_t* parser);
+bool parserExpect(parser_t* parser, const char* keyword);
+bool pathDirsChanged(int count);
+tokenKind_t peekToken(parser_t* parser);
 void printCommand(command_t* command);
+size_t printEscape(const char* s, bool inArg, bool* stop);
+int printfBuiltin(command_t* command);
+bool printfNumber(const char* arg, long double* value);
+void printJobTable(void);
 void printStatus(int status);
-llNode* removeFromChildList(llNode* head, pid_t childPid);
-int startShell(void);
\ No newline at end of file
+void printUsage(FILE* stream, const usage_t* usage);
+void pushArg(command_t* command, char* arg);
+int pwdBuiltin(command_t* command);
+void queueNotification(const char* message, size_t len);
+void reapChildren(void);
+void readCapture(client_t* client, int stream);
+void readHereDoc(lineReader_t* reader, lexer_t* lexer, token_t* token);
+char* readLine(lineReader_t* reader);
+void readRequest(client_t* client);
+void receiveSlots(void);
+ssize_t recvFds(int sock, void* data, size_t len, int* fds, int maxFds, int* numFds, int flags);
+bool removeJob(pid_t childPid);
+tokenKind_t replayToken(lexer_t* lexer, token_t* token);
+void resetPathCache(void);
+void requestSlots(void);
+int runBatch(command_t* command);
+int runBuiltin(const builtin_t* builtin, command_t* command);
+int runParallel(command_t* command);
+void runPipeline(command_t* pipeline);
+int runServer(const char* path);
+int runSimple(node_t* node);
+void runSlot(int sock);
+void saveTokens(node_t* node, size_t size);
+char* scriptCachePath(const char* path, char** sourcePath);
+uint32_t scriptChecksum(const scriptHeader_t* script);
+int sendFds(int sock, const void* data, size_t len, const int* fds, int numFds);
+int setLauncher(command_t* command);
+void showPrompt(void);
+void skipNewlines(parser_t* parser);
+int showStatus(command_t* command);
+int sleepBuiltin(command_t* command);
+int spliceAll(int inFd, int outFd, size_t len);
+pid_t spawnLaunch(const launch_t* launch);
+stageFn_t stageBuiltin(command_t* command);
+int startPipeline(command_t* pipeline, bool background, int parallelJob, int lastOut, pid_t* pids, pid_t* lastPid);
+int startShell(lineReader_t* reader);
+int startTrace(const char* file);
+void startUsage(usage_t* usage);
+int startZygote(void);
+void stopZygote(void);
+void storeScript(const scriptHeader_t* script, const char* cachePath);
+int swapFd(int fd, int target);
+void syntaxError(parser_t* parser, const char* expected);
+int teeStage(command_t* command);
+int testBinary(const char* left, const char* op, const char* right);
+int testBuiltin(command_t* command);
+bool testInteger(const char* arg, long long* value);
+int testUnary(const char* op, const char* arg);
+int timeCommand(command_t* command);
+int traceBuiltin(command_t* command);
+void traceChild(const job_t* job);
+traceChild_t* traceChildStamp(void);
+uint64_t traceClock(void);
+void traceRecord(const char* name, const char* category, pid_t tid, uint64_t start);
+void traceSpan(const char* name, const char* category, pid_t tid, unsigned long command, uint64_t start, uint64_t end);
+int trueBuiltin(command_t* command);
+size_t unquoteWord(char* word, size_t len);
+pid_t vforkLaunch(const launch_t* launch);
+void waitForeground(const pid_t* pids, int numPids);
+void waitForInput(int fd);
+bool waitInterruptible(int intFd, const struct timespec* timeout);
+char* wordText(token_t* token);
+int writeAll(int fd, const char* buf, size_t len);
+int writeTrace(const char* file);
+uint64_t writeJobOutput(const jobOutput_t* output, int fd, uint64_t from);
+pid_t zygoteLaunch(const launch_t* launch);
+void zygoteMain(int control);
+bool zygoteSlotReady(void);
\ No newline at end of file